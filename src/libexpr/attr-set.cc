@@ -7,6 +7,14 @@
 namespace nix {
 
 
+unsigned long nrAttrLookups = 0;
+unsigned long nrAttrProbes = 0;
+unsigned long nrAttrHashIndexes = 0;
+unsigned long nrLayeredSets = 0;
+unsigned long nrLayeredSetsFlattened = 0;
+unsigned long nrLayeredValuesCopied = 0;
+
+
 /* Allocate a new array of attributes for an attribute set with a specific
    capacity. The space is implicitly reserved after the Bindings
    structure. */
@@ -14,7 +22,37 @@ Bindings * EvalState::allocBindings(size_t capacity)
 {
     if (capacity > std::numeric_limits<Bindings::size_t>::max())
         throw Error("attribute set of size %d is too big", capacity);
-    return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity)) Bindings((Bindings::size_t) capacity);
+    if (profiler) profiler->recordAlloc(EvalProfiler::AllocKind::Bindings, Bindings::allocSize(capacity));
+    return new (allocBytes(Bindings::allocSize(capacity))) Bindings((Bindings::size_t) capacity);
+}
+
+
+/* Allocate the attributes of 'base // overlay' as a layered set
+   (see Bindings). Only the attributes of 'overlay' are copied. */
+Bindings * EvalState::allocLayeredBindings(Bindings & base, Bindings & overlay)
+{
+    uint32_t depth = base.isLayered() ? base.extra()->depth + 1 : 1;
+    if (depth > Bindings::maxLayerDepth) {
+        base.flatten();
+        depth = 1;
+    }
+
+    size_t size = base.size() + overlay.size();
+    for (auto & i : overlay)
+        if (base.find(i.name) != base.end()) size--;
+
+    Bindings * res = allocBindings(size);
+    assert(res->hasExtra());
+    res->size_ = size;
+    std::copy(overlay.begin(), overlay.end(), res->end() - overlay.size());
+    auto e = res->extra();
+    e->base = &base;
+    e->overlaySize = overlay.size();
+    e->depth = depth;
+
+    nrLayeredSets++;
+
+    return res;
 }
 
 
@@ -46,6 +84,69 @@ Value * EvalState::allocAttr(Value & vAttrs, const Symbol & name)
 void Bindings::sort()
 {
     std::sort(begin(), end());
+    invalidateHashIndex();
+}
+
+
+void Bindings::buildHashIndex()
+{
+    /* Use a load factor of at most 50%. */
+    uint32_t nrSlots = 1;
+    while (nrSlots < 2 * size_) nrSlots <<= 1;
+
+    auto index = extra();
+    index->slots = (uint32_t *) allocBytes(nrSlots * sizeof(uint32_t));
+    index->mask = nrSlots - 1;
+
+    for (size_t pos = 0; pos < size_; ++pos) {
+        uint32_t i = attrs[pos].name.hash() & index->mask;
+        while (index->slots[i]) i = (i + 1) & index->mask;
+        index->slots[i] = pos + 1;
+    }
+
+    nrAttrHashIndexes++;
+}
+
+
+Bindings::iterator Bindings::findLayered(const Symbol & name)
+{
+    auto e = extra();
+
+    nrAttrProbes++;
+    auto i = std::lower_bound(end() - e->overlaySize, end(), Attr(name, 0));
+    if (i != end() && i->name == name) return i;
+
+    auto j = e->base->find(name);
+    return j == e->base->end() ? end() : j;
+}
+
+
+void Bindings::flatten()
+{
+    auto e = extra();
+
+    /* Merge the base attributes into the front of the array. This
+       never overwrites an overlay attribute that hasn't been moved
+       yet, since the number of base attributes that end up in the
+       result is 'size_ - overlaySize'. */
+    auto overlay = end() - e->overlaySize;
+    auto out = &attrs[0];
+
+    for (auto & i : *e->base) {
+        while (overlay != end() && overlay->name < i.name) *out++ = *overlay++;
+        if (overlay != end() && overlay->name == i.name) continue;
+        *out++ = i;
+    }
+
+    while (overlay != end()) *out++ = *overlay++;
+
+    assert(out == end());
+
+    nrLayeredSetsFlattened++;
+    nrLayeredValuesCopied += size_ - e->overlaySize;
+
+    e->base = nullptr;
+    e->overlaySize = e->depth = 0;
 }
 
 
@@ -26,48 +26,168 @@ struct Attr
     }
 };
 
+/* Statistics on attribute lookups, reported by printStats(). */
+extern unsigned long nrAttrLookups, nrAttrProbes, nrAttrHashIndexes;
+
+/* Statistics on layered attribute sets, reported by printStats(). */
+extern unsigned long nrLayeredSets, nrLayeredSetsFlattened, nrLayeredValuesCopied;
+
 /* Bindings contains all the attributes of an attribute set. It is defined
    by its size and its capacity, the capacity being the number of Attr
    elements allocated after this structure, while the size corresponds to
-   the number of elements already inserted in this structure. */
+   the number of elements already inserted in this structure.
+
+   Lookups use binary search. Large attribute sets (such as Nixpkgs)
+   additionally reserve space for some Extra state after the Attr
+   elements. Once such a set has been searched often enough, an
+   open-addressing hash table mapping symbols to positions is built,
+   making further lookups O(1). The index is discarded when the set is
+   modified through push_back() or sort().
+
+   The Extra state is also used by the '//' operator to produce
+   layered sets: when a small set is merged into a large one, only
+   the attributes of the small set are copied (into the last slots of
+   the result), and lookups of other attributes are forwarded to the
+   large set. A layered set is flattened, i.e. the remaining
+   attributes are copied into place, when it is first iterated. */
 class Bindings
 {
 public:
     typedef uint32_t size_t;
 
+    typedef Attr * iterator;
+
+    /* Sets with at least this capacity get a hash index. */
+    static const size_t hashIndexMinCapacity = 32;
+
+    /* The number of lookups in a set after which its hash index is
+       built. */
+    static const uint32_t hashIndexMinLookups = 8;
+
+    /* The maximum length of a chain of layered sets. Longer chains
+       are flattened to keep lookups cheap. */
+    static const uint32_t maxLayerDepth = 8;
+
 private:
     size_t size_, capacity_;
     Attr attrs[0];
 
-    Bindings(size_t capacity) : size_(0), capacity_(capacity) { }
+    struct Extra
+    {
+        /* The hash index: positions in 'attrs' plus one, or 0 for
+           empty slots. */
+        uint32_t * slots;
+        uint32_t mask;
+        uint32_t lookups;
+
+        /* If non-null, this is a layered set of which only the last
+           'overlaySize' attributes have been filled in. The others
+           have to be taken from 'base'. */
+        Bindings * base;
+        uint32_t overlaySize;
+        uint32_t depth;
+    };
+
+    Bindings(size_t capacity) : size_(0), capacity_(capacity)
+    {
+        if (hasExtra()) *extra() = Extra{nullptr, 0, 0, nullptr, 0, 0};
+    }
+
     Bindings(const Bindings & bindings) = delete;
 
+    bool hasExtra() const { return capacity_ >= hashIndexMinCapacity; }
+
+    Extra * extra() const { return (Extra *) &attrs[capacity_]; }
+
+    bool isLayered() const { return hasExtra() && extra()->base; }
+
+    void invalidateHashIndex()
+    {
+        if (hasExtra()) {
+            auto e = extra();
+            e->slots = nullptr;
+            e->mask = e->lookups = 0;
+        }
+    }
+
+    void buildHashIndex();
+
+    /* Copy the attributes of the base of a layered set into place,
+       turning it into an ordinary set. */
+    void flatten();
+
+    iterator findLayered(const Symbol & name);
+
 public:
+    /* The number of bytes to allocate for a set of the given
+       capacity. */
+    static std::size_t allocSize(std::size_t capacity)
+    {
+        return sizeof(Bindings) + sizeof(Attr) * capacity
+            + (capacity >= hashIndexMinCapacity ? sizeof(Extra) : 0);
+    }
+
+    /* Whether 'base // overlay' should produce a layered set. */
+    static bool shouldLayer(const Bindings & base, const Bindings & overlay)
+    {
+        return base.size_ >= hashIndexMinCapacity && overlay.size_ <= base.size_ / 4;
+    }
+
     size_t size() const { return size_; }
 
     bool empty() const { return !size_; }
 
-    typedef Attr * iterator;
-
     void push_back(const Attr & attr)
     {
         assert(size_ < capacity_);
+        assert(!isLayered());
         attrs[size_++] = attr;
+        invalidateHashIndex();
     }
 
     iterator find(const Symbol & name)
     {
-        Attr key(name, 0);
-        iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return i;
+        nrAttrLookups++;
+
+        if (hasExtra()) {
+            auto e = extra();
+            if (e->base) return findLayered(name);
+            if (!e->slots && ++e->lookups >= hashIndexMinLookups)
+                buildHashIndex();
+            if (e->slots) {
+                for (uint32_t i = name.hash() & e->mask; ; i = (i + 1) & e->mask) {
+                    nrAttrProbes++;
+                    auto pos = e->slots[i];
+                    if (!pos) return end();
+                    if (attrs[pos - 1].name == name) return &attrs[pos - 1];
+                }
+            }
+        }
+
+        size_t lo = 0, hi = size_;
+        while (lo < hi) {
+            nrAttrProbes++;
+            size_t mid = lo + (hi - lo) / 2;
+            if (attrs[mid].name < name) lo = mid + 1; else hi = mid;
+        }
+        if (lo < size_ && attrs[lo].name == name) return &attrs[lo];
         return end();
     }
 
-    iterator begin() { return &attrs[0]; }
+    iterator begin()
+    {
+        if (isLayered()) flatten();
+        return &attrs[0];
+    }
+
+    /* This doesn't flatten layered sets: flattening happens in
+       place, so end() is the same before and after, and find() can
+       keep returning it for missing attributes. */
     iterator end() { return &attrs[size_]; }
 
     Attr & operator[](size_t pos)
     {
+        if (isLayered()) flatten();
         return attrs[pos];
     }
 
@@ -78,6 +198,7 @@ public:
     /* Returns the attributes in lexicographically sorted order. */
     std::vector<const Attr *> lexicographicOrder() const
     {
+        if (isLayered()) const_cast<Bindings *>(this)->flatten();
         std::vector<const Attr *> res;
         res.reserve(size_);
         for (size_t n = 0; n < size_; n++)
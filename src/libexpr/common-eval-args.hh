@@ -16,8 +16,8 @@ struct MixEvalArgs : virtual Args
 
     Strings searchPath;
 
-private:
-
+    /* The unevaluated automatic arguments, prefixed with 'E' for
+       expressions and 'S' for strings. */
     std::map<std::string, std::string> autoArgs;
 };
 
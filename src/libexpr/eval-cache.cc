@@ -0,0 +1,248 @@
+#include "eval-cache.hh"
+#include "eval.hh"
+#include "sqlite.hh"
+#include "sync.hh"
+#include "globals.hh"
+#include "store-api.hh"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists Evaluations (
+    fingerprint text primary key not null,
+    results     text not null,
+    timestamp   integer not null
+);
+
+create table if not exists Inputs (
+    evaluation  text not null,
+    path        text not null,
+    fingerprint text not null,
+    dev         integer,
+    ino         integer,
+    size        integer,
+    mtime       integer,
+    ctime       integer,
+    primary key (evaluation, path)
+);
+
+)sql";
+
+
+std::string fingerprintInput(const Path & path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1) {
+        if (errno == ENOENT || errno == ENOTDIR) return "missing";
+        throw SysError("getting status of '%s'", path);
+    }
+
+    if (S_ISREG(st.st_mode))
+        return "file:" + hashFile(htSHA256, path).to_string(Base32, false);
+
+    if (S_ISDIR(st.st_mode)) {
+        std::string s;
+        for (auto & i : readDirectory(path))
+            s += fmt("%s:%d\n", i.name, (int) i.type);
+        return "dir:" + hashString(htSHA256, s).to_string(Base32, false);
+    }
+
+    return fmt("other:%o", st.st_mode & S_IFMT);
+}
+
+
+static int64_t toNanoseconds(const struct timespec & t)
+{
+    return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+/* The status of a file or directory lets us skip rehashing files and
+   rereading directories that were not touched since the cache entry
+   was created. The size and modification time alone are not enough:
+   stat() follows symlinks, and an input reached through a symlink
+   (such as a channel) may be repointed to another file with the same
+   size and modification time. In particular, all files in the Nix
+   store have a modification time of 1. So the device and inode
+   number (and the inode change time) are compared as well. */
+InputStat statInput(const Path & path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+        return FileStat{(uint64_t) st.st_dev, (uint64_t) st.st_ino, (int64_t) st.st_size,
+            toNanoseconds(st.st_mtim), toNanoseconds(st.st_ctim)};
+    return {};
+}
+
+
+Hash fingerprintEval(EvalState & state, const Strings & extra)
+{
+    Strings ss{"eval-cache-v1", nixVersion, settings.thisSystem,
+        state.store->getUri(), state.store->storeDir,
+        evalSettings.restrictEval ? "1" : "0",
+        evalSettings.pureEval ? "1" : "0",
+        evalSettings.enableImportFromDerivation ? "1" : "0",
+        concatStringsSep(" ", evalSettings.allowedUris.get()),
+        /* Paths like ~/foo.nix are resolved against $HOME. */
+        getHome()};
+
+    for (auto & i : state.getSearchPath())
+        ss.push_back(i.first + "=" + i.second);
+
+    ss.push_back("");
+    ss.insert(ss.end(), extra.begin(), extra.end());
+
+    return hashString(htSHA256, concatStringsSep(std::string(1, '\0'), ss));
+}
+
+
+class EvalCacheImpl : public EvalCache
+{
+public:
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertEvaluation, queryEvaluation, insertInput, queryInputs, deleteInputs;
+    };
+
+    Sync<State> _state;
+
+    EvalCacheImpl()
+    {
+        auto state(_state.lock());
+
+        Path dbPath = getCacheDir() + "/nix/eval-cache-v2.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        // We can always reproduce the cache.
+        state->db.exec("pragma synchronous = off");
+        state->db.exec("pragma main.journal_mode = truncate");
+        state->db.exec("pragma busy_timeout = 3600000");
+
+        state->db.exec(schema);
+
+        state->insertEvaluation.create(state->db,
+            "insert or replace into Evaluations(fingerprint, results, timestamp) values (?, ?, ?)");
+
+        state->queryEvaluation.create(state->db,
+            "select results from Evaluations where fingerprint = ?");
+
+        state->insertInput.create(state->db,
+            "insert or replace into Inputs(evaluation, path, fingerprint, dev, ino, size, mtime, ctime) values (?, ?, ?, ?, ?, ?, ?, ?)");
+
+        state->queryInputs.create(state->db,
+            "select path, fingerprint, dev, ino, size, mtime, ctime from Inputs where evaluation = ?");
+
+        state->deleteInputs.create(state->db,
+            "delete from Inputs where evaluation = ?");
+    }
+
+    std::optional<Strings> lookup(const Hash & fingerprint) override
+    {
+        return retrySQLite<std::optional<Strings>>([&]() -> std::optional<Strings> {
+            auto state(_state.lock());
+
+            auto key = fingerprint.to_string(Base32, false);
+
+            auto queryEvaluation(state->queryEvaluation.use()(key));
+            if (!queryEvaluation.next()) return {};
+            auto results = tokenizeString<Strings>(queryEvaluation.getStr(0), "\n");
+
+            auto queryInputs(state->queryInputs.use()(key));
+            while (queryInputs.next()) {
+                auto path = queryInputs.getStr(0);
+                auto expected = queryInputs.getStr(1);
+
+                if (!queryInputs.isNull(2)
+                    && statInput(path) == FileStat{
+                        (uint64_t) queryInputs.getInt(2), (uint64_t) queryInputs.getInt(3),
+                        queryInputs.getInt(4), queryInputs.getInt(5), queryInputs.getInt(6)})
+                    continue;
+
+                if (fingerprintInput(path) != expected) {
+                    debug("evaluation cache entry '%s' is stale because '%s' changed", key, path);
+                    return {};
+                }
+            }
+
+            return results;
+        });
+    }
+
+    void add(const Hash & fingerprint, const TrackedInputs & inputs,
+        const Strings & results) override
+    {
+        /* Fingerprint the inputs before taking the lock, since this
+           may have to hash large files. An input that changed since
+           the evaluation read it (or while we're hashing it) would
+           make us record a fingerprint that doesn't match the
+           results, so don't cache anything in that case. */
+        struct Input
+        {
+            Path path;
+            std::string fingerprint;
+            InputStat st;
+        };
+
+        std::vector<Input> inputs2;
+        for (auto & i : inputs) {
+            Input input{i.first, "", statInput(i.first)};
+            if (input.st != i.second) {
+                debug("not caching evaluation because '%s' changed during evaluation", i.first);
+                return;
+            }
+            input.fingerprint = fingerprintInput(i.first);
+            if (statInput(i.first) != input.st) {
+                debug("not caching evaluation because '%s' changed while hashing it", i.first);
+                return;
+            }
+            inputs2.push_back(std::move(input));
+        }
+
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            auto key = fingerprint.to_string(Base32, false);
+
+            SQLiteTxn txn(state->db);
+
+            state->deleteInputs.use()(key).exec();
+
+            for (auto & input : inputs2)
+                state->insertInput.use()
+                    (key)
+                    (input.path)
+                    (input.fingerprint)
+                    (input.st ? (int64_t) input.st->dev : 0, (bool) input.st)
+                    (input.st ? (int64_t) input.st->ino : 0, (bool) input.st)
+                    (input.st ? input.st->size : 0, (bool) input.st)
+                    (input.st ? input.st->mtime : 0, (bool) input.st)
+                    (input.st ? input.st->ctime : 0, (bool) input.st)
+                    .exec();
+
+            state->insertEvaluation.use()
+                (key)
+                (concatStringsSep("\n", results))
+                (time(0))
+                .exec();
+
+            txn.commit();
+        });
+    }
+};
+
+
+ref<EvalCache> getEvalCache()
+{
+    static ref<EvalCache> cache = make_ref<EvalCacheImpl>();
+    return cache;
+}
+
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "types.hh"
+#include "hash.hh"
+#include "ref.hh"
+
+#include <optional>
+#include <map>
+
+namespace nix {
+
+class EvalState;
+
+/* The status of a regular file or directory that determines whether
+   it may have changed. */
+struct FileStat
+{
+    uint64_t dev, ino;
+    int64_t size, mtime, ctime;
+
+    bool operator == (const FileStat & other) const
+    {
+        return dev == other.dev && ino == other.ino && size == other.size
+            && mtime == other.mtime && ctime == other.ctime;
+    }
+
+    bool operator != (const FileStat & other) const
+    {
+        return !(*this == other);
+    }
+};
+
+/* The status of a regular file or directory, or nothing for other
+   kinds of files and paths that don't exist. */
+typedef std::optional<FileStat> InputStat;
+
+InputStat statInput(const Path & path);
+
+/* The file system paths accessed during an evaluation, together with
+   their status at the time they were first accessed. */
+typedef std::map<Path, InputStat> TrackedInputs;
+
+/* A persistent cache of evaluation results. Entries are keyed by a
+   fingerprint of everything an evaluation depends on other than the
+   file system (the expression, the requested attribute paths, the
+   automatic arguments, the search path and the evaluation settings).
+   Each entry also records the files that were accessed during the
+   evaluation together with a hash of their contents, and is only
+   returned by lookup() if none of those files have changed. */
+class EvalCache
+{
+public:
+
+    virtual ~EvalCache() { }
+
+    /* Return the results stored under 'fingerprint', provided that
+       all recorded inputs are unchanged. */
+    virtual std::optional<Strings> lookup(const Hash & fingerprint) = 0;
+
+    /* Store the results of an evaluation that accessed exactly the
+       files in 'inputs'. Nothing is stored if any of them changed
+       since the evaluation read it. */
+    virtual void add(const Hash & fingerprint, const TrackedInputs & inputs,
+        const Strings & results) = 0;
+};
+
+/* Return a string that changes whenever 'path' changes: a hash of
+   its contents for regular files, a hash of the names and types of
+   its entries for directories, or "missing" if it doesn't exist.
+   Directories are not hashed recursively; evaluations that depend on
+   the contents of a whole tree record every file in it (see
+   EvalState::trackInputTree()). */
+std::string fingerprintInput(const Path & path);
+
+/* Compute the part of an evaluation fingerprint that is determined
+   by the search path and the evaluation settings of 'state'. The
+   caller adds the identity of the expression and its arguments. */
+Hash fingerprintEval(EvalState & state, const Strings & extra);
+
+/* Return the evaluation cache of the current user. */
+ref<EvalCache> getEvalCache();
+
+}
@@ -0,0 +1,367 @@
+#include "eval-profiler.hh"
+#include "eval.hh"
+#include "json.hh"
+#include "util.hh"
+
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+
+#include <signal.h>
+#include <sys/time.h>
+
+namespace nix {
+
+
+/* The number of profiling timer ticks that have not been attributed
+   to a call stack yet. */
+static std::atomic<unsigned int> pendingSamples{0};
+
+static void sigprofHandler(int)
+{
+    pendingSamples++;
+}
+
+
+EvalProfiler::EvalProfiler(const Settings & settings)
+    : settings(settings)
+    , startTime(Clock::now())
+{
+    if (sampling()) {
+        if (settings.traceFile != "")
+            printError("warning: Chrome traces are not available in sampling mode");
+
+        struct sigaction act;
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = sigprofHandler;
+        sigemptyset(&act.sa_mask);
+        act.sa_flags = SA_RESTART;
+        if (sigaction(SIGPROF, &act, 0))
+            throw SysError("installing handler for SIGPROF");
+
+        struct itimerval timer;
+        timer.it_interval.tv_sec = settings.sampleInterval / 1000000;
+        timer.it_interval.tv_usec = settings.sampleInterval % 1000000;
+        timer.it_value = timer.it_interval;
+        if (setitimer(ITIMER_PROF, &timer, 0))
+            throw SysError("starting profiling timer");
+    }
+}
+
+
+EvalProfiler::~EvalProfiler()
+{
+    if (sampling()) {
+        struct itimerval timer;
+        memset(&timer, 0, sizeof(timer));
+        setitimer(ITIMER_PROF, &timer, 0);
+    }
+}
+
+
+void EvalProfiler::enter(const void * id, bool isPrimOp)
+{
+    if (pendingSamples) takeSamples();
+
+    auto parent = stack.empty() ? &root : stack.back().node;
+
+    auto & child = parent->children[id];
+    if (!child) child = std::make_unique<Node>(parent, id, isPrimOp);
+    child->calls++;
+
+    stack.push_back({child.get(), timing() ? Clock::now() : Clock::time_point(), 0});
+}
+
+
+void EvalProfiler::exit()
+{
+    if (pendingSamples) takeSamples();
+
+    assert(!stack.empty());
+    auto frame = stack.back();
+    stack.pop_back();
+
+    if (!timing()) return;
+
+    uint64_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - frame.start).count();
+
+    frame.node->self += duration - std::min(duration, frame.childTime);
+    if (!stack.empty()) stack.back().childTime += duration;
+
+    if (settings.traceFile == "" || !settings.maxEvents) return;
+
+    Event event{frame.node,
+        (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(frame.start - startTime).count(),
+        duration};
+
+    /* Once the buffer is full, overwrite the oldest events. */
+    if (events.size() < settings.maxEvents)
+        events.push_back(event);
+    else {
+        events[nextEvent] = event;
+        eventsDropped++;
+    }
+    nextEvent = (nextEvent + 1) % settings.maxEvents;
+}
+
+
+void EvalProfiler::takeSamples()
+{
+    auto node = stack.empty() ? &root : stack.back().node;
+    node->self += pendingSamples.exchange(0);
+}
+
+
+std::string EvalProfiler::nodeName(const Node & node)
+{
+    if (!node.parent) return "(toplevel)";
+    if (node.isPrimOp)
+        return "primop " + (std::string) ((const PrimOp *) node.id)->name;
+    return ((const ExprLambda *) node.id)->showNamePos();
+}
+
+
+void EvalProfiler::write()
+{
+    if (pendingSamples) takeSamples();
+
+    if (settings.traceFile != "" && !sampling()) writeTrace();
+    if (settings.foldedFile != "") writeFolded();
+    if (settings.allocFile != "") writeAllocProfile();
+    if (settings.allocTop) printAllocReport();
+}
+
+
+void EvalProfiler::writeTrace()
+{
+    std::ofstream str(settings.traceFile);
+    if (!str) throw SysError("opening '%s'", settings.traceFile);
+
+    /* Timestamps are in microseconds. */
+    str << std::fixed << std::setprecision(3);
+
+    std::unordered_map<const Node *, std::string> names;
+
+    {
+        JSONObject res(str);
+        res.attr("displayTimeUnit", "ns");
+        res.attr("eventsDropped", eventsDropped);
+        auto list = res.list("traceEvents");
+
+        /* Write the events from oldest to newest. */
+        size_t first = events.size() < settings.maxEvents ? 0 : nextEvent;
+        for (size_t n = 0; n < events.size(); ++n) {
+            auto & event = events[(first + n) % events.size()];
+            auto & name = names[event.node];
+            if (name.empty()) name = nodeName(*event.node);
+            auto obj = list.object();
+            obj.attr("name", name);
+            obj.attr("cat", event.node->isPrimOp ? "primop" : "function");
+            obj.attr("ph", "X");
+            obj.attr("ts", event.start / 1000.0);
+            obj.attr("dur", event.duration / 1000.0);
+            obj.attr("pid", (int) getpid());
+            obj.attr("tid", 1);
+        }
+    }
+
+    str << "\n";
+
+    if (!str) throw SysError("writing '%s'", settings.traceFile);
+}
+
+
+void EvalProfiler::writeFolded()
+{
+    std::ofstream str(settings.foldedFile);
+    if (!str) throw SysError("opening '%s'", settings.foldedFile);
+
+    /* Frame names are separated by semicolons, so these must not
+       appear in the names themselves. */
+    auto escape = [](std::string s) {
+        for (auto & c : s)
+            if (c == ';' || c == '\n') c = ',';
+        return s;
+    };
+
+    std::function<void(const Node &, const std::string &)> doNode;
+    doNode = [&](const Node & node, const std::string & prefix) {
+        auto name = prefix + escape(nodeName(node));
+        if (node.self) str << name << " " << node.self << "\n";
+        for (auto & i : node.children)
+            doNode(*i.second, node.parent ? name + ";" : "");
+    };
+
+    doNode(root, "");
+
+    if (!str) throw SysError("writing '%s'", settings.foldedFile);
+}
+
+
+/* A minimal encoder for the protocol buffer messages used by pprof
+   (https://github.com/google/pprof/blob/master/proto/profile.proto). */
+struct ProtoWriter
+{
+    std::string buf;
+
+    void varint(uint64_t n)
+    {
+        while (n >= 0x80) {
+            buf.push_back((char) (n | 0x80));
+            n >>= 7;
+        }
+        buf.push_back((char) n);
+    }
+
+    void field(unsigned int number, uint64_t n)
+    {
+        varint(number << 3);
+        varint(n);
+    }
+
+    void field(unsigned int number, const std::string & s)
+    {
+        varint((number << 3) | 2);
+        varint(s.size());
+        buf += s;
+    }
+
+    void field(unsigned int number, const ProtoWriter & msg)
+    {
+        field(number, msg.buf);
+    }
+};
+
+
+void EvalProfiler::writeAllocProfile()
+{
+    std::vector<std::string> strings{""};
+    std::unordered_map<std::string, uint64_t> stringIds;
+
+    auto string = [&](const std::string & s) {
+        auto i = stringIds.find(s);
+        if (i != stringIds.end()) return i->second;
+        strings.push_back(s);
+        return stringIds[s] = strings.size() - 1;
+    };
+
+    static const char * kindNames[nrAllocKinds] = {"value", "env", "attrset", "list"};
+
+    ProtoWriter profile;
+
+    for (auto & type : {std::make_pair("alloc_objects", "count"), std::make_pair("alloc_space", "bytes")}) {
+        ProtoWriter valueType;
+        valueType.field(1, string(type.first));
+        valueType.field(2, string(type.second));
+        profile.field(1, valueType);
+    }
+
+    /* Every node of the call tree becomes a location, and every
+       distinct function or primop becomes a function. */
+    std::unordered_map<const Node *, uint64_t> locationIds;
+    std::unordered_map<const void *, uint64_t> functionIds;
+
+    std::function<void(const Node &)> doNode;
+    doNode = [&](const Node & node) {
+        auto & functionId = functionIds[node.id];
+        if (!functionId) {
+            functionId = functionIds.size();
+            ProtoWriter function;
+            function.field(1, functionId);
+            function.field(2, string(nodeName(node)));
+            if (node.parent && !node.isPrimOp) {
+                auto & pos = ((const ExprLambda *) node.id)->pos;
+                if (pos) {
+                    function.field(4, string(pos.file));
+                    function.field(5, pos.line);
+                }
+            }
+            profile.field(5, function);
+        }
+
+        auto locationId = locationIds[&node] = locationIds.size() + 1;
+        ProtoWriter location, line;
+        location.field(1, locationId);
+        line.field(1, functionId);
+        if (node.parent && !node.isPrimOp)
+            line.field(2, ((const ExprLambda *) node.id)->pos.line);
+        location.field(4, line);
+        profile.field(4, location);
+
+        for (size_t kind = 0; kind < nrAllocKinds; ++kind) {
+            if (!node.allocCount[kind]) continue;
+            ProtoWriter sample, locationIdsField, values, label;
+            for (auto n = &node; n; n = n->parent)
+                locationIdsField.varint(locationIds[n]);
+            sample.field(1, locationIdsField);
+            values.varint(node.allocCount[kind]);
+            values.varint(node.allocBytes[kind]);
+            sample.field(2, values);
+            label.field(1, string("kind"));
+            label.field(2, string(kindNames[kind]));
+            sample.field(3, label);
+            profile.field(2, sample);
+        }
+
+        for (auto & i : node.children)
+            doNode(*i.second);
+    };
+
+    doNode(root);
+
+    for (auto & s : strings)
+        profile.field(6, s);
+
+    writeFile(settings.allocFile, profile.buf);
+}
+
+
+void EvalProfiler::printAllocReport()
+{
+    /* Sum the allocations of each function over all call stacks. */
+    struct Totals
+    {
+        const Node * node;
+        uint64_t bytes = 0;
+        uint64_t allocBytes[nrAllocKinds] = {};
+    };
+
+    std::unordered_map<const void *, Totals> totals;
+
+    std::function<void(const Node &)> doNode;
+    doNode = [&](const Node & node) {
+        auto & t = totals[node.id];
+        t.node = &node;
+        for (size_t kind = 0; kind < nrAllocKinds; ++kind) {
+            t.bytes += node.allocBytes[kind];
+            t.allocBytes[kind] += node.allocBytes[kind];
+        }
+        for (auto & i : node.children)
+            doNode(*i.second);
+    };
+
+    doNode(root);
+
+    std::vector<Totals *> sorted;
+    for (auto & i : totals)
+        if (i.second.bytes) sorted.push_back(&i.second);
+
+    auto n = std::min((size_t) settings.allocTop, sorted.size());
+    std::partial_sort(sorted.begin(), sorted.begin() + n, sorted.end(),
+        [](const Totals * a, const Totals * b) { return a->bytes > b->bytes; });
+
+    std::string report = fmt("%12s %12s %12s %12s %12s  %s\n",
+        "total", "values", "envs", "attrsets", "lists", "function");
+    for (size_t i = 0; i < n; ++i) {
+        auto & t = *sorted[i];
+        report += fmt("%12d %12d %12d %12d %12d  %s\n",
+            t.bytes, t.allocBytes[0], t.allocBytes[1], t.allocBytes[2], t.allocBytes[3],
+            nodeName(*t.node));
+    }
+
+    writeToStderr(report);
+}
+
+
+}
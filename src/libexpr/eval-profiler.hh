@@ -0,0 +1,166 @@
+#pragma once
+
+#include "types.hh"
+
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+
+namespace nix {
+
+struct ExprLambda;
+struct PrimOp;
+
+/* A profiler that attributes evaluation time to the functions and
+   primops that were called. Calls are organised in a call tree,
+   which can be written in the "folded stacks" format understood by
+   flamegraph.pl and similar tools. In addition, the most recent calls
+   are kept in a fixed-size ring buffer and can be written as a Chrome
+   trace (viewable in chrome://tracing or Perfetto).
+
+   In sampling mode, no clocks are read on function entry and
+   exit. Instead, a profiling timer periodically marks the current
+   call stack, giving a much lower overhead. Only the folded stacks
+   output is available in that mode.
+
+   The profiler can also attribute heap allocations (values,
+   environments, attribute sets and lists) to the call stack that
+   performed them. These are written as a pprof profile and/or
+   summarised per function in a top-N report. */
+class EvalProfiler
+{
+public:
+
+    struct Settings
+    {
+        Path traceFile;
+        Path foldedFile;
+        unsigned int sampleInterval = 0; // in microseconds
+        size_t maxEvents = 0;
+        Path allocFile;
+        unsigned int allocTop = 0;
+    };
+
+    enum class AllocKind { Value, Env, Bindings, List };
+    static const size_t nrAllocKinds = 4;
+
+    EvalProfiler(const Settings & settings);
+
+    ~EvalProfiler();
+
+    void enterLambda(const ExprLambda * lambda)
+    {
+        enter(lambda, false);
+    }
+
+    void enterPrimOp(const PrimOp * primOp)
+    {
+        enter(primOp, true);
+    }
+
+    void exit();
+
+    void recordAlloc(AllocKind kind, size_t bytes)
+    {
+        auto node = stack.empty() ? &root : stack.back().node;
+        node->allocCount[(size_t) kind]++;
+        node->allocBytes[(size_t) kind] += bytes;
+    }
+
+    /* Write the requested output files. */
+    void write();
+
+    /* Record a call for the lifetime of this object. */
+    struct Frame
+    {
+        EvalProfiler & profiler;
+
+        Frame(EvalProfiler & profiler, const ExprLambda * lambda)
+            : profiler(profiler)
+        {
+            profiler.enterLambda(lambda);
+        }
+
+        Frame(EvalProfiler & profiler, const PrimOp * primOp)
+            : profiler(profiler)
+        {
+            profiler.enterPrimOp(primOp);
+        }
+
+        ~Frame()
+        {
+            profiler.exit();
+        }
+    };
+
+private:
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Node
+    {
+        Node * parent;
+        const void * id;
+        bool isPrimOp;
+        uint64_t calls = 0;
+        /* Time spent in this function but not in its callees, in
+           nanoseconds, or the number of samples in sampling mode. */
+        uint64_t self = 0;
+        /* Allocations made by this function itself. */
+        uint64_t allocCount[nrAllocKinds] = {};
+        uint64_t allocBytes[nrAllocKinds] = {};
+        std::unordered_map<const void *, std::unique_ptr<Node>> children;
+
+        Node(Node * parent, const void * id, bool isPrimOp)
+            : parent(parent), id(id), isPrimOp(isPrimOp) { }
+    };
+
+    struct StackFrame
+    {
+        Node * node;
+        Clock::time_point start;
+        uint64_t childTime;
+    };
+
+    struct Event
+    {
+        Node * node;
+        uint64_t start, duration; // relative to 'startTime', in nanoseconds
+    };
+
+    Settings settings;
+
+    Clock::time_point startTime;
+
+    Node root{nullptr, nullptr, false};
+
+    std::vector<StackFrame> stack;
+
+    std::vector<Event> events;
+    size_t nextEvent = 0;
+    uint64_t eventsDropped = 0;
+
+    bool sampling() const { return settings.sampleInterval != 0; }
+
+    /* Whether we need to time calls. */
+    bool timing() const
+    {
+        return !sampling() && (settings.traceFile != "" || settings.foldedFile != "");
+    }
+
+    void enter(const void * id, bool isPrimOp);
+
+    void takeSamples();
+
+    std::string nodeName(const Node & node);
+
+    void writeTrace();
+
+    void writeFolded();
+
+    void writeAllocProfile();
+
+    void printAllocReport();
+};
+
+}
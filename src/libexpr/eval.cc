@@ -16,6 +16,7 @@
 #include <sys/resource.h>
 #include <iostream>
 #include <fstream>
+#include <unordered_set>
 
 #include <sys/resource.h>
 
@@ -42,6 +43,42 @@ static char * dupString(const char * s)
 }
 
 
+static char * allocString(size_t size)
+{
+    char * t;
+#if HAVE_BOEHMGC
+    t = (char *) GC_MALLOC_ATOMIC(size);
+#else
+    t = (char *) malloc(size);
+#endif
+    if (!t) throw std::bad_alloc();
+    return t;
+}
+
+
+/* Return a copy of a string context element that is shared by all
+   values with that element. Since context elements are store paths
+   (possibly with a prefix), there are few distinct ones, while the
+   same element often appears in the contexts of many strings. The
+   copies are never freed. */
+static const char * internContextElem(const string & s)
+{
+    static std::unordered_set<string> elems;
+    return elems.insert(s).first->c_str();
+}
+
+
+/* Allocate a null-terminated context array containing 'elems', which
+   must be sorted and free of duplicates. */
+static const char * * mkContext(const std::vector<const char *> & elems)
+{
+    auto context = (const char * *) allocBytes((elems.size() + 1) * sizeof(char *));
+    std::copy(elems.begin(), elems.end(), context);
+    context[elems.size()] = 0;
+    return context;
+}
+
+
 static void printValue(std::ostream & str, std::set<const Value *> & active, const Value & v)
 {
     checkInterrupt();
@@ -204,6 +241,10 @@ void initGC()
        there. */
     GC_set_no_dls(1);
 
+    /* Make the collector usable in child processes forked by
+       forkEvalWorkers(). */
+    GC_set_handle_fork(1);
+
     GC_INIT();
 
     GC_set_oom_fn(oomHandler);
@@ -308,6 +349,18 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
 {
     countCalls = getEnv("NIX_COUNT_CALLS", "0") != "0";
 
+    if (evalSettings.profileTraceFile != ""
+        || evalSettings.profileFoldedFile != ""
+        || evalSettings.allocProfileFile != ""
+        || evalSettings.allocProfileTop)
+        profiler = std::make_unique<EvalProfiler>(EvalProfiler::Settings{
+            evalSettings.profileTraceFile,
+            evalSettings.profileFoldedFile,
+            evalSettings.profileSampleInterval,
+            evalSettings.profileMaxEvents,
+            evalSettings.allocProfileFile,
+            evalSettings.allocProfileTop});
+
     assert(gcInitialised);
 
     static_assert(sizeof(Env) <= 16, "environment must be <= 16 bytes");
@@ -349,11 +402,20 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
 
 EvalState::~EvalState()
 {
+    if (profiler) {
+        try {
+            profiler->write();
+        } catch (...) {
+            ignoreException();
+        }
+    }
 }
 
 
 Path EvalState::checkSourcePath(const Path & path_)
 {
+    trackInput(path_);
+
     if (!allowedPaths) return path_;
 
     auto i = resolvedPaths.find(path_);
@@ -554,12 +616,11 @@ Value & mkString(Value & v, const string & s, const PathSet & context)
 {
     mkString(v, s.c_str());
     if (!context.empty()) {
-        size_t n = 0;
-        v.string.context = (const char * *)
-            allocBytes((context.size() + 1) * sizeof(char *));
+        std::vector<const char *> elems;
+        elems.reserve(context.size());
         for (auto & i : context)
-            v.string.context[n++] = dupString(i.c_str());
-        v.string.context[n] = 0;
+            elems.push_back(internContextElem(i));
+        v.string.context = mkContext(elems);
     }
     return v;
 }
@@ -607,6 +668,7 @@ void finalizeValue(void * obj, void * data)
 Value * EvalState::allocValue()
 {
     nrValues++;
+    if (profiler) profiler->recordAlloc(EvalProfiler::AllocKind::Value, sizeof(Value));
     auto v = (Value *) allocBytes(sizeof(Value));
     //GC_register_finalizer_no_order(v, finalizeValue, nullptr, nullptr, nullptr);
     return v;
@@ -620,6 +682,7 @@ Env & EvalState::allocEnv(size_t size)
 
     nrEnvs++;
     nrValuesInEnvs += size;
+    if (profiler) profiler->recordAlloc(EvalProfiler::AllocKind::Env, sizeof(Env) + size * sizeof(Value *));
     Env * env = (Env *) allocBytes(sizeof(Env) + size * sizeof(Value *));
     env->size = (decltype(Env::size)) size;
     env->type = Env::Plain;
@@ -641,6 +704,7 @@ void EvalState::mkList(Value & v, size_t size)
         v.type = tListN;
         v.bigList.size = size;
         v.bigList.elems = size ? (Value * *) allocBytes(size * sizeof(Value *)) : 0;
+        if (profiler && size) profiler->recordAlloc(EvalProfiler::AllocKind::List, size * sizeof(Value *));
     }
     nrListElems += size;
 }
@@ -853,7 +917,6 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
         /* The recursive attributes are evaluated in the new
            environment, while the inherited attributes are evaluated
            in the original environment. */
-        size_t displ = 0;
         for (auto & i : attrs) {
             Value * vAttr;
             if (hasOverrides && !i.second.inherited) {
@@ -861,7 +924,7 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
                 mkThunk(*vAttr, env2, i.second.e);
             } else
                 vAttr = i.second.e->maybeThunk(state, i.second.inherited ? env : env2);
-            env2.values[displ++] = vAttr;
+            env2.values[i.second.displ] = vAttr;
             v.attrs->push_back(Attr(i.first, vAttr, &i.second.pos));
         }
 
@@ -874,7 +937,7 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
            been substituted into the bodies of the other attributes.
            Hence we need __overrides.) */
         if (hasOverrides) {
-            Value * vOverrides = (*v.attrs)[overrides->second.displ].value;
+            Value * vOverrides = env2.values[overrides->second.displ];
             state.forceAttrs(*vOverrides);
             Bindings * newBnds = state.allocBindings(v.attrs->size() + vOverrides->attrs->size());
             for (auto & i : *v.attrs)
@@ -882,7 +945,7 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
             for (auto & i : *vOverrides->attrs) {
                 AttrDefs::iterator j = attrs.find(i.name);
                 if (j != attrs.end()) {
-                    (*newBnds)[j->second.displ] = i;
+                    (*newBnds)[v.attrs->find(i.name) - v.attrs->begin()] = i;
                     env2.values[j->second.displ] = i.value;
                 } else
                     newBnds->push_back(i);
@@ -927,9 +990,8 @@ void ExprLet::eval(EvalState & state, Env & env, Value & v)
     /* The recursive attributes are evaluated in the new environment,
        while the inherited attributes are evaluated in the original
        environment. */
-    size_t displ = 0;
     for (auto & i : attrs->attrs)
-        env2.values[displ++] = i.second.e->maybeThunk(state, i.second.inherited ? env : env2);
+        env2.values[i.second.displ] = i.second.e->maybeThunk(state, i.second.inherited ? env : env2);
 
     body->eval(state, env2, v);
 }
@@ -1083,6 +1145,13 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
         /* And call the primop. */
         nrPrimOpCalls++;
         if (countCalls) primOpCalls[primOp->primOp->name]++;
+        /* Keep the profiler frame (which has a destructor) out of
+           the common path, so as not to prevent tail calls. */
+        if (profiler) {
+            EvalProfiler::Frame frame(*profiler, primOp->primOp);
+            primOp->primOp->fun(*this, pos, vArgs, v);
+            return;
+        }
         primOp->primOp->fun(*this, pos, vArgs, v);
     } else {
         Value * fun2 = allocValue();
@@ -1176,6 +1245,22 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
     nrFunctionCalls++;
     if (countCalls) incrFunctionCall(&lambda);
 
+    /* Keep the profiler frame (which has a destructor) out of the
+       common path, so as not to prevent tail calls. */
+    if (profiler) {
+        EvalProfiler::Frame frame(*profiler, &lambda);
+        if (settings.showTrace)
+            try {
+                lambda.body->eval(*this, env2, v);
+            } catch (Error & e) {
+                addErrorPrefix(e, "while evaluating %1%, called from %2%:\n", lambda, pos);
+                throw;
+            }
+        else
+            lambda.body->eval(*this, env2, v);
+        return;
+    }
+
     /* Evaluate the body.  This is conditional on showTrace, because
        catching exceptions makes this function not tail-recursive. */
     if (settings.showTrace)
@@ -1311,6 +1396,18 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     if (v1.attrs->size() == 0) { v = v2; return; }
     if (v2.attrs->size() == 0) { v = v1; return; }
 
+    /* If a few attributes are added to a large set, avoid copying
+       the large set. */
+    if (Bindings::shouldLayer(*v1.attrs, *v2.attrs)) {
+        clearValue(v);
+        v.type = tAttrs;
+        v.attrs = state.allocLayeredBindings(*v1.attrs, *v2.attrs);
+        state.nrAttrsets++;
+        state.nrAttrsInAttrsets += v.attrs->size();
+        state.nrOpUpdateValuesCopied += v2.attrs->size();
+        return;
+    }
+
     state.mkAttrs(v, v1.attrs->size() + v2.attrs->size());
 
     /* Merge the sets, preferring values from the second set.  Make
@@ -1377,13 +1474,34 @@ void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const Po
 void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
 {
     PathSet context;
-    std::ostringstream s;
     NixInt n = 0;
     NixFloat nf = 0;
 
     bool first = !forceString;
     ValueType firstType = tString;
 
+    /* The pieces of a string or path result. These are concatenated
+       once the total length is known, and strings are not copied
+       until then. The vector is traced by the garbage collector
+       since it may hold the only reference to a string. */
+    struct Piece
+    {
+        const char * s;
+        size_t len;
+        const char * * context;
+    };
+#if HAVE_BOEHMGC
+    std::vector<Piece, traceable_allocator<Piece> > pieces;
+#else
+    std::vector<Piece> pieces;
+#endif
+    pieces.reserve(es->size());
+
+    /* Storage for values that had to be converted to strings. */
+    std::list<string> coerced;
+
+    size_t len = 0;
+
     for (auto & i : *es) {
         Value vTmp;
         i->eval(state, env, vTmp);
@@ -1414,21 +1532,70 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
                 nf += vTmp.fpoint;
             } else
                 throwEvalError("cannot add %1% to a float, at %2%", showType(vTmp), pos);
-        } else
-            s << state.coerceToString(pos, vTmp, context, false, firstType == tString);
+        } else if (vTmp.type == tString) {
+            pieces.push_back({vTmp.string.s, strlen(vTmp.string.s), vTmp.string.context});
+            len += pieces.back().len;
+        } else {
+            coerced.push_back(state.coerceToString(pos, vTmp, context, false, firstType == tString));
+            pieces.push_back({coerced.back().data(), coerced.back().size(), nullptr});
+            len += pieces.back().len;
+        }
     }
 
-    if (firstType == tInt)
+    if (firstType == tInt) {
         mkInt(v, n);
-    else if (firstType == tFloat)
+        return;
+    }
+
+    if (firstType == tFloat) {
         mkFloat(v, nf);
-    else if (firstType == tPath) {
-        if (!context.empty())
+        return;
+    }
+
+    char * buf = allocString(len + 1);
+    char * p = buf;
+    for (auto & i : pieces) {
+        memcpy(p, i.s, i.len);
+        p += i.len;
+    }
+    *p = 0;
+
+    /* Compute the context of the result. In the common case where
+       only one piece has a context, it is shared rather than
+       copied. */
+    const char * * resultContext = nullptr;
+    bool mergeContexts = !context.empty();
+    for (auto & i : pieces) {
+        if (!i.context || !*i.context || i.context == resultContext) continue;
+        if (resultContext) mergeContexts = true;
+        resultContext = i.context;
+    }
+
+    if (firstType == tPath) {
+        if (resultContext || mergeContexts)
             throwEvalError("a string that refers to a store path cannot be appended to a path, at %1%", pos);
-        auto path = canonPath(s.str());
+        auto path = canonPath(string(buf, len));
         mkPath(v, path.c_str());
+        return;
+    }
+
+    mkStringNoCopy(v, buf);
+
+    if (mergeContexts) {
+        std::vector<const char *> elems;
+        for (auto & i : pieces)
+            if (i.context)
+                for (auto p = i.context; *p; ++p)
+                    elems.push_back(*p);
+        for (auto & i : context)
+            elems.push_back(internContextElem(i));
+        std::sort(elems.begin(), elems.end(),
+            [](const char * a, const char * b) { return strcmp(a, b) < 0; });
+        elems.erase(std::unique(elems.begin(), elems.end(),
+            [](const char * a, const char * b) { return strcmp(a, b) == 0; }), elems.end());
+        v.string.context = mkContext(elems);
     } else
-        mkString(v, s.str(), context);
+        v.string.context = resultContext;
 }
 
 
@@ -1627,6 +1794,28 @@ string EvalState::coerceToString(const Pos & pos, Value & v, PathSet & context,
 }
 
 
+void EvalState::trackInput(const Path & path)
+{
+    if (trackedInputs && !trackedInputs->count(path))
+        trackedInputs->emplace(path, statInput(path));
+}
+
+
+void EvalState::trackInputTree(const Path & path)
+{
+    if (!trackedInputs) return;
+
+    trackInput(path);
+
+    struct stat st;
+    if (lstat(path.c_str(), &st) == -1) return;
+
+    if (S_ISDIR(st.st_mode))
+        for (auto & i : readDirectory(path))
+            trackInputTree(path + "/" + i.name);
+}
+
+
 string EvalState::copyPathToStore(PathSet & context, const Path & path)
 {
     if (nix::isDerivation(path))
@@ -1636,9 +1825,11 @@ string EvalState::copyPathToStore(PathSet & context, const Path & path)
     if (srcToStore[path] != "")
         dstPath = srcToStore[path];
     else {
+        auto srcPath = checkSourcePath(path);
+        trackInputTree(srcPath);
         dstPath = settings.readOnlyMode
-            ? store->computeStorePathForPath(baseNameOf(path), checkSourcePath(path)).first
-            : store->addToStore(baseNameOf(path), checkSourcePath(path), true, htSHA256, defaultPathFilter, repair);
+            ? store->computeStorePathForPath(baseNameOf(path), srcPath).first
+            : store->addToStore(baseNameOf(path), srcPath, true, htSHA256, defaultPathFilter, repair);
         srcToStore[path] = dstPath;
         printMsg(lvlChatty, format("copied source '%1%' -> '%2%'")
             % path % dstPath);
@@ -1804,8 +1995,27 @@ void EvalState::printStats()
         topObj.attr("nrThunks", nrThunks);
         topObj.attr("nrAvoided", nrAvoided);
         topObj.attr("nrLookups", nrLookups);
+        {
+            auto attrLookups = topObj.object("attrLookups");
+            attrLookups.attr("number", nrAttrLookups);
+            attrLookups.attr("probes", nrAttrProbes);
+            attrLookups.attr("hashIndexes", nrAttrHashIndexes);
+        }
+        {
+            auto layered = topObj.object("layeredAttrsets");
+            layered.attr("number", nrLayeredSets);
+            layered.attr("flattened", nrLayeredSetsFlattened);
+            layered.attr("valuesCopied", nrLayeredValuesCopied);
+        }
         topObj.attr("nrPrimOpCalls", nrPrimOpCalls);
         topObj.attr("nrFunctionCalls", nrFunctionCalls);
+        {
+            auto parser = topObj.object("parser");
+            parser.attr("parses", nrParses);
+            parser.attr("time", parseTime / 1000000.0);
+            parser.attr("cacheHits", nrParseCacheHits);
+            parser.attr("timeSaved", parseTimeSaved / 1000000.0);
+        }
 #if HAVE_BOEHMGC
         {
             auto gc = topObj.object("gc");
@@ -1887,7 +2097,7 @@ size_t valueSize(Value & v)
             break;
         case tAttrs:
             if (seen.insert(v.attrs).second) {
-                sz += sizeof(Bindings) + sizeof(Attr) * v.attrs->capacity();
+                sz += Bindings::allocSize(v.attrs->capacity());
                 for (auto & i : *v.attrs)
                     sz += doValue(*i.value);
             }
@@ -7,6 +7,8 @@
 #include "hash.hh"
 #include "config.hh"
 #include "function-trace.hh"
+#include "eval-profiler.hh"
+#include "eval-cache.hh"
 
 #include <map>
 #include <unordered_map>
@@ -86,7 +88,20 @@ public:
 
     Value vEmptySet;
 
-    const ref<Store> store;
+    /* Not const, since the children forked by forkEvalWorkers()
+       replace it with a connection of their own. */
+    ref<Store> store;
+
+    /* If set, the file system paths accessed during evaluation are
+       recorded here together with their status at the time of the
+       first access, so that the result of the evaluation can be
+       cached (see eval-cache.hh). */
+    std::optional<TrackedInputs> trackedInputs;
+
+    /* Set if the evaluation depended on something other than the
+       tracked inputs, such as environment variables, the current time
+       or an unhashed download. Such results must not be cached. */
+    bool impure = false;
 
 private:
     SrcToStore srcToStore;
@@ -125,6 +140,14 @@ public:
 
     Path checkSourcePath(const Path & path);
 
+    /* Record 'path' as an input of the evaluation. */
+    void trackInput(const Path & path);
+
+    /* Record every file and directory under 'path' as an input of
+       the evaluation, for when its entire contents matter (e.g. when
+       it is copied to the store). */
+    void trackInputTree(const Path & path);
+
     void checkURI(const std::string & uri);
 
     /* When using a diverted store and 'path' is in the Nix store, map
@@ -245,6 +268,18 @@ private:
     Expr * parse(const char * text, const Path & path,
         const Path & basePath, StaticEnv & staticEnv);
 
+    /* Support for the on-disk cache of parse trees (see
+       parse-cache.cc). */
+    string baseEnvFingerprint;
+
+    Path parseCachePath(const Path & path, const string & contents);
+
+    Expr * lookupParseCache(const Path & cachePath);
+
+    void addToParseCache(const Path & cachePath, Expr * e, uint64_t parseTime);
+
+    bool parseCachePruned = false;
+
 public:
 
     /* Do a deep equality test between two values.  That is, list
@@ -268,6 +303,8 @@ public:
 
     Bindings * allocBindings(size_t capacity);
 
+    Bindings * allocLayeredBindings(Bindings & base, Bindings & overlay);
+
     void mkList(Value & v, size_t length);
     void mkAttrs(Value & v, size_t capacity);
     void mkThunk_(Value & v, Expr * expr);
@@ -293,9 +330,17 @@ private:
     unsigned long nrListConcats = 0;
     unsigned long nrPrimOpCalls = 0;
     unsigned long nrFunctionCalls = 0;
+    unsigned long nrParses = 0;
+    uint64_t parseTime = 0; // in microseconds
+    unsigned long nrParseCacheHits = 0;
+    uint64_t parseTimeSaved = 0; // in microseconds
 
     bool countCalls;
 
+    /* The profiler, if enabled through the 'eval-profile-*'
+       settings. */
+    std::unique_ptr<EvalProfiler> profiler;
+
     typedef std::map<Symbol, size_t> PrimOpCalls;
     PrimOpCalls primOpCalls;
 
@@ -353,6 +398,37 @@ struct EvalSettings : Config
 
     Setting<bool> traceFunctionCalls{this, false, "trace-function-calls",
         "Emit log messages for each function entry and exit at the 'vomit' log level (-vvvv)"};
+
+    Setting<Path> profileTraceFile{this, "", "eval-profile-trace",
+        "If set, write a Chrome trace of the most recent function and primop calls during evaluation to this file."};
+
+    Setting<Path> profileFoldedFile{this, "", "eval-profile-folded",
+        "If set, write the time spent in each function and primop during evaluation to this file in folded stacks format."};
+
+    Setting<unsigned int> profileSampleInterval{this, 0, "eval-profile-sample-interval",
+        "If non-zero, sample the evaluation call stack every this many microseconds of CPU time instead of timing every call."};
+
+    Setting<size_t> profileMaxEvents{this, 1000000, "eval-profile-max-events",
+        "The number of most recent calls to keep for the Chrome trace written to 'eval-profile-trace'."};
+
+    Setting<Path> allocProfileFile{this, "", "eval-alloc-profile",
+        "If set, write a pprof profile of the memory allocated by each function during evaluation to this file."};
+
+    Setting<unsigned int> allocProfileTop{this, 0, "eval-alloc-profile-top",
+        "If non-zero, print the functions that allocated the most memory during evaluation, up to this number."};
+
+    Setting<unsigned int> evalWorkers{this, 1, "eval-workers",
+        "Number of processes to use for evaluating the attributes of package sets in parallel in 'nix search' and 'nix-env -qa'."};
+
+    Setting<bool> parseCache{this, false, "parse-cache",
+        "Whether to cache the parse trees of Nix expressions on disk."};
+
+    Setting<unsigned int> parseCacheMaxAge{this, 30 * 24 * 3600, "parse-cache-max-age",
+        "Number of seconds after which unused entries are removed from the parse cache (0 to keep them forever)."};
+
+    Setting<bool> evalCache{this, false, "eval-cache",
+        "Whether to cache the results of instantiating Nix expressions on disk, "
+        "keyed by the contents of the files read during evaluation."};
 };
 
 extern EvalSettings evalSettings;
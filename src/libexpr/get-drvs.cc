@@ -2,6 +2,9 @@
 #include "util.hh"
 #include "eval-inline.hh"
 #include "derivations.hh"
+#include "attr-path.hh"
+#include "parallel-eval.hh"
+#include "serialise.hh"
 
 #include <cstring>
 #include <regex>
@@ -43,9 +46,28 @@ DrvInfo::DrvInfo(EvalState & state, ref<Store> store, const std::string & drvPat
 }
 
 
+DrvInfo::DrvInfo(EvalState & state, const string & attrPath,
+    Value & root, Bindings & autoArgs, const string & rootAttrPath)
+    : state(&state), root(&root), rootAutoArgs(&autoArgs)
+    , rootAttrPath(rootAttrPath), attrPath(attrPath)
+{
+}
+
+
+Bindings * DrvInfo::getAttrs() const
+{
+    if (!attrs && root) {
+        Value * v = findAlongAttrPath(*state, rootAttrPath, *rootAutoArgs, *root);
+        state->forceAttrs(*v);
+        attrs = v->attrs;
+    }
+    return attrs;
+}
+
+
 string DrvInfo::queryName() const
 {
-    if (name == "" && attrs) {
+    if (name == "" && getAttrs()) {
         auto i = attrs->find(state->sName);
         if (i == attrs->end()) throw TypeError("derivation name missing");
         name = state->forceStringNoCtx(*i->value);
@@ -56,7 +78,7 @@ string DrvInfo::queryName() const
 
 string DrvInfo::querySystem() const
 {
-    if (system == "" && attrs) {
+    if (system == "" && getAttrs()) {
         auto i = attrs->find(state->sSystem);
         system = i == attrs->end() ? "unknown" : state->forceStringNoCtx(*i->value, *i->pos);
     }
@@ -66,7 +88,7 @@ string DrvInfo::querySystem() const
 
 string DrvInfo::queryDrvPath() const
 {
-    if (drvPath == "" && attrs) {
+    if (drvPath == "" && getAttrs()) {
         Bindings::iterator i = attrs->find(state->sDrvPath);
         PathSet context;
         drvPath = i != attrs->end() ? state->coerceToPath(*i->pos, *i->value, context) : "";
@@ -77,7 +99,7 @@ string DrvInfo::queryDrvPath() const
 
 string DrvInfo::queryOutPath() const
 {
-    if (outPath == "" && attrs) {
+    if (outPath == "" && getAttrs()) {
         Bindings::iterator i = attrs->find(state->sOutPath);
         PathSet context;
         outPath = i != attrs->end() ? state->coerceToPath(*i->pos, *i->value, context) : "";
@@ -91,7 +113,7 @@ DrvInfo::Outputs DrvInfo::queryOutputs(bool onlyOutputsToInstall)
     if (outputs.empty()) {
         /* Get the ‘outputs’ list. */
         Bindings::iterator i;
-        if (attrs && (i = attrs->find(state->sOutputs)) != attrs->end()) {
+        if (getAttrs() && (i = attrs->find(state->sOutputs)) != attrs->end()) {
             state->forceList(*i->value, *i->pos);
 
             /* For each output... */
@@ -111,7 +133,7 @@ DrvInfo::Outputs DrvInfo::queryOutputs(bool onlyOutputsToInstall)
         } else
             outputs["out"] = queryOutPath();
     }
-    if (!onlyOutputsToInstall || !attrs)
+    if (!onlyOutputsToInstall || !getAttrs())
         return outputs;
 
     /* Check for `meta.outputsToInstall` and return `outputs` reduced to that. */
@@ -133,7 +155,7 @@ DrvInfo::Outputs DrvInfo::queryOutputs(bool onlyOutputsToInstall)
 
 string DrvInfo::queryOutputName() const
 {
-    if (outputName == "" && attrs) {
+    if (outputName == "" && getAttrs()) {
         Bindings::iterator i = attrs->find(state->sOutputName);
         outputName = i != attrs->end() ? state->forceStringNoCtx(*i->value) : "";
     }
@@ -144,7 +166,7 @@ string DrvInfo::queryOutputName() const
 Bindings * DrvInfo::getMeta()
 {
     if (meta) return meta;
-    if (!attrs) return 0;
+    if (!getAttrs()) return 0;
     Bindings::iterator a = attrs->find(state->sMeta);
     if (a == attrs->end()) return 0;
     state->forceAttrs(*a->value, *a->pos);
@@ -314,10 +336,106 @@ static string addToPath(const string & s1, const string & s2)
 static std::regex attrRegex("[A-Za-z_][A-Za-z0-9-_+]*");
 
 
+/* If set, getDerivations() evaluates the attributes of package sets
+   in parallel, and resolves the attribute paths of the derivations it
+   finds relative to this value and prefix. */
+struct ParallelRoot
+{
+    Value & v;
+    string pathPrefix;
+};
+
+
 static void getDerivations(EvalState & state, Value & vIn,
     const string & pathPrefix, Bindings & autoArgs,
     DrvInfos & drvs, Done & done,
-    bool ignoreAssertionFailures)
+    bool ignoreAssertionFailures, const ParallelRoot * root = nullptr);
+
+
+static void getDerivationsFromAttr(EvalState & state, const Attr & i,
+    const string & pathPrefix2, Bindings & autoArgs,
+    DrvInfos & drvs, Done & done,
+    bool ignoreAssertionFailures, bool combineChannels,
+    const ParallelRoot * root)
+{
+    if (combineChannels)
+        getDerivations(state, *i.value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures, root);
+    else if (getDerivation(state, *i.value, pathPrefix2, drvs, done, ignoreAssertionFailures)) {
+        /* If the value of this attribute is itself a set,
+           should we recurse into it?  => Only if it has a
+           `recurseForDerivations = true' attribute. */
+        if (i.value->type == tAttrs) {
+            Bindings::iterator j = i.value->attrs->find(state.symbols.create("recurseForDerivations"));
+            if (j != i.value->attrs->end() && state.forceBool(*j->value, *j->pos))
+                getDerivations(state, *i.value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures, root);
+        }
+    }
+}
+
+
+/* Process the given attributes of a package set in forked workers
+   (see getDerivationsParallel()). */
+static void getDerivationsForked(EvalState & state, const std::vector<const Attr *> & attrs,
+    const string & pathPrefix, Bindings & autoArgs, DrvInfos & drvs,
+    bool ignoreAssertionFailures, const ParallelRoot & root)
+{
+    PathSet drvPaths;
+
+    forkEvalWorkers(state, attrs.size(), evalSettings.evalWorkers,
+        [&](size_t n) {
+            DrvInfos drvs2;
+            Done done2;
+            getDerivationsFromAttr(state, *attrs[n], addToPath(pathPrefix, attrs[n]->name),
+                autoArgs, drvs2, done2, ignoreAssertionFailures, false, nullptr);
+            StringSink sink;
+            sink << drvs2.size();
+            for (auto & drv : drvs2) {
+                sink << drv.attrPath << drv.queryName();
+                /* Errors are left to the parent, which gets them
+                   when it evaluates the attribute itself. */
+                try {
+                    auto system = drv.querySystem();
+                    auto drvPath = drv.queryDrvPath();
+                    auto outputs = drv.queryOutputs();
+                    sink << (uint64_t) 1 << system << drvPath << drv.queryOutPath() << outputs.size();
+                    for (auto & output : outputs)
+                        sink << output.first << output.second;
+                } catch (Error &) {
+                    sink << (uint64_t) 0;
+                }
+            }
+            return *sink.s;
+        },
+        [&](size_t n, std::string && data) {
+            StringSource source(data);
+            for (auto count = readNum<size_t>(source); count; --count) {
+                auto attrPath = readString(source);
+                DrvInfo drv(state, attrPath, root.v, autoArgs,
+                    root.pathPrefix.empty() ? attrPath : string(attrPath, root.pathPrefix.size() + 1));
+                drv.setName(readString(source));
+                if (readInt(source)) {
+                    drv.setSystem(readString(source));
+                    drv.setDrvPath(readString(source));
+                    drv.setOutPath(readString(source));
+                    DrvInfo::Outputs outputs;
+                    for (auto count2 = readNum<size_t>(source); count2; --count2) {
+                        auto name = readString(source);
+                        outputs[name] = readString(source);
+                    }
+                    drv.setOutputs(outputs);
+                    if (drv.queryDrvPath() != "" && !drvPaths.insert(drv.queryDrvPath()).second)
+                        continue;
+                }
+                drvs.push_back(drv);
+            }
+        });
+}
+
+
+static void getDerivations(EvalState & state, Value & vIn,
+    const string & pathPrefix, Bindings & autoArgs,
+    DrvInfos & drvs, Done & done,
+    bool ignoreAssertionFailures, const ParallelRoot * root)
 {
     Value v;
     state.autoCallFunction(autoArgs, vIn, v);
@@ -336,31 +454,30 @@ static void getDerivations(EvalState & state, Value & vIn,
            there are names clashes between derivations, the derivation
            bound to the attribute with the "lower" name should take
            precedence). */
-        for (auto & i : v.attrs->lexicographicOrder()) {
-            debug("evaluating attribute '%1%'", i->name);
-            if (!std::regex_match(std::string(i->name), attrRegex))
-                continue;
-            string pathPrefix2 = addToPath(pathPrefix, i->name);
-            if (combineChannels)
-                getDerivations(state, *i->value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
-            else if (getDerivation(state, *i->value, pathPrefix2, drvs, done, ignoreAssertionFailures)) {
-                /* If the value of this attribute is itself a set,
-                   should we recurse into it?  => Only if it has a
-                   `recurseForDerivations = true' attribute. */
-                if (i->value->type == tAttrs) {
-                    Bindings::iterator j = i->value->attrs->find(state.symbols.create("recurseForDerivations"));
-                    if (j != i->value->attrs->end() && state.forceBool(*j->value, *j->pos))
-                        getDerivations(state, *i->value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
-                }
+        std::vector<const Attr *> attrs;
+        for (auto & i : v.attrs->lexicographicOrder())
+            if (std::regex_match(std::string(i->name), attrRegex))
+                attrs.push_back(i);
+
+        /* The attributes of a package set can be evaluated
+           independently, so fork workers to process them in
+           parallel. */
+        if (root && !combineChannels && evalSettings.evalWorkers > 1)
+            getDerivationsForked(state, attrs, pathPrefix, autoArgs, drvs, ignoreAssertionFailures, *root);
+
+        else
+            for (auto i : attrs) {
+                debug("evaluating attribute '%1%'", i->name);
+                getDerivationsFromAttr(state, *i, addToPath(pathPrefix, i->name), autoArgs,
+                    drvs, done, ignoreAssertionFailures, combineChannels, root);
             }
-        }
     }
 
     else if (v.isList()) {
         for (unsigned int n = 0; n < v.listSize(); ++n) {
             string pathPrefix2 = addToPath(pathPrefix, (format("%1%") % n).str());
             if (getDerivation(state, *v.listElems()[n], pathPrefix2, drvs, done, ignoreAssertionFailures))
-                getDerivations(state, *v.listElems()[n], pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
+                getDerivations(state, *v.listElems()[n], pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures, root);
         }
     }
 
@@ -376,4 +493,13 @@ void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
 }
 
 
+void getDerivationsParallel(EvalState & state, Value & v, const string & pathPrefix,
+    Bindings & autoArgs, DrvInfos & drvs, bool ignoreAssertionFailures)
+{
+    Done done;
+    ParallelRoot root{v, pathPrefix};
+    getDerivations(state, v, pathPrefix, autoArgs, drvs, done, ignoreAssertionFailures, &root);
+}
+
+
 }
@@ -26,7 +26,16 @@ private:
 
     bool failed = false; // set if we get an AssertionError
 
-    Bindings * attrs = nullptr, * meta = nullptr;
+    mutable Bindings * attrs = nullptr;
+    Bindings * meta = nullptr;
+
+    /* If set, 'attrs' is obtained on demand by looking up
+       'rootAttrPath' in 'root' (see getDerivationsParallel()). */
+    Value * root = nullptr;
+    Bindings * rootAutoArgs = nullptr;
+    string rootAttrPath;
+
+    Bindings * getAttrs() const;
 
     Bindings * getMeta();
 
@@ -38,6 +47,8 @@ public:
     DrvInfo(EvalState & state) : state(&state) { };
     DrvInfo(EvalState & state, const string & attrPath, Bindings * attrs);
     DrvInfo(EvalState & state, ref<Store> store, const std::string & drvPathWithOutputs);
+    DrvInfo(EvalState & state, const string & attrPath,
+        Value & root, Bindings & autoArgs, const string & rootAttrPath);
 
     string queryName() const;
     string querySystem() const;
@@ -63,6 +74,8 @@ public:
     void setName(const string & s) { name = s; }
     void setDrvPath(const string & s) { drvPath = s; }
     void setOutPath(const string & s) { outPath = s; }
+    void setSystem(const string & s) { system = s; }
+    void setOutputs(const Outputs & o) { outputs = o; }
 
     void setFailed() { failed = true; };
     bool hasFailed() { return failed; };
@@ -85,5 +98,18 @@ void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
     Bindings & autoArgs, DrvInfos & drvs,
     bool ignoreAssertionFailures);
 
+/* Like getDerivations(), but if 'eval-workers' is greater than 1,
+   evaluate the attributes of package sets in parallel using
+   forkEvalWorkers(). The workers return the name, system, derivation
+   path and outputs of each derivation. Anything else (such as 'meta')
+   is evaluated in the calling process when it is first queried, by
+   looking up the derivation's attribute path in 'v' again, so 'v'
+   must stay reachable by the garbage collector. Since the workers
+   don't share a heap, derivations are deduplicated by derivation
+   path rather than by identity. */
+void getDerivationsParallel(EvalState & state, Value & v, const string & pathPrefix,
+    Bindings & autoArgs, DrvInfos & drvs,
+    bool ignoreAssertionFailures);
+
 
 }
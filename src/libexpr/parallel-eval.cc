@@ -0,0 +1,126 @@
+#include "parallel-eval.hh"
+#include "eval.hh"
+#include "store-api.hh"
+#include "download.hh"
+#include "util.hh"
+#include "serialise.hh"
+#include "sync.hh"
+#include "finally.hh"
+
+#include <atomic>
+#include <map>
+#include <thread>
+
+#include <sys/mman.h>
+
+namespace nix {
+
+void forkEvalWorkers(EvalState & state, size_t nrItems, size_t nrWorkers,
+    std::function<std::string(size_t item)> work,
+    std::function<void(size_t item, std::string && result)> done)
+{
+    if (nrWorkers > nrItems) nrWorkers = nrItems;
+
+    if (nrWorkers <= 1) {
+        for (size_t item = 0; item < nrItems; ++item)
+            done(item, work(item));
+        return;
+    }
+
+    /* The index of the next item to be claimed by a worker. */
+    void * p = mmap(nullptr, sizeof(std::atomic<size_t>),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw SysError("allocating shared memory");
+    Finally unmap([&]() { munmap(p, sizeof(std::atomic<size_t>)); });
+    auto nextItem = new (p) std::atomic<size_t>(0);
+
+    struct Result
+    {
+        bool ok;
+        std::string data;
+    };
+
+    Sync<std::map<size_t, Result>> results_;
+
+    /* Note: on error, the workers are killed (by ~Pid()) before the
+       reader threads are joined, since the readers only finish once
+       the workers have closed their pipes. */
+    std::vector<std::thread> readers;
+
+    Finally joinReaders([&]() {
+        for (auto & thread : readers)
+            if (thread.joinable()) thread.join();
+    });
+
+    std::list<Pid> pids;
+
+    for (size_t n = 0; n < nrWorkers; ++n) {
+        Pipe pipe;
+        pipe.create();
+
+        ProcessOptions options;
+        options.allowVfork = false;
+
+        pids.emplace_back(startProcess([&]() {
+            pipe.readSide = -1;
+            /* The parent's logger, downloader and store connections
+               may be in use by (or locked by) threads that don't exist
+               here. */
+            logger = makeDefaultLogger();
+            resetDownloaderAfterFork();
+            state.store = openStore();
+            FdSink sink(pipe.writeSide.get());
+            while (true) {
+                size_t item = (*nextItem)++;
+                if (item >= nrItems) break;
+                try {
+                    auto data = work(item);
+                    sink << item << (uint64_t) 1 << data;
+                } catch (std::exception & e) {
+                    sink << item << (uint64_t) 0 << std::string(e.what());
+                }
+                sink.flush();
+            }
+            _exit(0);
+        }, options));
+
+        pipe.writeSide = -1;
+
+        /* Read the results of this worker in a separate thread so that
+           no worker blocks on a full pipe. */
+        readers.emplace_back([&results_, fd{std::make_shared<AutoCloseFD>(std::move(pipe.readSide))}]() {
+            FdSource source(fd->get());
+            try {
+                while (true) {
+                    auto item = readNum<size_t>(source);
+                    bool ok = readInt(source);
+                    auto data = readString(source);
+                    results_.lock()->emplace(item, Result{ok, std::move(data)});
+                }
+            } catch (EndOfFile &) {
+            }
+        });
+    }
+
+    for (auto & thread : readers)
+        thread.join();
+
+    for (auto & pid : pids) {
+        int status = pid.wait();
+        if (status != 0)
+            throw Error("evaluation worker %s", statusToString(status));
+    }
+
+    auto results(results_.lock());
+
+    for (size_t item = 0; item < nrItems; ++item) {
+        auto i = results->find(item);
+        if (i == results->end())
+            throw Error("evaluation worker did not return a result for item %d", item);
+        if (!i->second.ok)
+            throw Error(i->second.data);
+        done(item, std::move(i->second.data));
+    }
+}
+
+}
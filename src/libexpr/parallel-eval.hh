@@ -0,0 +1,38 @@
+#pragma once
+
+#include "types.hh"
+
+#include <functional>
+
+namespace nix {
+
+class EvalState;
+
+/* Process 'nrItems' independent work items (such as the top-level
+   attributes of a package set) using up to 'nrWorkers' forked child
+   processes. The evaluator is not thread-safe, so rather than sharing
+   one heap between threads, each child inherits a copy-on-write
+   snapshot of the parent's evaluator state and repeatedly claims the
+   next unprocessed item from a counter in shared memory, so that
+   expensive items don't hold up the others.
+
+   'work' is called in a child process for each item and must return
+   its result as a string. 'done' is called in the parent for every
+   item, in ascending order, once all items have been processed. If
+   'work' throws an exception, the first such error is rethrown in the
+   parent. If 'nrWorkers' is 1, everything happens in the calling
+   process.
+
+   The children are forked without exec, and only the calling thread
+   survives fork(). So each child replaces everything that other
+   threads of the parent may be using: it gets a new default logger
+   and downloader, and opens a new connection to the store (using
+   openStore(), i.e. the 'store' setting) as 'state.store'. 'work'
+   must not use anything else that belongs to other threads of the
+   parent. Callers should stop any progress bar before calling this
+   function, since the children write to the same terminal. */
+void forkEvalWorkers(EvalState & state, size_t nrItems, size_t nrWorkers,
+    std::function<std::string(size_t item)> work,
+    std::function<void(size_t item, std::string && result)> done);
+
+}
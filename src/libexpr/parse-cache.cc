@@ -0,0 +1,815 @@
+#include "parse-cache.hh"
+#include "eval.hh"
+#include "globals.hh"
+#include "util.hh"
+#include "finally.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+
+/* Serialised parse trees consist of a symbol table (all strings in
+   the tree, stored once) followed by the expressions in pre-order.
+   Each expression starts with a tag byte. Expressions that are
+   referenced from more than one place in the tree (such as the
+   source of an 'inherit (e) ...') are written once and then referred
+   to by number using the 'tagRef' tag. */
+
+static const char parseCacheMagic[] = "nixast01";
+
+enum : uint8_t {
+    tagNull = 0, tagRef,
+    tagInt, tagFloat, tagString, tagPath, tagVar, tagSelect,
+    tagOpHasAttr, tagAttrs, tagList, tagLambda, tagLet, tagWith,
+    tagIf, tagAssert, tagOpNot, tagApp, tagOpEq, tagOpNEq, tagOpAnd,
+    tagOpOr, tagOpImpl, tagOpUpdate, tagOpConcatLists, tagConcatStrings,
+    tagPos,
+};
+
+
+struct ExprWriter
+{
+    std::string out;
+    std::string symbolData;
+    uint32_t nrSymbols = 0;
+    std::map<const string *, uint32_t> symbolIds;
+    std::map<Expr *, uint32_t> exprIds;
+
+    void writeInt(uint64_t n)
+    {
+        /* Variable-length encoding: 7 bits per byte, high bit set on
+           all but the last byte. */
+        do {
+            uint8_t b = n & 0x7f;
+            n >>= 7;
+            out.push_back(b | (n ? 0x80 : 0));
+        } while (n);
+    }
+
+    void writeBytes(std::string & dst, const std::string & s)
+    {
+        std::swap(out, dst);
+        writeInt(s.size());
+        out.append(s);
+        std::swap(out, dst);
+    }
+
+    void writeSymbol(const Symbol & sym)
+    {
+        if (!sym.set()) { writeInt(0); return; }
+        const string * key = &(const string &) sym;
+        auto i = symbolIds.find(key);
+        if (i == symbolIds.end()) {
+            i = symbolIds.emplace(key, ++nrSymbols).first;
+            writeBytes(symbolData, *key);
+        }
+        writeInt(i->second);
+    }
+
+    void writePos(const Pos & pos)
+    {
+        writeSymbol(pos.file);
+        writeInt(pos.line);
+        writeInt(pos.column);
+    }
+
+    void writeAttrPath(const AttrPath & attrPath)
+    {
+        writeInt(attrPath.size());
+        for (auto & i : attrPath) {
+            writeSymbol(i.symbol);
+            if (!i.symbol.set()) writeExpr(i.expr);
+        }
+    }
+
+    template<typename T>
+    bool writeBinOp(Expr * e, uint8_t tag)
+    {
+        auto e2 = dynamic_cast<T *>(e);
+        if (!e2) return false;
+        out.push_back(tag);
+        writePos(e2->pos);
+        writeExpr(e2->e1);
+        writeExpr(e2->e2);
+        return true;
+    }
+
+    void writeExpr(Expr * e)
+    {
+        if (!e) { out.push_back(tagNull); return; }
+
+        auto i = exprIds.find(e);
+        if (i != exprIds.end()) {
+            out.push_back(tagRef);
+            writeInt(i->second);
+            return;
+        }
+        exprIds.emplace(e, exprIds.size());
+
+        if (auto e2 = dynamic_cast<ExprInt *>(e)) {
+            out.push_back(tagInt);
+            writeInt(e2->n);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprFloat *>(e)) {
+            out.push_back(tagFloat);
+            uint64_t n;
+            static_assert(sizeof(n) == sizeof(e2->nf), "unexpected float size");
+            memcpy(&n, &e2->nf, sizeof(n));
+            writeInt(n);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprString *>(e)) {
+            out.push_back(tagString);
+            writeSymbol(e2->s);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprPath *>(e)) {
+            out.push_back(tagPath);
+            writeBytes(out, e2->s);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprVar *>(e)) {
+            out.push_back(tagVar);
+            writePos(e2->pos);
+            writeSymbol(e2->name);
+            writeInt(e2->fromWith);
+            writeInt(e2->level);
+            writeInt(e2->fromWith ? 0 : e2->displ);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+            out.push_back(tagSelect);
+            writePos(e2->pos);
+            writeExpr(e2->e);
+            writeExpr(e2->def);
+            writeAttrPath(e2->attrPath);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+            out.push_back(tagOpHasAttr);
+            writeExpr(e2->e);
+            writeAttrPath(e2->attrPath);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAttrs *>(e)) {
+            out.push_back(tagAttrs);
+            writeInt(e2->recursive);
+            writeInt(e2->attrs.size());
+            for (auto & j : e2->attrs) {
+                writeSymbol(j.first);
+                writeInt(j.second.inherited);
+                writeExpr(j.second.e);
+                writePos(j.second.pos);
+                writeInt(e2->recursive ? j.second.displ : 0);
+            }
+            writeInt(e2->dynamicAttrs.size());
+            for (auto & j : e2->dynamicAttrs) {
+                writeExpr(j.nameExpr);
+                writeExpr(j.valueExpr);
+                writePos(j.pos);
+            }
+        }
+
+        else if (auto e2 = dynamic_cast<ExprList *>(e)) {
+            out.push_back(tagList);
+            writeInt(e2->elems.size());
+            for (auto & j : e2->elems)
+                writeExpr(j);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLambda *>(e)) {
+            out.push_back(tagLambda);
+            writePos(e2->pos);
+            writeSymbol(e2->name);
+            writeSymbol(e2->arg);
+            writeInt(e2->matchAttrs);
+            if (e2->matchAttrs) {
+                writeInt(e2->formals->ellipsis);
+                writeInt(e2->formals->formals.size());
+                for (auto & j : e2->formals->formals) {
+                    writeSymbol(j.name);
+                    writeExpr(j.def);
+                }
+            }
+            writeExpr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLet *>(e)) {
+            out.push_back(tagLet);
+            writeInt(e2->attrs->attrs.size());
+            for (auto & j : e2->attrs->attrs) {
+                writeSymbol(j.first);
+                writeInt(j.second.inherited);
+                writeExpr(j.second.e);
+                writePos(j.second.pos);
+                writeInt(j.second.displ);
+            }
+            writeExpr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprWith *>(e)) {
+            out.push_back(tagWith);
+            writePos(e2->pos);
+            writeInt(e2->prevWith);
+            writeExpr(e2->attrs);
+            writeExpr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+            out.push_back(tagIf);
+            writeExpr(e2->cond);
+            writeExpr(e2->then);
+            writeExpr(e2->else_);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+            out.push_back(tagAssert);
+            writePos(e2->pos);
+            writeExpr(e2->cond);
+            writeExpr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpNot *>(e)) {
+            out.push_back(tagOpNot);
+            writeExpr(e2->e);
+        }
+
+        else if (writeBinOp<ExprApp>(e, tagApp)) ;
+        else if (writeBinOp<ExprOpEq>(e, tagOpEq)) ;
+        else if (writeBinOp<ExprOpNEq>(e, tagOpNEq)) ;
+        else if (writeBinOp<ExprOpAnd>(e, tagOpAnd)) ;
+        else if (writeBinOp<ExprOpOr>(e, tagOpOr)) ;
+        else if (writeBinOp<ExprOpImpl>(e, tagOpImpl)) ;
+        else if (writeBinOp<ExprOpUpdate>(e, tagOpUpdate)) ;
+        else if (writeBinOp<ExprOpConcatLists>(e, tagOpConcatLists)) ;
+
+        else if (auto e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+            out.push_back(tagConcatStrings);
+            writePos(e2->pos);
+            writeInt(e2->forceString);
+            writeInt(e2->es->size());
+            for (auto & j : *e2->es)
+                writeExpr(j);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprPos *>(e)) {
+            out.push_back(tagPos);
+            writePos(e2->pos);
+        }
+
+        else
+            throw Error("cannot serialise expression '%s'", *e);
+    }
+};
+
+
+std::string serialiseExpr(Expr * e)
+{
+    ExprWriter writer;
+    writer.writeExpr(e);
+
+    std::string res(parseCacheMagic, sizeof(parseCacheMagic) - 1);
+    std::swap(writer.out, res);
+    writer.writeInt(writer.nrSymbols);
+    writer.out.append(writer.symbolData);
+    writer.out.append(res);
+    return writer.out;
+}
+
+
+struct ExprReader
+{
+    const char * p, * end;
+    std::vector<Symbol> symbols;
+    std::vector<Expr *> exprs;
+
+    /* The environments that the expression being read is evaluated
+       in, innermost last, mirroring the StaticEnvs of bindVars(). The
+       stored variable levels and displacements are checked against
+       these, since the evaluator uses them without bounds checks. */
+    struct Scope
+    {
+        bool isWith;
+        size_t size;
+        size_t id;
+    };
+    std::vector<Scope> scopes;
+    size_t nextScopeId = 0;
+
+    /* The innermost scope of each expression in 'exprs', or
+       'noScope' while the expression is still being read. A reference
+       to an expression is only valid in the same scope, since the
+       expression's variables were checked against that scope, and
+       only once it has been read, so that the tree has no cycles. */
+    static constexpr size_t noScope = std::numeric_limits<size_t>::max();
+    std::vector<size_t> exprScopes;
+
+    void pushScope(bool isWith, size_t size)
+    {
+        scopes.push_back({isWith, size, nextScopeId++});
+    }
+
+    [[noreturn]] void corrupt()
+    {
+        throw Error("serialised parse tree is corrupt");
+    }
+
+    uint64_t readInt()
+    {
+        uint64_t n = 0;
+        for (unsigned int shift = 0; ; shift += 7) {
+            if (p == end || shift > 63) corrupt();
+            uint8_t b = *p++;
+            n |= (uint64_t) (b & 0x7f) << shift;
+            if (!(b & 0x80)) return n;
+        }
+    }
+
+    string readString()
+    {
+        auto len = readInt();
+        if (len > (size_t) (end - p)) corrupt();
+        string s(p, len);
+        p += len;
+        return s;
+    }
+
+    Symbol readSymbol()
+    {
+        auto n = readInt();
+        if (n == 0) return Symbol();
+        if (n > symbols.size()) corrupt();
+        return symbols[n - 1];
+    }
+
+    Pos readPos()
+    {
+        auto file = readSymbol();
+        auto line = readInt();
+        auto column = readInt();
+        return Pos(file, line, column);
+    }
+
+    AttrPath readAttrPath()
+    {
+        AttrPath attrPath;
+        auto n = readInt();
+        for (uint64_t i = 0; i < n; ++i) {
+            auto sym = readSymbol();
+            if (sym.set())
+                attrPath.emplace_back(sym);
+            else
+                attrPath.emplace_back(readExpr());
+        }
+        return attrPath;
+    }
+
+    Expr * readNonNullExpr()
+    {
+        auto e = readExpr();
+        if (!e) corrupt();
+        return e;
+    }
+
+    template<typename T>
+    Expr * readBinOp(size_t id)
+    {
+        auto pos = readPos();
+        auto e = new T(pos, nullptr, nullptr);
+        exprs[id] = e;
+        e->e1 = readNonNullExpr();
+        e->e2 = readNonNullExpr();
+        return e;
+    }
+
+    /* Read an attribute of a 'rec' set or a 'let' if 'scoped' is set,
+       in which case the innermost scope is the one created by that
+       set. Inherited attributes are evaluated in the enclosing
+       scope. */
+    ExprAttrs::AttrDef readAttrDef(bool scoped)
+    {
+        ExprAttrs::AttrDef def;
+        def.inherited = readInt();
+        if (scoped && def.inherited) {
+            auto scope = scopes.back();
+            scopes.pop_back();
+            def.e = readNonNullExpr();
+            scopes.push_back(scope);
+        } else
+            def.e = readNonNullExpr();
+        def.pos = readPos();
+        def.displ = readInt();
+        if (scoped && def.displ >= scopes.back().size) corrupt();
+        return def;
+    }
+
+    const Scope & scopeAt(uint64_t level)
+    {
+        if (level >= scopes.size()) corrupt();
+        return scopes[scopes.size() - 1 - level];
+    }
+
+    Expr * readExpr()
+    {
+        if (p == end) corrupt();
+        uint8_t tag = *p++;
+
+        if (tag == tagNull) return nullptr;
+
+        if (tag == tagRef) {
+            auto n = readInt();
+            if (n >= exprs.size() || !exprs[n] || exprScopes[n] != scopes.back().id)
+                corrupt();
+            return exprs[n];
+        }
+
+        /* Reserve this expression's number now, since it's assigned
+           in pre-order. Compound expressions register themselves
+           before reading their children. */
+        size_t id = exprs.size();
+        exprs.push_back(nullptr);
+        exprScopes.push_back(noScope);
+
+        Expr * res;
+
+        switch (tag) {
+
+        case tagInt:
+            res = new ExprInt(readInt());
+            break;
+
+        case tagFloat: {
+            uint64_t n = readInt();
+            NixFloat nf;
+            memcpy(&nf, &n, sizeof(nf));
+            res = new ExprFloat(nf);
+            break;
+        }
+
+        case tagString:
+            res = new ExprString(readSymbol());
+            break;
+
+        case tagPath:
+            res = new ExprPath(readString());
+            break;
+
+        case tagVar: {
+            auto pos = readPos();
+            auto e = new ExprVar(pos, readSymbol());
+            e->fromWith = readInt();
+            e->level = readInt();
+            e->displ = readInt();
+            auto & scope = scopeAt(e->level);
+            if (e->fromWith ? !scope.isWith : scope.isWith || e->displ >= scope.size)
+                corrupt();
+            res = e;
+            break;
+        }
+
+        case tagSelect: {
+            auto pos = readPos();
+            auto e = new ExprSelect(pos, nullptr, AttrPath(), nullptr);
+            exprs[id] = e;
+            e->e = readNonNullExpr();
+            e->def = readExpr();
+            e->attrPath = readAttrPath();
+            res = e;
+            break;
+        }
+
+        case tagOpHasAttr: {
+            auto e = new ExprOpHasAttr(nullptr, AttrPath());
+            exprs[id] = e;
+            e->e = readNonNullExpr();
+            e->attrPath = readAttrPath();
+            res = e;
+            break;
+        }
+
+        case tagAttrs: {
+            auto e = new ExprAttrs;
+            exprs[id] = e;
+            e->recursive = readInt();
+            auto n = readInt();
+            if (e->recursive) pushScope(false, n);
+            for (uint64_t i = 0; i < n; ++i) {
+                auto name = readSymbol();
+                e->attrs[name] = readAttrDef(e->recursive);
+            }
+            if (e->attrs.size() != n) corrupt();
+            n = readInt();
+            for (uint64_t i = 0; i < n; ++i) {
+                auto nameExpr = readNonNullExpr();
+                auto valueExpr = readNonNullExpr();
+                e->dynamicAttrs.emplace_back(nameExpr, valueExpr, readPos());
+            }
+            if (e->recursive) scopes.pop_back();
+            res = e;
+            break;
+        }
+
+        case tagList: {
+            auto e = new ExprList;
+            exprs[id] = e;
+            auto n = readInt();
+            for (uint64_t i = 0; i < n; ++i)
+                e->elems.push_back(readNonNullExpr());
+            res = e;
+            break;
+        }
+
+        case tagLambda: {
+            auto pos = readPos();
+            auto name = readSymbol();
+            auto arg = readSymbol();
+            if (!arg.set()) corrupt();
+            bool matchAttrs = readInt();
+            Formals * formals = nullptr;
+            pushScope(false, arg.empty() ? 0 : 1);
+            if (matchAttrs) {
+                formals = new Formals;
+                formals->ellipsis = readInt();
+                auto n = readInt();
+                scopes.back().size += n;
+                for (uint64_t i = 0; i < n; ++i) {
+                    auto name = readSymbol();
+                    formals->formals.emplace_back(name, readExpr());
+                    formals->argNames.insert(name);
+                }
+            }
+            auto e = new ExprLambda(pos, arg, matchAttrs, formals, nullptr);
+            e->name = name;
+            exprs[id] = e;
+            e->body = readNonNullExpr();
+            scopes.pop_back();
+            res = e;
+            break;
+        }
+
+        case tagLet: {
+            auto attrs = new ExprAttrs;
+            auto e = new ExprLet(attrs, nullptr);
+            exprs[id] = e;
+            auto n = readInt();
+            pushScope(false, n);
+            for (uint64_t i = 0; i < n; ++i) {
+                auto name = readSymbol();
+                attrs->attrs[name] = readAttrDef(true);
+            }
+            if (attrs->attrs.size() != n) corrupt();
+            e->body = readNonNullExpr();
+            scopes.pop_back();
+            res = e;
+            break;
+        }
+
+        case tagWith: {
+            auto pos = readPos();
+            auto e = new ExprWith(pos, nullptr, nullptr);
+            exprs[id] = e;
+            e->prevWith = readInt();
+            /* 'prevWith' counts from the enclosing scope, at level 1. */
+            if (e->prevWith && !scopeAt(e->prevWith - 1).isWith) corrupt();
+            e->attrs = readNonNullExpr();
+            pushScope(true, 1);
+            e->body = readNonNullExpr();
+            scopes.pop_back();
+            res = e;
+            break;
+        }
+
+        case tagIf: {
+            auto e = new ExprIf(nullptr, nullptr, nullptr);
+            exprs[id] = e;
+            e->cond = readNonNullExpr();
+            e->then = readNonNullExpr();
+            e->else_ = readNonNullExpr();
+            res = e;
+            break;
+        }
+
+        case tagAssert: {
+            auto pos = readPos();
+            auto e = new ExprAssert(pos, nullptr, nullptr);
+            exprs[id] = e;
+            e->cond = readNonNullExpr();
+            e->body = readNonNullExpr();
+            res = e;
+            break;
+        }
+
+        case tagOpNot: {
+            auto e = new ExprOpNot(nullptr);
+            exprs[id] = e;
+            e->e = readNonNullExpr();
+            res = e;
+            break;
+        }
+
+        case tagApp: res = readBinOp<ExprApp>(id); break;
+        case tagOpEq: res = readBinOp<ExprOpEq>(id); break;
+        case tagOpNEq: res = readBinOp<ExprOpNEq>(id); break;
+        case tagOpAnd: res = readBinOp<ExprOpAnd>(id); break;
+        case tagOpOr: res = readBinOp<ExprOpOr>(id); break;
+        case tagOpImpl: res = readBinOp<ExprOpImpl>(id); break;
+        case tagOpUpdate: res = readBinOp<ExprOpUpdate>(id); break;
+        case tagOpConcatLists: res = readBinOp<ExprOpConcatLists>(id); break;
+
+        case tagConcatStrings: {
+            auto pos = readPos();
+            bool forceString = readInt();
+            auto es = new vector<Expr *>;
+            auto e = new ExprConcatStrings(pos, forceString, es);
+            exprs[id] = e;
+            auto n = readInt();
+            for (uint64_t i = 0; i < n; ++i)
+                es->push_back(readNonNullExpr());
+            res = e;
+            break;
+        }
+
+        case tagPos:
+            res = new ExprPos(readPos());
+            break;
+
+        default:
+            corrupt();
+        }
+
+        exprs[id] = res;
+        exprScopes[id] = scopes.back().id;
+        return res;
+    }
+};
+
+
+Expr * deserialiseExpr(SymbolTable & symbols, size_t baseEnvSize,
+    const char * data, size_t size)
+{
+    ExprReader reader;
+    reader.p = data;
+    reader.end = data + size;
+    reader.pushScope(false, baseEnvSize);
+
+    size_t magicLen = sizeof(parseCacheMagic) - 1;
+    if (size < magicLen || memcmp(data, parseCacheMagic, magicLen) != 0)
+        reader.corrupt();
+    reader.p += magicLen;
+
+    auto nrSymbols = reader.readInt();
+    for (uint64_t i = 0; i < nrSymbols; ++i)
+        reader.symbols.push_back(symbols.create(reader.readString()));
+
+    auto e = reader.readNonNullExpr();
+    if (reader.p != reader.end) reader.corrupt();
+    return e;
+}
+
+
+/* The parse cache stores serialised parse trees in
+   ~/.cache/nix/parse-cache-v1, named after a hash of the file's path
+   and contents, the Nix version, the home directory (which ~/ paths
+   are resolved against) and the variables in the base environment
+   (whose displacements are baked into the tree). The
+   first line of each entry records how long the original parse
+   took, so that printStats() can report the time saved.
+
+   The mtime of an entry is the last time it was used (updated at
+   most once a day). Entries that haven't been used for
+   'parse-cache-max-age' seconds are removed when a new entry is
+   added, at most once a day. */
+
+static const time_t parseCacheTouchInterval = 24 * 60 * 60;
+
+Path EvalState::parseCachePath(const Path & path, const string & contents)
+{
+    if (baseEnvFingerprint.empty()) {
+        /* The variables are ordered by symbol address, which varies
+           between runs, so sort them by name first. */
+        std::vector<std::pair<string, unsigned int>> vars;
+        for (auto & i : staticBaseEnv.vars)
+            vars.emplace_back(i.first, i.second);
+        std::sort(vars.begin(), vars.end());
+        string s;
+        for (auto & i : vars)
+            s += i.first + "=" + std::to_string(i.second) + ";";
+        baseEnvFingerprint = hashString(htSHA256, s).to_string(Base32, false);
+    }
+
+    auto key = hashString(htSHA256,
+        nixVersion + ":" + baseEnvFingerprint + ":" + getHome() + ":" + path + ":" + contents);
+
+    return getCacheDir() + "/nix/parse-cache-v1/" + key.to_string(Base32, false);
+}
+
+
+Expr * EvalState::lookupParseCache(const Path & cachePath)
+{
+    /* Problems with the cache are never fatal: a cache entry that
+       can't be read is treated as a miss. */
+    AutoCloseFD fd = open(cachePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) {
+        if (errno != ENOENT)
+            printError("warning: cannot open parse cache entry '%s': %s", cachePath, strerror(errno));
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1 || st.st_size == 0) return nullptr;
+
+    if (st.st_mtime < time(0) - parseCacheTouchInterval)
+        futimens(fd.get(), nullptr);
+
+    auto start = std::chrono::steady_clock::now();
+
+    void * data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+    if (data == MAP_FAILED) {
+        printError("warning: cannot map parse cache entry '%s': %s", cachePath, strerror(errno));
+        return nullptr;
+    }
+    Finally unmap([&]() { munmap(data, st.st_size); });
+
+    auto p = (const char *) data;
+    auto nl = (const char *) memchr(p, '\n', st.st_size);
+    if (!nl) return nullptr;
+
+    uint64_t parseTime;
+    if (!string2Int(string(p, nl - p), parseTime)) return nullptr;
+
+    Expr * e;
+    try {
+        e = deserialiseExpr(symbols, baseEnvDispl, nl + 1, st.st_size - (nl + 1 - p));
+    } catch (Error & e) {
+        printError("warning: ignoring parse cache entry '%s': %s", cachePath, e.what());
+        return nullptr;
+    }
+
+    auto loadTime = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+
+    nrParseCacheHits++;
+    parseTimeSaved += parseTime > (uint64_t) loadTime ? parseTime - loadTime : 0;
+
+    return e;
+}
+
+
+static void pruneParseCache(const Path & cacheDir)
+{
+    if (!evalSettings.parseCacheMaxAge) return;
+
+    auto now = time(0);
+
+    Path stampPath = cacheDir + "/.last-prune";
+    struct stat st;
+    if (lstat(stampPath.c_str(), &st) == 0 && st.st_mtime >= now - parseCacheTouchInterval)
+        return;
+    writeFile(stampPath, "");
+
+    for (auto & i : readDirectory(cacheDir)) {
+        Path entry = cacheDir + "/" + i.name;
+        if (entry == stampPath) continue;
+        if (lstat(entry.c_str(), &st) == -1) continue;
+        if (st.st_mtime >= now - (time_t) evalSettings.parseCacheMaxAge) continue;
+        debug("removing unused parse cache entry '%s'", entry);
+        deletePath(entry);
+    }
+}
+
+
+void EvalState::addToParseCache(const Path & cachePath, Expr * e, uint64_t parseTime)
+{
+    try {
+        auto data = std::to_string(parseTime) + "\n" + serialiseExpr(e);
+        createDirs(dirOf(cachePath));
+        Path tmp = cachePath + ".tmp." + std::to_string(getpid());
+        writeFile(tmp, data);
+        if (rename(tmp.c_str(), cachePath.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, cachePath);
+    } catch (Error & e) {
+        printError("warning: cannot write parse cache entry '%s': %s", cachePath, e.what());
+    }
+
+    if (!parseCachePruned) {
+        parseCachePruned = true;
+        try {
+            pruneParseCache(dirOf(cachePath));
+        } catch (Error & e) {
+            printError("warning: cannot prune parse cache: %s", e.what());
+        }
+    }
+}
+
+
+}
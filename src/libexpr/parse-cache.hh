@@ -0,0 +1,21 @@
+#pragma once
+
+#include "nixexpr.hh"
+
+namespace nix {
+
+/* Serialise a parse tree to a compact binary representation. The
+   tree must already have been processed by bindVars(), since the
+   resolved variable levels and displacements are stored as well, so
+   that deserialising doesn't need to repeat variable resolution. */
+std::string serialiseExpr(Expr * e);
+
+/* Reconstruct a parse tree from the output of serialiseExpr(),
+   interning its symbols in 'symbols'. The tree must have been bound
+   in a base environment of 'baseEnvSize' variables. Throws an Error
+   if 'data' is malformed, including if a variable's level or
+   displacement is out of range. */
+Expr * deserialiseExpr(SymbolTable & symbols, size_t baseEnvSize,
+    const char * data, size_t size);
+
+}
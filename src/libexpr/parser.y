@@ -537,6 +537,8 @@ formal
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <chrono>
+
 #include "eval.hh"
 #include "download.hh"
 #include "store-api.hh"
@@ -548,6 +550,8 @@ namespace nix {
 Expr * EvalState::parse(const char * text,
     const Path & path, const Path & basePath, StaticEnv & staticEnv)
 {
+    auto start = std::chrono::steady_clock::now();
+
     yyscan_t scanner;
     ParseData data(*this);
     data.basePath = basePath;
@@ -562,6 +566,10 @@ Expr * EvalState::parse(const char * text,
 
     data.result->bindVars(staticEnv);
 
+    nrParses++;
+    parseTime += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+
     return data.result;
 }
 
@@ -596,7 +604,21 @@ Expr * EvalState::parseExprFromFile(const Path & path)
 
 Expr * EvalState::parseExprFromFile(const Path & path, StaticEnv & staticEnv)
 {
-    return parse(readFile(path).c_str(), path, dirOf(path), staticEnv);
+    auto contents = readFile(path);
+
+    /* Only trees bound in the base environment can be cached, since
+       other static environments (e.g. from scopedImport) differ
+       between calls. */
+    if (!evalSettings.parseCache || &staticEnv != &staticBaseEnv)
+        return parse(contents.c_str(), path, dirOf(path), staticEnv);
+
+    auto cachePath = parseCachePath(path, contents);
+    if (auto e = lookupParseCache(cachePath)) return e;
+
+    auto before = parseTime;
+    auto e = parse(contents.c_str(), path, dirOf(path), staticEnv);
+    addToParseCache(cachePath, e, parseTime - before);
+    return e;
 }
 
 
@@ -657,6 +679,7 @@ Path EvalState::findFile(SearchPath & searchPath, const string & path, const Pos
         auto r = resolveSearchPathElem(i);
         if (!r.first) continue;
         Path res = r.second + suffix;
+        if (trackedInputs) trackedInputs->insert(res);
         if (pathExists(res)) return canonPath(res);
     }
     format f = format(
@@ -669,6 +692,9 @@ Path EvalState::findFile(SearchPath & searchPath, const string & path, const Pos
 
 std::pair<bool, std::string> EvalState::resolveSearchPathElem(const SearchPathElem & elem)
 {
+    /* The contents behind a URI can change without notice. */
+    if (isUri(elem.second)) impure = true;
+
     auto i = searchPathResolved.find(elem.second);
     if (i != searchPathResolved.end()) return i->second;
 
@@ -142,7 +142,7 @@ static void prim_scopedImport(EvalState & state, const Pos & pos, Value * * args
             }
 
             printTalkative("evaluating file '%1%'", realPath);
-            Expr * e = state.parseExprFromFile(resolveExprPath(realPath), staticEnv);
+            Expr * e = state.parseExprFromFile(state.checkSourcePath(resolveExprPath(realPath)), staticEnv);
 
             e->eval(state, *env, v);
         }
@@ -214,6 +214,8 @@ void prim_exec(EvalState & state, const Pos & pos, Value * * args, Value & v)
             % program % e.path % pos);
     }
 
+    state.impure = true;
+
     auto output = runProgram(program, true, commandArgs);
     Expr * parsed;
     try {
@@ -469,7 +471,22 @@ static void prim_tryEval(EvalState & state, const Pos & pos, Value * * args, Val
 static void prim_getEnv(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     string name = state.forceStringNoCtx(*args[0], pos);
-    mkString(v, evalSettings.restrictEval || evalSettings.pureEval ? "" : getEnv(name));
+    if (evalSettings.restrictEval || evalSettings.pureEval)
+        mkString(v, "");
+    else {
+        state.impure = true;
+        mkString(v, getEnv(name));
+    }
+}
+
+
+/* Return the current time. 'builtins.currentTime' is bound to an
+   application of this function (rather than to an integer) so that
+   using it marks the evaluation as impure. */
+static void prim_currentTime(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.impure = true;
+    mkInt(v, time(0));
 }
 
 
@@ -1043,6 +1060,8 @@ static void addPath(EvalState & state, const Pos & pos, const string & name, con
     const auto path = evalSettings.pureEval && expectedHash ?
         path_ :
         state.checkSourcePath(path_);
+    if (!(evalSettings.pureEval && expectedHash))
+        state.trackInputTree(path);
     PathFilter filter = filterFun ? ([&](const Path & path) {
         auto st = lstat(path);
 
@@ -2087,6 +2106,8 @@ void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
     if (evalSettings.pureEval && !request.expectedHash)
         throw Error("in pure evaluation mode, '%s' requires a 'sha256' argument", who);
 
+    if (!request.expectedHash) state.impure = true;
+
     auto res = getDownloader()->downloadCached(state.store, request);
 
     if (state.allowedPaths)
@@ -2153,7 +2174,10 @@ void EvalState::createBaseEnv()
     };
 
     if (!evalSettings.pureEval) {
-        mkInt(v, time(0));
+        Value * vCurrentTime = allocValue();
+        vCurrentTime->type = tPrimOp;
+        vCurrentTime->primOp = new PrimOp(prim_currentTime, 1, symbols.create("currentTime"));
+        mkApp(v, *vCurrentTime, vEmptySet);
         addConstant("__currentTime", v);
     }
 
@@ -229,6 +229,10 @@ static void prim_fetchGit(EvalState & state, const Pos & pos, Value * * args, Va
     // whitelist. Ah well.
     state.checkURI(url);
 
+    /* Without a revision, the result depends on the current state of
+       the repository. */
+    if (rev == "") state.impure = true;
+
     auto gitInfo = exportGit(state.store, url, ref, rev, name);
 
     state.mkAttrs(v, 8);
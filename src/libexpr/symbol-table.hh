@@ -53,6 +53,13 @@ public:
         return s->empty();
     }
 
+    /* A hash of the symbol, derived from its address (so that it's
+       cheap to compute but only stable within a process). */
+    uint32_t hash() const
+    {
+        return ((uint64_t) (uintptr_t) s * 0x9e3779b97f4a7c15ULL) >> 32;
+    }
+
     friend std::ostream & operator << (std::ostream & str, const Symbol & sym);
 };
 
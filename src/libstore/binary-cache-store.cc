@@ -16,6 +16,8 @@
 #include <future>
 #include <regex>
 
+#include <fcntl.h>
+
 #include <nlohmann/json.hpp>
 
 namespace nix {
@@ -38,23 +40,35 @@ void BinaryCacheStore::init()
     auto cacheInfo = getFile(cacheInfoFile);
     if (!cacheInfo) {
         upsertFile(cacheInfoFile, "StoreDir: " + storeDir + "\n", "text/x-nix-cache-info");
-    } else {
-        for (auto & line : tokenizeString<Strings>(*cacheInfo, "\n")) {
-            size_t colon = line.find(':');
-            if (colon == std::string::npos) continue;
-            auto name = line.substr(0, colon);
-            auto value = trim(line.substr(colon + 1, std::string::npos));
-            if (name == "StoreDir") {
-                if (value != storeDir)
-                    throw Error(format("binary cache '%s' is for Nix stores with prefix '%s', not '%s'")
-                        % getUri() % value % storeDir);
-            } else if (name == "WantMassQuery") {
-                wantMassQuery_ = value == "1";
-            } else if (name == "Priority") {
-                string2Int(value, priority);
-            }
+        *narInfoIndexPrefix.lock() = 0;
+    } else
+        parseCacheInfo(*cacheInfo);
+}
+
+void BinaryCacheStore::parseCacheInfo(const std::string & cacheInfo)
+{
+    size_t indexPrefix = 0;
+
+    for (auto & line : tokenizeString<Strings>(cacheInfo, "\n")) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        auto name = line.substr(0, colon);
+        auto value = trim(line.substr(colon + 1, std::string::npos));
+        if (name == "StoreDir") {
+            if (value != storeDir)
+                throw Error(format("binary cache '%s' is for Nix stores with prefix '%s', not '%s'")
+                    % getUri() % value % storeDir);
+        } else if (name == "WantMassQuery") {
+            wantMassQuery_ = value == "1";
+        } else if (name == "Priority") {
+            string2Int(value, priority);
+        } else if (name == "NarInfoIndex") {
+            if (!string2Int(value, indexPrefix) || indexPrefix > 4)
+                indexPrefix = 0;
         }
     }
+
+    *narInfoIndexPrefix.lock() = indexPrefix;
 }
 
 void BinaryCacheStore::getFile(const std::string & path,
@@ -114,10 +128,52 @@ void BinaryCacheStore::writeNarInfo(ref<NarInfo> narInfo)
         diskCache->upsertNarInfo(getUri(), hashPart, std::shared_ptr<NarInfo>(narInfo));
 }
 
+void BinaryCacheStore::upsertFileFromLocal(const std::string & path,
+    const Path & localPath, const std::string & mimeType)
+{
+    upsertFile(path, readFile(localPath), mimeType);
+}
+
 void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::string> & nar,
     RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
 {
-    if (!repair && isValidPath(info.path)) return;
+    assert(nar->compare(0, narMagic.size(), narMagic) == 0);
+
+    auto accessor_ = std::dynamic_pointer_cast<RemoteFSAccessor>(accessor);
+
+    StringSource source(*nar);
+
+    addToStoreCommon(info, source, repair, [&]() {
+        if (accessor_)
+            accessor_->addToCache(info.path, *nar, makeNarAccessor(nar));
+    });
+}
+
+void BinaryCacheStore::addToStore(const ValidPathInfo & info, Source & narSource,
+    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+{
+    /* The accessor cache needs the entire NAR, so we might as well
+       read it into memory. */
+    if (std::dynamic_pointer_cast<RemoteFSAccessor>(accessor)) {
+        TeeSink tee(narSource);
+        parseDump(tee, tee.source);
+        addToStore(info, tee.source.data, repair, checkSigs, accessor);
+        return;
+    }
+
+    addToStoreCommon(info, narSource, repair, []() { });
+}
+
+void BinaryCacheStore::addToStoreCommon(const ValidPathInfo & info, Source & narSource,
+    RepairFlag repair, std::function<void()> narVerified)
+{
+    if (!repair && isValidPath(info.path)) {
+        /* Consume the NAR anyway, since the caller may be reading it
+           from a stream that contains other data after it. */
+        ParseSink sink;
+        parseDump(sink, narSource);
+        return;
+    }
 
     /* Verify that all references are valid. This may do some .narinfo
        reads, but typically they'll already be cached. */
@@ -130,22 +186,65 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
                 % info.path % ref);
         }
 
-    assert(nar->compare(0, narMagic.size(), narMagic) == 0);
-
     auto narInfo = make_ref<NarInfo>(info);
 
-    narInfo->narSize = nar->size();
-    narInfo->narHash = hashString(htSHA256, *nar);
+    /* Read the NAR in a single pass: index it (for the listing and
+       the debug info index) while hashing it, and compress it to a
+       temporary file while hashing the compressed data. So memory
+       usage doesn't depend on the size of the NAR. The name of the
+       uploaded file depends on the hash of the compressed data, so
+       it can only be uploaded afterwards. */
+    Path tmpDir = createTempDir(getTempRoot(), "nix-upload");
+    AutoDelete delTmpDir(tmpDir, true);
+    Path tmpFile = tmpDir + "/nar";
+
+    AutoCloseFD fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (!fd) throw SysError("creating temporary file '%s'", tmpFile);
+
+    HashSink fileHashSink(htSHA256);
+    FdSink fileSink(fd.get());
+
+    LambdaSink fileTee([&](const unsigned char * data, size_t len) {
+        fileHashSink(data, len);
+        fileSink(data, len);
+    });
+
+    narInfo->compression = compression;
+    auto now1 = std::chrono::steady_clock::now();
+
+    auto compressionSink = makeCompressionSink(compression, fileTee, parallelCompression, compressionLevel, zstdLongDistance);
+
+    HashSink narHashSink(htSHA256);
+
+    /* Note: makeNarAccessor() parses the NAR, so it rejects input
+       that isn't a NAR archive. */
+    LambdaSource narTee([&](unsigned char * data, size_t len) {
+        auto n = narSource.read(data, len);
+        narHashSink(data, n);
+        (*compressionSink)(data, n);
+        return n;
+    });
+
+    auto narAccessor = makeNarAccessor(narTee);
+
+    compressionSink->finish();
+    fileSink.flush();
+    fd = -1;
+
+    auto now2 = std::chrono::steady_clock::now();
+
+    auto narHash = narHashSink.finish();
+    narInfo->narHash = narHash.first;
+    narInfo->narSize = narHash.second;
 
     if (info.narHash && info.narHash != narInfo->narHash)
         throw Error(format("refusing to copy corrupted path '%1%' to binary cache") % info.path);
 
-    auto accessor_ = std::dynamic_pointer_cast<RemoteFSAccessor>(accessor);
-
-    auto narAccessor = makeNarAccessor(nar);
+    auto fileHash = fileHashSink.finish();
+    narInfo->fileHash = fileHash.first;
+    narInfo->fileSize = fileHash.second;
 
-    if (accessor_)
-        accessor_->addToCache(info.path, *nar, narAccessor);
+    narVerified();
 
     /* Optionally write a JSON file containing a listing of the
        contents of the NAR. */
@@ -165,24 +264,17 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
         upsertFile(storePathToHash(info.path) + ".ls", jsonOut.str(), "application/json");
     }
 
-    /* Compress the NAR. */
-    narInfo->compression = compression;
-    auto now1 = std::chrono::steady_clock::now();
-    auto narCompressed = compress(compression, *nar, parallelCompression);
-    auto now2 = std::chrono::steady_clock::now();
-    narInfo->fileHash = hashString(htSHA256, *narCompressed);
-    narInfo->fileSize = narCompressed->size();
-
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
     printMsg(lvlTalkative, format("copying path '%1%' (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache")
         % narInfo->path % narInfo->narSize
-        % ((1.0 - (double) narCompressed->size() / nar->size()) * 100.0)
+        % ((1.0 - (double) narInfo->fileSize / narInfo->narSize) * 100.0)
         % duration);
 
     narInfo->url = "nar/" + narInfo->fileHash.to_string(Base32, false) + ".nar"
         + (compression == "xz" ? ".xz" :
            compression == "bzip2" ? ".bz2" :
            compression == "br" ? ".br" :
+           compression == "zstd" ? ".zst" :
            "");
 
     /* Optionally maintain an index of DWARF debug info files
@@ -245,12 +337,12 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
     /* Atomically write the NAR file. */
     if (repair || !fileExists(narInfo->url)) {
         stats.narWrite++;
-        upsertFile(narInfo->url, *narCompressed, "application/x-nix-nar");
+        upsertFileFromLocal(narInfo->url, tmpFile, "application/x-nix-nar");
     } else
         stats.narWriteAverted++;
 
-    stats.narWriteBytes += nar->size();
-    stats.narWriteCompressedBytes += narCompressed->size();
+    stats.narWriteBytes += narInfo->narSize;
+    stats.narWriteCompressedBytes += narInfo->fileSize;
     stats.narWriteCompressionTimeMs += duration;
 
     /* Atomically write the NAR info file.*/
@@ -326,6 +418,114 @@ void BinaryCacheStore::queryPathInfoUncached(const Path & storePath,
         }});
 }
 
+std::map<Path, std::shared_ptr<ValidPathInfo>> BinaryCacheStore::queryPathInfosUncached(const PathSet & paths,
+    std::map<Path, std::exception_ptr> & errors)
+{
+    std::map<Path, std::shared_ptr<ValidPathInfo>> res;
+    PathSet remaining(paths);
+
+    /* Only fetch a shard of the NAR info index if we're looking for
+       enough paths in it. Otherwise fetching the individual .narinfo
+       files is cheaper. */
+    if (narInfoIndexMinPaths && paths.size() >= narInfoIndexMinPaths) {
+
+        /* The index is advertised in 'nix-cache-info', which we
+           may not have read (if the cache was already in the disk
+           cache). */
+        auto prefixLen = *narInfoIndexPrefix.lock();
+        if (!prefixLen) {
+            try {
+                auto cacheInfo = getFile("nix-cache-info");
+                if (cacheInfo) parseCacheInfo(*cacheInfo);
+            } catch (Error & e) {
+                debug("cannot read 'nix-cache-info' of '%s': %s", getUri(), e.what());
+            }
+            auto indexPrefix(narInfoIndexPrefix.lock());
+            if (!*indexPrefix) *indexPrefix = 0;
+            prefixLen = *indexPrefix;
+        }
+
+        /* Group the paths by shard. */
+        std::map<std::string, PathSet> shards;
+        if (*prefixLen)
+            for (auto & path : paths)
+                shards[storePathToHash(path).substr(0, *prefixLen)].insert(path);
+
+        struct State
+        {
+            size_t left = 0;
+        };
+
+        Sync<State> state_;
+        std::condition_variable wakeup;
+        Sync<std::map<Path, std::shared_ptr<ValidPathInfo>>> found_;
+
+        for (auto & shard : shards) {
+            if (shard.second.size() < narInfoIndexMinPaths) continue;
+
+            auto shardFile = "narinfo-index/" + shard.first;
+            debug("fetching NAR info index shard '%s' from '%s' for %d paths",
+                shardFile, getUri(), shard.second.size());
+
+            state_.lock()->left++;
+
+            getFile(shardFile,
+                {[&, shardFile, wanted(shard.second)](std::future<std::shared_ptr<std::string>> fut) {
+                    try {
+                        auto data = fut.get();
+                        if (data) {
+                            /* Entries are .narinfo files separated by
+                               empty lines. */
+                            std::map<std::string, std::shared_ptr<ValidPathInfo>> infos;
+                            size_t pos = 0;
+                            while (pos < data->size()) {
+                                auto end = data->find("\n\n", pos);
+                                if (end == std::string::npos) end = data->size();
+                                auto entry = data->substr(pos, end - pos + 1);
+                                pos = end + 2;
+                                if (trim(entry).empty()) continue;
+                                auto info = std::make_shared<NarInfo>(*this, entry, shardFile);
+                                infos.emplace(storePathToHash(info->path), info);
+                            }
+
+                            auto found(found_.lock());
+                            for (auto & path : wanted) {
+                                auto i = infos.find(storePathToHash(path));
+                                if (i != infos.end()) {
+                                    stats.narInfoRead++;
+                                    (*found)[path] = i->second;
+                                }
+                            }
+                        }
+                    } catch (Error & e) {
+                        printError("warning: ignoring NAR info index shard '%s' of '%s': %s",
+                            shardFile, getUri(), e.what());
+                    }
+                    auto state(state_.lock());
+                    if (!--state->left) wakeup.notify_one();
+                }});
+        }
+
+        {
+            auto state(state_.lock());
+            while (state->left)
+                state.wait(wakeup);
+        }
+
+        /* Paths not in the index are looked up individually, since
+           the index may be older than the cache. */
+        for (auto & i : *found_.lock()) {
+            res.insert(i);
+            remaining.erase(i.first);
+        }
+    }
+
+    for (auto & i : Store::queryPathInfosUncached(remaining, errors))
+        res.insert(i);
+
+    return res;
+}
+
 Path BinaryCacheStore::addToStore(const string & name, const Path & srcPath,
     bool recursive, HashType hashAlgo, PathFilter & filter, RepairFlag repair)
 {
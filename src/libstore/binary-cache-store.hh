@@ -4,6 +4,7 @@
 #include "store-api.hh"
 
 #include "pool.hh"
+#include "sync.hh"
 
 #include <atomic>
 
@@ -15,13 +16,19 @@ class BinaryCacheStore : public Store
 {
 public:
 
-    const Setting<std::string> compression{this, "xz", "compression", "NAR compression method ('xz', 'bzip2', or 'none')"};
+    const Setting<std::string> compression{this, "xz", "compression", "NAR compression method ('xz', 'bzip2', 'br', 'zstd' or 'none')"};
+    const Setting<int> compressionLevel{this, -1, "compression-level",
+        "NAR compression level for 'xz', 'br' and 'zstd' (-1 means the method's default)"};
     const Setting<bool> writeNARListing{this, false, "write-nar-listing", "whether to write a JSON file listing the files in each NAR"};
     const Setting<bool> writeDebugInfo{this, false, "index-debug-info", "whether to index DWARF debug info files by build ID"};
     const Setting<Path> secretKeyFile{this, "", "secret-key", "path to secret key used to sign the binary cache"};
     const Setting<Path> localNarCache{this, "", "local-nar-cache", "path to a local cache of NARs"};
     const Setting<bool> parallelCompression{this, false, "parallel-compression",
-        "enable multi-threading compression, available for xz only currently"};
+        "enable multi-threading compression, available for xz and zstd only currently"};
+    const Setting<bool> zstdLongDistance{this, false, "zstd-long-distance-matching",
+        "enable long-distance matching for 'zstd' compression, which improves the ratio of large NARs"};
+    const Setting<unsigned int> narInfoIndexMinPaths{this, 4, "narinfo-index-min-paths",
+        "minimum number of paths to look up in a shard of the NAR info index of the binary cache before fetching it (0 to never use the index)"};
 
 private:
 
@@ -39,6 +46,17 @@ public:
         const std::string & data,
         const std::string & mimeType) = 0;
 
+    /* Upload the contents of the local file 'localPath' to
+       'path'. The file may be moved. The default implementation reads
+       the file into memory and calls upsertFile(). */
+    virtual void upsertFileFromLocal(const std::string & path,
+        const Path & localPath,
+        const std::string & mimeType);
+
+    /* Return the directory in which to create temporary files for
+       upsertFileFromLocal(), or "" for the default. */
+    virtual Path getTempRoot() { return ""; }
+
     /* Note: subclasses must implement at least one of the two
        following getFile() methods. */
 
@@ -57,6 +75,13 @@ protected:
     bool wantMassQuery_ = false;
     int priority = 50;
 
+    /* The length of the hash part prefixes by which the NAR info
+       index of this cache is sharded (0 if it has no index), or
+       empty if we haven't read 'nix-cache-info' yet. */
+    Sync<std::optional<size_t>> narInfoIndexPrefix;
+
+    void parseCacheInfo(const std::string & cacheInfo);
+
 public:
 
     virtual void init();
@@ -69,6 +94,12 @@ private:
 
     void writeNarInfo(ref<NarInfo> narInfo);
 
+    /* Add a NAR read from 'narSource' to the binary cache, without
+       keeping it in memory. 'narVerified' is called once the NAR hash
+       has been checked. */
+    void addToStoreCommon(const ValidPathInfo & info, Source & narSource,
+        RepairFlag repair, std::function<void()> narVerified);
+
 public:
 
     bool isValidPathUncached(const Path & path) override;
@@ -76,11 +107,18 @@ public:
     void queryPathInfoUncached(const Path & path,
         Callback<std::shared_ptr<ValidPathInfo>> callback) noexcept override;
 
+    std::map<Path, std::shared_ptr<ValidPathInfo>> queryPathInfosUncached(const PathSet & paths,
+        std::map<Path, std::exception_ptr> & errors) override;
+
     Path queryPathFromHashPart(const string & hashPart) override
     { unsupported("queryPathFromHashPart"); }
 
     bool wantMassQuery() override { return wantMassQuery_; }
 
+    void addToStore(const ValidPathInfo & info, Source & narSource,
+        RepairFlag repair, CheckSigsFlag checkSigs,
+        std::shared_ptr<FSAccessor> accessor) override;
+
     void addToStore(const ValidPathInfo & info, const ref<std::string> & nar,
         RepairFlag repair, CheckSigsFlag checkSigs,
         std::shared_ptr<FSAccessor> accessor) override;
@@ -17,6 +17,7 @@
 #include <algorithm>
 #include <iostream>
 #include <map>
+#include <unordered_map>
 #include <sstream>
 #include <thread>
 #include <future>
@@ -30,7 +31,6 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
-#include <sys/select.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <fcntl.h>
@@ -39,6 +39,7 @@
 #include <errno.h>
 #include <cstring>
 #include <termios.h>
+#include <poll.h>
 
 #include <pwd.h>
 #include <grp.h>
@@ -51,6 +52,7 @@
 #include <netinet/ip.h>
 #include <sys/personality.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
 #include <sched.h>
 #include <sys/param.h>
 #include <sys/mount.h>
@@ -181,6 +183,18 @@ public:
 
     virtual string key() = 0;
 
+    /* The expected time in seconds that this goal itself takes once
+       it can run. */
+    virtual double expectedDuration()
+    {
+        return 0;
+    }
+
+    /* The expected time from the start of this goal until all goals
+       that (transitively) wait for it are done, i.e. the length of
+       the remaining critical path through this goal. */
+    double criticalPath();
+
 protected:
 
     virtual void amDone(ExitCode result);
@@ -212,6 +226,37 @@ struct Child
 };
 
 
+/* Waits for file descriptors to become readable (which includes
+   EOF). This uses epoll on Linux and poll() elsewhere, so unlike
+   select() it is not limited to FD_SETSIZE descriptors. */
+class FdPoller
+{
+#if __linux__
+    AutoCloseFD epollFd;
+    std::vector<struct epoll_event> events;
+#else
+    std::set<int> fds;
+    std::vector<struct pollfd> pollFds;
+#endif
+
+public:
+
+    FdPoller();
+
+    void add(int fd);
+
+    /* Stop watching 'fd'. This is harmless if 'fd' was already
+       closed. */
+    void remove(int fd);
+
+    /* Wait until at least one descriptor is readable, or until
+       'timeout' milliseconds have passed (forever if -1). Returns
+       the readable descriptors, or nothing if interrupted by a
+       signal. */
+    std::vector<int> wait(int timeout);
+};
+
+
 /* The worker class. */
 class Worker
 {
@@ -232,6 +277,14 @@ private:
     /* Child processes currently running. */
     std::list<Child> children;
 
+    /* The child to which each watched file descriptor belongs. */
+    std::unordered_map<int, std::list<Child>::iterator> childFds;
+
+    FdPoller poller;
+
+    /* Buffer for reading child output. */
+    std::vector<unsigned char> readBuffer;
+
     /* Number of build slots occupied.  This includes local builds and
        substitutions but not remote builds via the build hook. */
     unsigned int nrLocalBuilds;
@@ -247,14 +300,42 @@ private:
     /* Goals sleeping for a few seconds (polling a lock). */
     WeakGoals waitingForAWhile;
 
+    /* Goals waiting for the release of a lock held by another
+       process, by lock file. */
+    std::map<Path, WeakGoals> waitingForLock;
+
+    /* Goals waiting for a machine-wide build slot. */
+    WeakGoals waitingForGlobalBuildSlot;
+
+    LockMonitor lockMonitor;
+
     /* Last time the goals in `waitingForAWhile' where woken up. */
     steady_time_point lastWokenUp;
 
     /* Cache for pathContentsGood(). */
     std::map<Path, bool> pathContentsGoodCache;
 
+    /* When the first build started, and the time we then expected
+       the builds to take. */
+    std::optional<steady_time_point> firstBuildStarted;
+    double predictedBuildTime = 0;
+
+    /* Order goals so that those on the longest remaining critical
+       path get build slots first. */
+    void sortByCriticalPath(std::vector<GoalPtr> & goals);
+
 public:
 
+    /* Cache for Goal::criticalPath(). */
+    std::map<Goal *, double> criticalPaths;
+
+    /* Must be called when goals, their dependencies or their expected
+       durations change. */
+    void invalidateCriticalPaths()
+    {
+        criticalPaths.clear();
+    }
+
     const Activity act;
     const Activity actDerivations;
     const Activity actSubstitutions;
@@ -334,11 +415,23 @@ public:
     void waitForAnyGoal(GoalPtr goal);
 
     /* Wait for a few seconds and then retry this goal.  Used when
-       waiting for a lock held by another process.  This kind of
-       polling is inefficient, but POSIX doesn't really provide a way
-       to wait for multiple locks in the main select() loop. */
+       waiting for something that we can't get notified about, such
+       as the build hook accepting a job. */
     void waitForAWhile(GoalPtr goal);
 
+    /* Wait until the lock on 'lockPath' (held by another process)
+       has been released, and then retry this goal.  Falls back to
+       waitForAWhile() if we can't watch locks. */
+    void waitForLock(GoalPtr goal, const Path & lockPath);
+
+    /* Wait until a machine-wide build slot has been released (see
+       acquireGlobalBuildSlot()). */
+    void waitForGlobalBuildSlot(GoalPtr goal);
+
+    /* Called when a goal starts a build, to predict how long the
+       builds will take. */
+    void buildStarted();
+
     /* Loop until the specified top-level goals have finished. */
     void run(const Goals & topGoals);
 
@@ -380,6 +473,25 @@ void Goal::addWaitee(GoalPtr waitee)
 {
     waitees.insert(waitee);
     addToWeakGoals(waitee->waiters, shared_from_this());
+    worker.invalidateCriticalPaths();
+}
+
+
+double Goal::criticalPath()
+{
+    auto & memo = worker.criticalPaths;
+    auto i = memo.find(this);
+    if (i != memo.end()) return i->second;
+
+    memo[this] = 0; // guard against cycles
+
+    double rest = 0;
+    for (auto & j : waiters) {
+        GoalPtr goal = j.lock();
+        if (goal) rest = std::max(rest, goal->criticalPath());
+    }
+
+    return memo[this] = expectedDuration() + rest;
 }
 
 
@@ -630,6 +742,32 @@ void UserLock::kill()
 }
 
 
+/* Machine-wide build slots are lock files in this directory, named
+   0 to global-max-jobs - 1. All Nix processes using the store (in
+   particular the per-client workers of the daemon) take a slot before
+   starting a local build, which limits the total number of builds. */
+static Path globalBuildSlotsDir()
+{
+    return settings.nixStateDir + "/build-slots";
+}
+
+
+/* Try to take a free machine-wide build slot. Returns an invalid
+   descriptor if there is none. */
+static AutoCloseFD acquireGlobalBuildSlot()
+{
+    createDirs(globalBuildSlotsDir());
+    for (unsigned int n = 0; n < settings.globalMaxJobs; ++n) {
+        auto fd = openLockFile(fmt("%s/%d", globalBuildSlotsDir(), n), true);
+        if (lockFile(fd.get(), ltWrite, false)) {
+            debug("acquired build slot %d", n);
+            return fd;
+        }
+    }
+    return AutoCloseFD();
+}
+
+
 //////////////////////////////////////////////////////////////////////
 
 
@@ -747,6 +885,10 @@ private:
     /* Whether additional wanted outputs have been added. */
     bool needRestart = false;
 
+    /* Cache for getEstimatedBuildTime(). */
+    bool haveEstimatedBuildTime = false;
+    std::optional<double> estimatedBuildTime;
+
     /* Whether to retry substituting the outputs after building the
        inputs. */
     bool retrySubstitution;
@@ -778,6 +920,9 @@ private:
     /* User selected for running the builder. */
     std::unique_ptr<UserLock> buildUser;
 
+    /* The machine-wide build slot held while building locally. */
+    AutoCloseFD globalBuildSlot;
+
     /* The process ID of the builder. */
     Pid pid;
 
@@ -907,6 +1052,14 @@ public:
         return "b$" + storePathToName(drvPath) + "$" + drvPath;
     }
 
+    double expectedDuration() override
+    {
+        return getEstimatedBuildTime().value_or(0);
+    }
+
+    /* The build time estimated from the build history, if any. */
+    std::optional<double> getEstimatedBuildTime();
+
     void work() override;
 
     Path getDrvPath()
@@ -951,8 +1104,9 @@ private:
     friend int childEntry(void *);
 
     /* Check that the derivation outputs all exist and register them
-       as valid. */
-    void registerOutputs();
+       as valid. Returns the path info of each output if this was the
+       last round of the build, or nothing otherwise. */
+    ValidPathInfos registerOutputs();
 
     /* Check that an output meets the requirements specified by the
        'outputChecks' attribute (or the legacy
@@ -1150,10 +1304,30 @@ void DerivationGoal::loadDerivation()
     /* Get the derivation. */
     drv = std::unique_ptr<BasicDerivation>(new Derivation(worker.store.derivationFromPath(drvPath)));
 
+    worker.invalidateCriticalPaths();
+
     haveDerivation();
 }
 
 
+std::optional<double> DerivationGoal::getEstimatedBuildTime()
+{
+    if (!drv) return {};
+    if (!haveEstimatedBuildTime) {
+        haveEstimatedBuildTime = true;
+        try {
+            auto name = storePathToName(drvPath);
+            if (hasSuffix(name, drvExtension))
+                name.resize(name.size() - drvExtension.size());
+            estimatedBuildTime = worker.store.queryExpectedBuildTime(name, drv->platform);
+        } catch (Error & e) {
+            debug("cannot estimate build time of '%s': %s", drvPath, e.what());
+        }
+    }
+    return estimatedBuildTime;
+}
+
+
 void DerivationGoal::haveDerivation()
 {
     trace("have derivation");
@@ -1388,14 +1562,15 @@ void DerivationGoal::tryToBuild()
     /* Obtain locks on all output paths.  The locks are automatically
        released when we exit this function or Nix crashes.  If we
        can't acquire the lock, then continue; hopefully some other
-       goal can start a build, and if not, the main loop will sleep a
-       few seconds and then retry this goal. */
+       goal can start a build, and if not, the main loop will wait
+       until the lock is released and then retry this goal. */
     PathSet lockFiles;
     for (auto & outPath : drv->outputPaths())
         lockFiles.insert(worker.store.toRealPath(outPath));
 
-    if (!outputLocks.lockPaths(lockFiles, "", false)) {
-        worker.waitForAWhile(shared_from_this());
+    Path blocked;
+    if (!outputLocks.lockPaths(lockFiles, "", false, &blocked)) {
+        worker.waitForLock(shared_from_this(), blocked);
         return;
     }
 
@@ -1444,6 +1619,7 @@ void DerivationGoal::tryToBuild()
             Logger::Fields{drvPath, hook ? machineName : "", curRound, nrRounds});
         mcRunningBuilds = std::make_unique<MaintainCount<uint64_t>>(worker.runningBuilds);
         worker.updateProgress();
+        worker.buildStarted();
     };
 
     /* Is the build hook willing to accept this job? */
@@ -1478,6 +1654,17 @@ void DerivationGoal::tryToBuild()
         return;
     }
 
+    /* If the number of builds across all processes is limited, we
+       also need a machine-wide build slot. */
+    if (settings.globalMaxJobs && !globalBuildSlot) {
+        globalBuildSlot = acquireGlobalBuildSlot();
+        if (!globalBuildSlot) {
+            worker.waitForGlobalBuildSlot(shared_from_this());
+            outputLocks.unlock();
+            return;
+        }
+    }
+
     try {
 
         /* Okay, we have to build. */
@@ -1487,6 +1674,7 @@ void DerivationGoal::tryToBuild()
         printError(e.msg());
         outputLocks.unlock();
         buildUser.reset();
+        globalBuildSlot = -1;
         worker.permanentFailure = true;
         done(BuildResult::InputRejected, e.msg());
         return;
@@ -1531,15 +1719,43 @@ void DerivationGoal::buildDone()
        to have terminated.  In fact, the builder could also have
        simply have closed its end of the pipe, so just to be sure,
        kill it. */
-    int status = hook ? hook->pid.kill() : pid.kill();
+    struct rusage usage;
+    int status = hook ? hook->pid.kill() : pid.kill(&usage);
 
     debug(format("builder process for '%1%' finished") % drvPath);
 
     result.timesBuilt++;
     result.stopTime = time(0);
 
+    /* Record the build in the build history when we're done, since
+       the output size is only known after registering the
+       outputs. Check builds are just as good a measure. */
+    BuildRecord record;
+    record.drvPath = drvPath;
+    record.system = drv->platform;
+    record.startTime = result.startTime;
+    record.stopTime = result.stopTime;
+    if (!hook) {
+        record.userTime = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+        record.systemTime = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#if __APPLE__
+        record.maxRSS = usage.ru_maxrss;
+#else
+        record.maxRSS = (uint64_t) usage.ru_maxrss * 1024;
+#endif
+    }
+
+    Finally addBuildRecord([&]() {
+        try {
+            worker.store.addBuildRecord(record);
+        } catch (...) {
+            ignoreException();
+        }
+    });
+
     /* So the child is gone now. */
     worker.childTerminated(this);
+    globalBuildSlot = -1;
 
     /* Close the read side of the logger pipe. */
     if (hook) {
@@ -1607,7 +1823,14 @@ void DerivationGoal::buildDone()
 
         /* Compute the FS closure of the outputs and register them as
            being valid. */
-        registerOutputs();
+        auto outputInfos = registerOutputs();
+
+        record.success = true;
+        if (!outputInfos.empty()) {
+            record.outputSize = 0;
+            for (auto & info : outputInfos)
+                *record.outputSize += info.narSize;
+        }
 
         if (settings.postBuildHook != "") {
             Activity act(*logger, lvlInfo, actPostBuildHook,
@@ -2130,7 +2353,7 @@ void DerivationGoal::startBuilder()
                     StringSink sink;
                     dumpPath(r, sink);
                     StringSource source(*sink.s);
-                    restorePath(p, source);
+                    restorePath(p, source, mtimeStore);
                 }
             }
         }
@@ -3157,7 +3380,7 @@ PathSet parseReferenceSpecifiers(Store & store, const BasicDerivation & drv, con
 }
 
 
-void DerivationGoal::registerOutputs()
+ValidPathInfos DerivationGoal::registerOutputs()
 {
     /* When using a build hook, the build hook can register the output
        as valid (by doing `nix-store --import').  If so we don't have
@@ -3166,11 +3389,20 @@ void DerivationGoal::registerOutputs()
         bool allValid = true;
         for (auto & i : drv->outputs)
             if (!worker.store.isValidPath(i.second.path)) allValid = false;
-        if (allValid) return;
+        if (allValid) {
+            ValidPathInfos infos;
+            for (auto & i : drv->outputs)
+                infos.push_back(*worker.store.queryPathInfo(i.second.path));
+            return infos;
+        }
     }
 
     std::map<std::string, ValidPathInfo> infos;
 
+    /* In check mode, the (already valid) path infos of the checked
+       outputs. */
+    ValidPathInfos checkedInfos;
+
     /* Set of inodes seen during calls to canonicalisePathMetaData()
        for this build's outputs.  This needs to be shared between
        outputs to allow hard links between outputs. */
@@ -3249,11 +3481,31 @@ void DerivationGoal::registerOutputs()
             deletePath(actualPath);
             sink.s = make_ref<std::string>(rewriteStrings(*sink.s, outputRewrites));
             StringSource source(*sink.s);
-            restorePath(actualPath, source);
+            restorePath(actualPath, source, mtimeStore);
 
             rewritten = true;
         }
 
+        /* For this output path, find the references to other paths
+           contained in it.  Compute the SHA-256 NAR hash at the same
+           time.  The hash is stored in the database so that we can
+           verify later on whether nobody has messed with the store.
+           If the output is going to be optimised, also compute the
+           hashes of the individual files, so that all of this takes
+           a single pass over the output. Canonicalisation doesn't
+           change the NAR serialisation, so this can be done before
+           canonicalisePathMetaData() when needed. */
+        HashResult hash;
+        PathSet references;
+        FileHashes fileHashes;
+        bool optimise = curRound == nrRounds && buildMode != bmCheck && settings.autoOptimiseStore;
+        bool scanned = false;
+        auto scan = [&]() {
+            debug("scanning for references inside '%1%'", path);
+            references = scanForReferences(actualPath, allPaths, hash, optimise ? &fileHashes : nullptr);
+            scanned = true;
+        };
+
         /* Check that fixed-output derivations produced the right
            outputs (i.e., the content hash should match the specified
            hash). */
@@ -3272,7 +3524,13 @@ void DerivationGoal::registerOutputs()
 
             /* Check the hash. In hash mode, move the path produced by
                the derivation to its content-addressed location. */
-            Hash h2 = recursive ? hashPath(h.type, actualPath).first : hashFile(h.type, actualPath);
+            Hash h2;
+            if (recursive && h.type == htSHA256) {
+                /* The NAR hash is exactly what we need. */
+                scan();
+                h2 = hash.first;
+            } else
+                h2 = recursive ? hashPath(h.type, actualPath).first : hashFile(h.type, actualPath);
 
             Path dest = worker.store.makeFixedOutputPath(recursive, h2, storePathToName(path));
 
@@ -3311,13 +3569,7 @@ void DerivationGoal::registerOutputs()
         canonicalisePathMetaData(actualPath,
             buildUser && !rewritten ? buildUser->getUID() : -1, inodesSeen);
 
-        /* For this output path, find the references to other paths
-           contained in it.  Compute the SHA-256 NAR hash at the same
-           time.  The hash is stored in the database so that we can
-           verify later on whether nobody has messed with the store. */
-        debug("scanning for references inside '%1%'", path);
-        HashResult hash;
-        PathSet references = scanForReferences(actualPath, allPaths, hash);
+        if (!scanned) scan();
 
         if (buildMode == bmCheck) {
             if (!worker.store.isValidPath(path)) continue;
@@ -3350,6 +3602,7 @@ void DerivationGoal::registerOutputs()
                 worker.store.registerValidPaths({info});
             }
 
+            checkedInfos.push_back(info);
             continue;
         }
 
@@ -3364,7 +3617,7 @@ void DerivationGoal::registerOutputs()
         }
 
         if (curRound == nrRounds) {
-            worker.store.optimisePath(actualPath); // FIXME: combine with scanForReferences()
+            worker.store.optimisePath(actualPath, optimise ? &fileHashes : nullptr);
             worker.markContentsGood(path);
         }
 
@@ -3381,7 +3634,7 @@ void DerivationGoal::registerOutputs()
         infos[i.first] = info;
     }
 
-    if (buildMode == bmCheck) return;
+    if (buildMode == bmCheck) return checkedInfos;
 
     /* Apply output checks. */
     checkOutputs(infos);
@@ -3426,7 +3679,7 @@ void DerivationGoal::registerOutputs()
 
     if (curRound < nrRounds) {
         prevInfos = infos;
-        return;
+        return {};
     }
 
     /* Remove the .check directories if we're done. FIXME: keep them
@@ -3441,16 +3694,16 @@ void DerivationGoal::registerOutputs()
     /* Register each output path as valid, and register the sets of
        paths referenced by each of them.  If there are cycles in the
        outputs, this will fail. */
-    {
-        ValidPathInfos infos2;
-        for (auto & i : infos) infos2.push_back(i.second);
-        worker.store.registerValidPaths(infos2);
-    }
+    ValidPathInfos infos2;
+    for (auto & i : infos) infos2.push_back(i.second);
+    worker.store.registerValidPaths(infos2);
 
     /* In case of a fixed-output derivation hash mismatch, throw an
        exception now that we have registered the output as valid. */
     if (delayedException)
         std::rethrow_exception(delayedException);
+
+    return infos2;
 }
 
 
@@ -4140,6 +4393,89 @@ void SubstitutionGoal::handleEOF(int fd)
 static bool working = false;
 
 
+#if __linux__
+
+FdPoller::FdPoller()
+    : epollFd(epoll_create1(EPOLL_CLOEXEC))
+    , events(64)
+{
+    if (!epollFd) throw SysError("creating epoll instance");
+}
+
+
+void FdPoller::add(int fd)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd.get(), EPOLL_CTL_ADD, fd, &event) == -1)
+        throw SysError("adding file descriptor %d to epoll instance", fd);
+}
+
+
+void FdPoller::remove(int fd)
+{
+    if (epoll_ctl(epollFd.get(), EPOLL_CTL_DEL, fd, nullptr) == -1
+        && errno != EBADF && errno != ENOENT)
+        throw SysError("removing file descriptor %d from epoll instance", fd);
+}
+
+
+std::vector<int> FdPoller::wait(int timeout)
+{
+    std::vector<int> ready;
+    int n = epoll_wait(epollFd.get(), events.data(), events.size(), timeout);
+    if (n == -1) {
+        if (errno == EINTR) return ready;
+        throw SysError("waiting for input");
+    }
+    for (int i = 0; i < n; ++i)
+        ready.push_back(events[i].data.fd);
+    /* If all slots were used, there may be more ready descriptors
+       than fit, so make room for them next time. */
+    if ((size_t) n == events.size()) events.resize(events.size() * 2);
+    return ready;
+}
+
+#else
+
+FdPoller::FdPoller()
+{
+}
+
+
+void FdPoller::add(int fd)
+{
+    fds.insert(fd);
+}
+
+
+void FdPoller::remove(int fd)
+{
+    fds.erase(fd);
+}
+
+
+std::vector<int> FdPoller::wait(int timeout)
+{
+    pollFds.clear();
+    for (auto fd : fds)
+        pollFds.push_back({fd, POLLIN, 0});
+
+    std::vector<int> ready;
+    if (poll(pollFds.data(), pollFds.size(), timeout) == -1) {
+        if (errno == EINTR) return ready;
+        throw SysError("waiting for input");
+    }
+    for (auto & pollFd : pollFds)
+        if (pollFd.revents) ready.push_back(pollFd.fd);
+    return ready;
+}
+
+#endif
+
+
 Worker::Worker(LocalStore & store)
     : act(*logger, actRealise)
     , actDerivations(*logger, actBuilds)
@@ -4150,6 +4486,9 @@ Worker::Worker(LocalStore & store)
     if (working) abort();
     working = true;
     nrLocalBuilds = 0;
+    readBuffer.resize(64 * 1024);
+    if (lockMonitor.getFd() != -1)
+        poller.add(lockMonitor.getFd());
     lastWokenUp = steady_time_point::min();
     permanentFailure = false;
     timedOut = false;
@@ -4181,6 +4520,7 @@ GoalPtr Worker::makeDerivationGoal(const Path & path,
     if (!goal) {
         goal = std::make_shared<DerivationGoal>(path, wantedOutputs, *this, buildMode);
         derivationGoals[path] = goal;
+        invalidateCriticalPaths();
         wakeUp(goal);
     } else
         (dynamic_cast<DerivationGoal *>(goal.get()))->addWantedOutputs(wantedOutputs);
@@ -4192,6 +4532,7 @@ std::shared_ptr<DerivationGoal> Worker::makeBasicDerivationGoal(const Path & drv
     const BasicDerivation & drv, BuildMode buildMode)
 {
     auto goal = std::make_shared<DerivationGoal>(drvPath, drv, *this, buildMode);
+    invalidateCriticalPaths();
     wakeUp(goal);
     return goal;
 }
@@ -4203,6 +4544,7 @@ GoalPtr Worker::makeSubstitutionGoal(const Path & path, RepairFlag repair)
     if (!goal) {
         goal = std::make_shared<SubstitutionGoal>(path, *this, repair);
         substitutionGoals[path] = goal;
+        invalidateCriticalPaths();
         wakeUp(goal);
     }
     return goal;
@@ -4268,7 +4610,11 @@ void Worker::childStarted(GoalPtr goal, const set<int> & fds,
     child.timeStarted = child.lastOutput = steady_time_point::clock::now();
     child.inBuildSlot = inBuildSlot;
     child.respectTimeouts = respectTimeouts;
-    children.emplace_back(child);
+    auto i = children.insert(children.end(), child);
+    for (auto fd : fds) {
+        poller.add(fd);
+        childFds[fd] = i;
+    }
     if (inBuildSlot) nrLocalBuilds++;
 }
 
@@ -4284,6 +4630,11 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
         nrLocalBuilds--;
     }
 
+    for (auto fd : i->fds) {
+        poller.remove(fd);
+        childFds.erase(fd);
+    }
+
     children.erase(i);
 
     if (wakeSleepers) {
@@ -4323,6 +4674,56 @@ void Worker::waitForAWhile(GoalPtr goal)
 }
 
 
+void Worker::waitForGlobalBuildSlot(GoalPtr goal)
+{
+    debug("wait for global build slot");
+
+    if (lockMonitor.getFd() == -1) {
+        waitForAWhile(goal);
+        return;
+    }
+
+    /* Wake up when any slot is released. If we can't tell whether
+       some slot is free, poll. */
+    bool free = false, unknown = false;
+    for (unsigned int n = 0; n < settings.globalMaxJobs; ++n)
+        switch (lockMonitor.watch(fmt("%s/%d", globalBuildSlotsDir(), n))) {
+            case LockMonitor::lsHeld: break;
+            case LockMonitor::lsReleased: free = true; break;
+            case LockMonitor::lsUnknown: unknown = true; break;
+        }
+
+    if (free)
+        wakeUp(goal);
+    else if (unknown)
+        waitForAWhile(goal);
+    else
+        addToWeakGoals(waitingForGlobalBuildSlot, goal);
+}
+
+
+void Worker::waitForLock(GoalPtr goal, const Path & lockPath)
+{
+    if (lockMonitor.getFd() == -1) {
+        waitForAWhile(goal);
+        return;
+    }
+
+    debug("wait for lock '%s'", lockPath);
+    switch (lockMonitor.watch(lockPath)) {
+        case LockMonitor::lsHeld:
+            addToWeakGoals(waitingForLock[lockPath], goal);
+            break;
+        case LockMonitor::lsReleased:
+            wakeUp(goal); /* the lock is gone already */
+            break;
+        case LockMonitor::lsUnknown:
+            waitForAWhile(goal);
+            break;
+    }
+}
+
+
 void Worker::run(const Goals & _topGoals)
 {
     for (auto & i : _topGoals) topGoals.insert(i);
@@ -4344,7 +4745,9 @@ void Worker::run(const Goals & _topGoals)
                 if (goal) awake2.insert(goal);
             }
             awake.clear();
-            for (auto & goal : awake2) {
+            std::vector<GoalPtr> awake3(awake2.begin(), awake2.end());
+            sortByCriticalPath(awake3);
+            for (auto & goal : awake3) {
                 checkInterrupt();
                 goal->work();
                 if (topGoals.empty()) break; // stuff may have been cancelled
@@ -4354,7 +4757,8 @@ void Worker::run(const Goals & _topGoals)
         if (topGoals.empty()) break;
 
         /* Wait for input. */
-        if (!children.empty() || !waitingForAWhile.empty())
+        if (!children.empty() || !waitingForAWhile.empty() || !waitingForLock.empty()
+            || !waitingForGlobalBuildSlot.empty())
             waitForInput();
         else {
             if (awake.empty() && 0 == settings.maxBuildJobs) throw Error(
@@ -4364,6 +4768,12 @@ void Worker::run(const Goals & _topGoals)
         }
     }
 
+    if (firstBuildStarted) {
+        auto actual = std::chrono::duration<double>(steady_time_point::clock::now() - *firstBuildStarted).count();
+        printMsg(lvlTalkative, "builds took %.1f s (predicted %.1f s)", actual, predictedBuildTime);
+        firstBuildStarted.reset();
+    }
+
     /* If --keep-going is not set, it's possible that the main goal
        exited while some of its subgoals were still active.  But if
        --keep-going *is* set, then they must all be finished now. */
@@ -4373,6 +4783,50 @@ void Worker::run(const Goals & _topGoals)
 }
 
 
+void Worker::sortByCriticalPath(std::vector<GoalPtr> & goals)
+{
+    /* Goals with the same critical path (e.g. because there is no
+       build history) stay in the order given by CompareGoalPtrs. */
+    if (goals.size() < 2) return;
+    std::vector<std::pair<double, GoalPtr>> keyed;
+    for (auto & goal : goals)
+        keyed.emplace_back(goal->criticalPath(), goal);
+    std::stable_sort(keyed.begin(), keyed.end(),
+        [](const std::pair<double, GoalPtr> & a, const std::pair<double, GoalPtr> & b) {
+            return a.first > b.first;
+        });
+    for (size_t i = 0; i < goals.size(); ++i)
+        goals[i] = keyed[i].second;
+}
+
+
+void Worker::buildStarted()
+{
+    if (firstBuildStarted) return;
+    firstBuildStarted = steady_time_point::clock::now();
+
+    /* The builds take at least as long as the longest critical path,
+       and at least as long as the total build time divided over the
+       build slots. */
+    double criticalPath = 0, totalTime = 0;
+    size_t unknown = 0;
+    for (auto & i : derivationGoals) {
+        auto goal = std::dynamic_pointer_cast<DerivationGoal>(i.second.lock());
+        if (!goal || goal->getExitCode() != Goal::ecBusy) continue;
+        auto estimate = goal->getEstimatedBuildTime();
+        if (!estimate) unknown++;
+        totalTime += estimate.value_or(0);
+        criticalPath = std::max(criticalPath, goal->criticalPath());
+    }
+
+    predictedBuildTime = std::max(criticalPath,
+        totalTime / std::max(1U, (unsigned int) settings.maxBuildJobs));
+
+    printMsg(lvlTalkative, "expecting builds to take %.1f s (critical path %.1f s, %.1f s in total, %d derivations without build history)",
+        predictedBuildTime, criticalPath, totalTime, unknown);
+}
+
+
 void Worker::waitForInput()
 {
     printMsg(lvlVomit, "waiting for children");
@@ -4383,132 +4837,164 @@ void Worker::waitForInput()
        the logger pipe of a build, we assume that the builder has
        terminated. */
 
-    bool useTimeout = false;
-    struct timeval timeout;
-    timeout.tv_usec = 0;
     auto before = steady_time_point::clock::now();
 
     /* If we're monitoring for silence on stdout/stderr, or if there
        is a build timeout, then wait for input until the first
        deadline for any child. */
-    auto nearest = steady_time_point::max(); // nearest deadline
-    if (settings.minFree.get() != 0)
-        // Periodicallty wake up to see if we need to run the garbage collector.
-        nearest = before + std::chrono::seconds(10);
+    auto nearestTimeout = steady_time_point::max();
     for (auto & i : children) {
         if (!i.respectTimeouts) continue;
         if (0 != settings.maxSilentTime)
-            nearest = std::min(nearest, i.lastOutput + std::chrono::seconds(settings.maxSilentTime));
+            nearestTimeout = std::min(nearestTimeout, i.lastOutput + std::chrono::seconds(settings.maxSilentTime));
         if (0 != settings.buildTimeout)
-            nearest = std::min(nearest, i.timeStarted + std::chrono::seconds(settings.buildTimeout));
-    }
-    if (nearest != steady_time_point::max()) {
-        timeout.tv_sec = std::max(1L, (long) std::chrono::duration_cast<std::chrono::seconds>(nearest - before).count());
-        useTimeout = true;
+            nearestTimeout = std::min(nearestTimeout, i.timeStarted + std::chrono::seconds(settings.buildTimeout));
     }
 
+    auto nearest = nearestTimeout; // nearest deadline
+    if (settings.minFree.get() != 0)
+        // Periodicallty wake up to see if we need to run the garbage collector.
+        nearest = std::min(nearest, before + std::chrono::seconds(10));
+
     /* If we are polling goals that are waiting for a lock, then wake
-       up after a few seconds at most. */
-    if (!waitingForAWhile.empty()) {
-        useTimeout = true;
+       up after a few seconds at most. Goals waiting for a lock
+       release notification are also retried at that point, in case
+       the lock file was replaced rather than released. */
+    if (!waitingForAWhile.empty() || !waitingForLock.empty() || !waitingForGlobalBuildSlot.empty()) {
         if (lastWokenUp == steady_time_point::min())
             printError("waiting for locks or build slots...");
         if (lastWokenUp == steady_time_point::min() || lastWokenUp > before) lastWokenUp = before;
-        timeout.tv_sec = std::max(1L,
-            (long) std::chrono::duration_cast<std::chrono::seconds>(
-                lastWokenUp + std::chrono::seconds(settings.pollInterval) - before).count());
+        nearest = std::min(nearest, lastWokenUp + std::chrono::seconds(settings.pollInterval));
     } else lastWokenUp = steady_time_point::min();
 
-    if (useTimeout)
-        vomit("sleeping %d seconds", timeout.tv_sec);
-
-    /* Use select() to wait for the input side of any logger pipe to
-       become `available'.  Note that `available' (i.e., non-blocking)
-       includes EOF. */
-    fd_set fds;
-    FD_ZERO(&fds);
-    int fdMax = 0;
-    for (auto & i : children) {
-        for (auto & j : i.fds) {
-            if (j >= FD_SETSIZE)
-                throw Error("reached FD_SETSIZE limit");
-            FD_SET(j, &fds);
-            if (j >= fdMax) fdMax = j + 1;
-        }
+    int timeout = -1;
+    if (nearest != steady_time_point::max()) {
+        /* Round up, and don't spin if a deadline has already
+           passed. Deadlines too far away to fit in an int (about 24
+           days) are clamped; we just wake up early in that case. */
+        int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            nearest - before + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)).count();
+        timeout = (int) std::min((int64_t) INT_MAX, std::max((int64_t) 10, ms));
+        vomit("sleeping %d ms", timeout);
     }
 
-    if (select(fdMax, &fds, 0, 0, useTimeout ? &timeout : 0) == -1) {
-        if (errno == EINTR) return;
-        throw SysError("waiting for input");
-    }
+    /* Wait for the input side of any logger pipe to become
+       `available'.  Note that `available' (i.e., non-blocking)
+       includes EOF. */
+    auto ready = poller.wait(timeout);
 
     auto after = steady_time_point::clock::now();
 
-    /* Process all available file descriptors. FIXME: this is
-       O(children * fds). */
-    decltype(children)::iterator i;
-    for (auto j = children.begin(); j != children.end(); j = i) {
-        i = std::next(j);
-
+    /* Process all available file descriptors. A handler may
+       terminate its child, in which case the child's remaining
+       descriptors are no longer in 'childFds'. */
+    for (auto fd : ready) {
         checkInterrupt();
 
-        GoalPtr goal = j->goal.lock();
-        assert(goal);
-
-        set<int> fds2(j->fds);
-        std::vector<unsigned char> buffer(4096);
-        for (auto & k : fds2) {
-            if (FD_ISSET(k, &fds)) {
-                ssize_t rd = read(k, buffer.data(), buffer.size());
-                // FIXME: is there a cleaner way to handle pt close
-                // than EIO? Is this even standard?
-                if (rd == 0 || (rd == -1 && errno == EIO)) {
-                    debug(format("%1%: got EOF") % goal->getName());
-                    goal->handleEOF(k);
-                    j->fds.erase(k);
-                } else if (rd == -1) {
-                    if (errno != EINTR)
-                        throw SysError("%s: read failed", goal->getName());
-                } else {
-                    printMsg(lvlVomit, format("%1%: read %2% bytes")
-                        % goal->getName() % rd);
-                    string data((char *) buffer.data(), rd);
-                    j->lastOutput = after;
-                    goal->handleChildOutput(k, data);
+        if (fd == lockMonitor.getFd()) {
+            for (auto & lockPath : lockMonitor.released()) {
+                if (dirOf(lockPath) == globalBuildSlotsDir()) {
+                    for (auto & j : waitingForGlobalBuildSlot) {
+                        GoalPtr goal = j.lock();
+                        if (goal) wakeUp(goal);
+                    }
+                    waitingForGlobalBuildSlot.clear();
+                    continue;
+                }
+                auto i = waitingForLock.find(lockPath);
+                if (i == waitingForLock.end()) continue;
+                for (auto & j : i->second) {
+                    GoalPtr goal = j.lock();
+                    if (goal) wakeUp(goal);
                 }
+                waitingForLock.erase(i);
             }
+            continue;
         }
 
-        if (goal->getExitCode() == Goal::ecBusy &&
-            0 != settings.maxSilentTime &&
-            j->respectTimeouts &&
-            after - j->lastOutput >= std::chrono::seconds(settings.maxSilentTime))
-        {
-            printError(
-                format("%1% timed out after %2% seconds of silence")
-                % goal->getName() % settings.maxSilentTime);
-            goal->timedOut();
+        auto i = childFds.find(fd);
+        if (i == childFds.end()) continue;
+        auto & child = *i->second;
+
+        GoalPtr goal = child.goal.lock();
+        assert(goal);
+
+        ssize_t rd = read(fd, readBuffer.data(), readBuffer.size());
+        // FIXME: is there a cleaner way to handle pt close
+        // than EIO? Is this even standard?
+        if (rd == 0 || (rd == -1 && errno == EIO)) {
+            debug(format("%1%: got EOF") % goal->getName());
+            child.fds.erase(fd);
+            childFds.erase(i);
+            poller.remove(fd);
+            goal->handleEOF(fd);
+        } else if (rd == -1) {
+            if (errno != EINTR)
+                throw SysError("%s: read failed", goal->getName());
+        } else {
+            printMsg(lvlVomit, format("%1%: read %2% bytes")
+                % goal->getName() % rd);
+            string data((char *) readBuffer.data(), rd);
+            child.lastOutput = after;
+            goal->handleChildOutput(fd, data);
         }
+    }
 
-        else if (goal->getExitCode() == Goal::ecBusy &&
-            0 != settings.buildTimeout &&
-            j->respectTimeouts &&
-            after - j->timeStarted >= std::chrono::seconds(settings.buildTimeout))
-        {
-            printError(
-                format("%1% timed out after %2% seconds")
-                % goal->getName() % settings.buildTimeout);
-            goal->timedOut();
+    /* Check for timeouts, but only if some deadline has passed. */
+    if (after >= nearestTimeout) {
+        decltype(children)::iterator i;
+        for (auto j = children.begin(); j != children.end(); j = i) {
+            i = std::next(j);
+
+            GoalPtr goal = j->goal.lock();
+            assert(goal);
+
+            if (goal->getExitCode() == Goal::ecBusy &&
+                0 != settings.maxSilentTime &&
+                j->respectTimeouts &&
+                after - j->lastOutput >= std::chrono::seconds(settings.maxSilentTime))
+            {
+                printError(
+                    format("%1% timed out after %2% seconds of silence")
+                    % goal->getName() % settings.maxSilentTime);
+                goal->timedOut();
+            }
+
+            else if (goal->getExitCode() == Goal::ecBusy &&
+                0 != settings.buildTimeout &&
+                j->respectTimeouts &&
+                after - j->timeStarted >= std::chrono::seconds(settings.buildTimeout))
+            {
+                printError(
+                    format("%1% timed out after %2% seconds")
+                    % goal->getName() % settings.buildTimeout);
+                goal->timedOut();
+            }
         }
     }
 
-    if (!waitingForAWhile.empty() && lastWokenUp + std::chrono::seconds(settings.pollInterval) <= after) {
+    if ((!waitingForAWhile.empty() || !waitingForLock.empty() || !waitingForGlobalBuildSlot.empty())
+        && lastWokenUp + std::chrono::seconds(settings.pollInterval) <= after)
+    {
         lastWokenUp = after;
         for (auto & i : waitingForAWhile) {
             GoalPtr goal = i.lock();
             if (goal) wakeUp(goal);
         }
         waitingForAWhile.clear();
+        for (auto & i : waitingForGlobalBuildSlot) {
+            GoalPtr goal = i.lock();
+            if (goal) wakeUp(goal);
+        }
+        waitingForGlobalBuildSlot.clear();
+        for (auto & i : waitingForLock) {
+            lockMonitor.unwatch(i.first);
+            for (auto & j : i.second) {
+                GoalPtr goal = j.lock();
+                if (goal) wakeUp(goal);
+            }
+        }
+        waitingForLock.clear();
     }
 }
 
@@ -81,7 +81,7 @@ struct CurlDownloader : public Downloader
             : downloader(downloader)
             , request(request)
             , act(*logger, lvlTalkative, actDownload,
-                fmt(request.data ? "uploading '%s'" : "downloading '%s'", request.uri),
+                fmt(request.isUpload() ? "uploading '%s'" : "downloading '%s'", request.uri),
                 {request.uri}, request.parentAct)
             , callback(std::move(callback))
             , finalSink([this](const unsigned char * data, size_t len) {
@@ -96,6 +96,16 @@ struct CurlDownloader : public Downloader
                 requestHeaders = curl_slist_append(requestHeaders, ("If-None-Match: " + request.expectedETag).c_str());
             if (!request.mimeType.empty())
                 requestHeaders = curl_slist_append(requestHeaders, ("Content-Type: " + request.mimeType).c_str());
+            if (!request.dataFile.empty()) {
+                dataFd = open(request.dataFile.c_str(), O_RDONLY | O_CLOEXEC);
+                if (!dataFd)
+                    throw SysError("opening file '%s'", request.dataFile);
+                struct stat st;
+                if (fstat(dataFd.get(), &st))
+                    throw SysError("getting attributes of file '%s'", request.dataFile);
+                dataSize = st.st_size;
+            } else if (request.data)
+                dataSize = request.data->size();
         }
 
         ~DownloadItem()
@@ -219,14 +229,22 @@ struct CurlDownloader : public Downloader
             return 0;
         }
 
+        AutoCloseFD dataFd;
+        size_t dataSize = 0;
+
         size_t readOffset = 0;
         size_t readCallback(char *buffer, size_t size, size_t nitems)
         {
-            if (readOffset == request.data->length())
+            if (readOffset == dataSize)
                 return 0;
-            auto count = std::min(size * nitems, request.data->length() - readOffset);
+            auto count = std::min(size * nitems, dataSize - readOffset);
             assert(count);
-            memcpy(buffer, request.data->data() + readOffset, count);
+            if (dataFd) {
+                auto n = pread(dataFd.get(), buffer, count, readOffset);
+                if (n <= 0) return CURL_READFUNC_ABORT;
+                count = n;
+            } else
+                memcpy(buffer, request.data->data() + readOffset, count);
             readOffset += count;
             return count;
         }
@@ -277,11 +295,13 @@ struct CurlDownloader : public Downloader
             if (request.head)
                 curl_easy_setopt(req, CURLOPT_NOBODY, 1);
 
-            if (request.data) {
+            if (request.isUpload()) {
+                /* Start from the beginning if this is a retry. */
+                readOffset = 0;
                 curl_easy_setopt(req, CURLOPT_UPLOAD, 1L);
                 curl_easy_setopt(req, CURLOPT_READFUNCTION, readCallbackWrapper);
                 curl_easy_setopt(req, CURLOPT_READDATA, this);
-                curl_easy_setopt(req, CURLOPT_INFILESIZE_LARGE, (curl_off_t) request.data->length());
+                curl_easy_setopt(req, CURLOPT_INFILESIZE_LARGE, (curl_off_t) dataSize);
             }
 
             if (request.verifyTLS) {
@@ -473,13 +493,27 @@ struct CurlDownloader : public Downloader
 
     ~CurlDownloader()
     {
-        stopWorkerThread();
-
-        workerThread.join();
+        if (workerThread.joinable()) {
+            stopWorkerThread();
+            workerThread.join();
+        }
 
         if (curlm) curl_multi_cleanup(curlm);
     }
 
+    /* Prepare for destruction in a child process created by fork(),
+       where the worker thread doesn't exist and can't be joined. The
+       curl handles are not cleaned up, since that could shut down
+       connections that are still used by the parent. */
+    void releaseAfterFork()
+    {
+        workerThread.detach();
+        curlm = nullptr;
+        auto state(state_.lock());
+        while (!state->incoming.empty()) state->incoming.pop();
+        state->quit = true;
+    }
+
     void stopWorkerThread()
     {
         /* Signal the worker thread to exit. */
@@ -604,7 +638,7 @@ struct CurlDownloader : public Downloader
 
     void enqueueItem(std::shared_ptr<DownloadItem> item)
     {
-        if (item->request.data
+        if (item->request.isUpload()
             && !hasPrefix(item->request.uri, "http://")
             && !hasPrefix(item->request.uri, "https://"))
             throw nix::Error("uploading to '%s' is not supported", item->request.uri);
@@ -669,12 +703,33 @@ struct CurlDownloader : public Downloader
     }
 };
 
-ref<Downloader> getDownloader()
+static bool downloaderCreated = false;
+
+static ref<Downloader> & sharedDownloader()
 {
-    static ref<Downloader> downloader = makeDownloader();
+    static ref<Downloader> downloader = []() {
+        downloaderCreated = true;
+        return makeDownloader();
+    }();
     return downloader;
 }
 
+ref<Downloader> getDownloader()
+{
+    return sharedDownloader();
+}
+
+void resetDownloaderAfterFork()
+{
+    /* The parent's downloader can't be used, since its worker thread
+       doesn't exist in this process. */
+    if (!downloaderCreated) return;
+    auto & downloader = sharedDownloader();
+    if (auto curlDownloader = downloader.dynamic_pointer_cast<CurlDownloader>())
+        curlDownloader->releaseAfterFork();
+    downloader = makeDownloader();
+}
+
 ref<Downloader> makeDownloader()
 {
     return make_ref<CurlDownloader>();
@@ -44,15 +44,23 @@ struct DownloadRequest
     ActivityId parentAct;
     bool decompress = true;
     std::shared_ptr<std::string> data;
+    /* A file to upload, as an alternative to 'data'. It is streamed
+       rather than read into memory. */
+    Path dataFile;
     std::string mimeType;
     std::function<void(char *, size_t)> dataCallback;
 
     DownloadRequest(const std::string & uri)
         : uri(uri), parentAct(getCurActivity()) { }
 
+    bool isUpload() const
+    {
+        return data || !dataFile.empty();
+    }
+
     std::string verb()
     {
-        return data ? "upload" : "download";
+        return isUpload() ? "upload" : "download";
     }
 };
 
@@ -124,6 +132,11 @@ ref<Downloader> getDownloader();
 /* Return a new Downloader object. */
 ref<Downloader> makeDownloader();
 
+/* Replace the shared Downloader object in a child process forked
+   without exec (see forkEvalWorkers()). Must be called before
+   getDownloader() is used in the child. */
+void resetDownloaderAfterFork();
+
 class DownloadError : public Error
 {
 public:
@@ -2,7 +2,10 @@
 #include "globals.hh"
 #include "local-store.hh"
 #include "finally.hh"
+#include "thread-pool.hh"
 
+#include <array>
+#include <atomic>
 #include <functional>
 #include <queue>
 #include <algorithm>
@@ -16,6 +19,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <climits>
+#include <cstring>
 
 namespace nix {
 
@@ -316,16 +320,39 @@ void LocalStore::findRoots(const Path & path, unsigned char type, Roots & roots)
 }
 
 
-void LocalStore::findRootsNoTemp(Roots & roots, bool censor)
+/* Records how long each phase of root discovery took. */
+struct PhaseTimer
 {
+    LocalStore::RootTimings * timings;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    PhaseTimer(LocalStore::RootTimings * timings) : timings(timings) { }
+
+    /* Record the time since the previous phase ended. */
+    void operator () (const std::string & phase)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (timings)
+            timings->emplace_back(phase, std::chrono::duration<double>(now - start).count());
+        start = now;
+    }
+};
+
+
+void LocalStore::findRootsNoTemp(Roots & roots, bool censor, RootTimings * timings)
+{
+    PhaseTimer timer(timings);
+
     /* Process direct roots in {gcroots,profiles}. */
     findRoots(stateDir + "/" + gcRootsDir, DT_UNKNOWN, roots);
+    timer("gcroots");
     findRoots(stateDir + "/profiles", DT_UNKNOWN, roots);
+    timer("profiles");
 
     /* Add additional roots returned by different platforms-specific
        heuristics.  This is typically used to add running programs to
        the set of roots (to prevent them from being garbage collected). */
-    findRuntimeRoots(roots, censor);
+    findRuntimeRoots(roots, censor, timings);
 }
 
 
@@ -363,12 +390,96 @@ try_again:
             .emplace(file);
 }
 
-static string quoteRegexChars(const string & raw)
+/* Call 'found' for every store path (i.e. the store directory
+   followed by a base-32 hash and a name) that occurs in
+   'data'. Candidates are located with memchr() rather than a regular
+   expression, since this is run on the memory maps and environment
+   of every process. */
+template<typename F>
+static void scanForStorePaths(const Path & storeDir, const char * data, size_t len, F found)
 {
-    static auto specialRegex = std::regex(R"([.^$\\*+?()\[\]{}|])");
-    return std::regex_replace(raw, specialRegex, R"(\$&)");
+    static auto isBase32 = []() {
+        std::array<bool, 256> res{};
+        for (auto c : base32Chars) res[(unsigned char) c] = true;
+        return res;
+    }();
+
+    auto isNameChar = [](char c) {
+        return isalnum((unsigned char) c) || strchr("+-._?=", c);
+    };
+
+    auto prefixLen = storeDir.size() + 1;
+    auto p = data, end = data + len;
+
+    while ((p = (const char *) memchr(p, storeDir[0], end - p))) {
+        if ((size_t) (end - p) >= prefixLen + storePathHashLen
+            && memcmp(p, storeDir.data(), storeDir.size()) == 0
+            && p[storeDir.size()] == '/')
+        {
+            auto q = p + prefixLen;
+            auto hashEnd = q + storePathHashLen;
+            while (q < hashEnd && isBase32[(unsigned char) *q]) q++;
+            if (q == hashEnd) {
+                while (q < end && *q && isNameChar(*q)) q++;
+                found(std::string(p, q));
+                p = q;
+                continue;
+            }
+        }
+        p++;
+    }
 }
 
+
+static bool isPid(const char * s)
+{
+    if (!*s) return false;
+    for (; *s; ++s)
+        if (!isdigit((unsigned char) *s)) return false;
+    return true;
+}
+
+
+/* Find the store paths used by process 'pid': its executable, working
+   directory, open files, memory mappings and environment. */
+static void findProcessRoots(const Path & storeDir, const std::string & pid, Roots & roots)
+{
+    readProcLink(fmt("/proc/%s/exe" , pid), roots);
+    readProcLink(fmt("/proc/%s/cwd", pid), roots);
+
+    auto fdStr = fmt("/proc/%s/fd", pid);
+    auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
+    if (!fdDir) {
+        if (errno == ENOENT || errno == EACCES)
+            return;
+        throw SysError(format("opening %1%") % fdStr);
+    }
+    struct dirent * fd_ent;
+    while (errno = 0, fd_ent = readdir(fdDir.get())) {
+        if (fd_ent->d_name[0] != '.')
+            readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), roots);
+    }
+    if (errno) {
+        if (errno == ESRCH)
+            return;
+        throw SysError(format("iterating /proc/%1%/fd") % pid);
+    }
+    fdDir.reset();
+
+    try {
+        for (auto & file : {fmt("/proc/%s/maps", pid), fmt("/proc/%s/environ", pid)}) {
+            auto contents = readFile(file, true);
+            scanForStorePaths(storeDir, contents.data(), contents.size(),
+                [&](std::string && path) { roots[std::move(path)].emplace(file); });
+        }
+    } catch (SysError & e) {
+        if (e.errNo == ENOENT || e.errNo == EACCES || e.errNo == ESRCH)
+            return;
+        throw;
+    }
+}
+
+
 static void readFileRoots(const char * path, Roots & roots)
 {
     try {
@@ -379,64 +490,49 @@ static void readFileRoots(const char * path, Roots & roots)
     }
 }
 
-void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
+void LocalStore::findRuntimeRoots(Roots & roots, bool censor, RootTimings * timings)
 {
+    PhaseTimer timer(timings);
+
     Roots unchecked;
 
     auto procDir = AutoCloseDir{opendir("/proc")};
     if (procDir) {
+        std::vector<std::string> pids;
         struct dirent * ent;
-        auto digitsRegex = std::regex(R"(^\d+$)");
-        auto mapRegex = std::regex(R"(^\s*\S+\s+\S+\s+\S+\s+\S+\s+\S+\s+(/\S+)\s*$)");
-        auto storePathRegex = std::regex(quoteRegexChars(storeDir) + R"(/[0-9a-z]+[0-9a-zA-Z\+\-\._\?=]*)");
         while (errno = 0, ent = readdir(procDir.get())) {
             checkInterrupt();
-            if (std::regex_match(ent->d_name, digitsRegex)) {
-                readProcLink(fmt("/proc/%s/exe" ,ent->d_name), unchecked);
-                readProcLink(fmt("/proc/%s/cwd", ent->d_name), unchecked);
-
-                auto fdStr = fmt("/proc/%s/fd", ent->d_name);
-                auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
-                if (!fdDir) {
-                    if (errno == ENOENT || errno == EACCES)
-                        continue;
-                    throw SysError(format("opening %1%") % fdStr);
-                }
-                struct dirent * fd_ent;
-                while (errno = 0, fd_ent = readdir(fdDir.get())) {
-                    if (fd_ent->d_name[0] != '.')
-                        readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), unchecked);
-                }
-                if (errno) {
-                    if (errno == ESRCH)
-                        continue;
-                    throw SysError(format("iterating /proc/%1%/fd") % ent->d_name);
-                }
-                fdDir.reset();
-
-                try {
-                    auto mapFile = fmt("/proc/%s/maps", ent->d_name);
-                    auto mapLines = tokenizeString<std::vector<string>>(readFile(mapFile, true), "\n");
-                    for (const auto & line : mapLines) {
-                        auto match = std::smatch{};
-                        if (std::regex_match(line, match, mapRegex))
-                            unchecked[match[1]].emplace(mapFile);
-                    }
-
-                    auto envFile = fmt("/proc/%s/environ", ent->d_name);
-                    auto envString = readFile(envFile, true);
-                    auto env_end = std::sregex_iterator{};
-                    for (auto i = std::sregex_iterator{envString.begin(), envString.end(), storePathRegex}; i != env_end; ++i)
-                        unchecked[i->str()].emplace(envFile);
-                } catch (SysError & e) {
-                    if (errno == ENOENT || errno == EACCES || errno == ESRCH)
-                        continue;
-                    throw;
-                }
-            }
+            if (isPid(ent->d_name))
+                pids.push_back(ent->d_name);
         }
         if (errno)
             throw SysError("iterating /proc");
+        procDir.reset();
+
+        /* Scan the processes in parallel, in batches to limit the
+           number of merges. */
+        Sync<Roots> unchecked_;
+        ThreadPool pool;
+        static const size_t batchSize = 64;
+
+        for (size_t i = 0; i < pids.size(); i += batchSize) {
+            pool.enqueue([&, i]() {
+                Roots found;
+                for (size_t j = i; j < std::min(i + batchSize, pids.size()); ++j) {
+                    checkInterrupt();
+                    findProcessRoots(storeDir, pids[j], found);
+                }
+                auto unchecked(unchecked_.lock());
+                for (auto & [target, links] : found)
+                    (*unchecked)[target].insert(links.begin(), links.end());
+            });
+        }
+
+        pool.process();
+
+        unchecked = std::move(*unchecked_.lock());
+
+        timer(fmt("/proc (%d processes)", pids.size()));
     }
 
 #if !defined(__linux__)
@@ -456,6 +552,7 @@ void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
         } catch (ExecError & e) {
             /* lsof not installed, lsof failed */
         }
+        timer("lsof");
     }
 #endif
 
@@ -463,6 +560,7 @@ void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
     readFileRoots("/proc/sys/kernel/modprobe", unchecked);
     readFileRoots("/proc/sys/kernel/fbsplash", unchecked);
     readFileRoots("/proc/sys/kernel/poweroff_cmd", unchecked);
+    timer("kernel");
 #endif
 
     for (auto & [target, links] : unchecked) {
@@ -477,6 +575,8 @@ void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
             }
         }
     }
+
+    timer(fmt("checking %d runtime roots", unchecked.size()));
 }
 
 
@@ -491,6 +591,9 @@ struct LocalStore::GCState
     PathSet tempRoots;
     PathSet dead;
     PathSet alive;
+    /* Dead paths that were not valid when liveness was determined
+       (used by the incremental collector). */
+    PathSet deadInvalid;
     bool gcKeepOutputs;
     bool gcKeepDerivations;
     unsigned long long bytesInvalidated;
@@ -500,6 +603,284 @@ struct LocalStore::GCState
 };
 
 
+/* The graph of valid paths, loaded from the database in bulk so that
+   liveness can be computed without a query per path. Nodes are
+   numbered in order of their ValidPaths.id. Edges are stored in
+   compressed sparse row form: the successors of node n are
+   'targets[start[n] .. start[n + 1])'. */
+struct LocalStore::GCGraph
+{
+    typedef uint32_t Node;
+
+    static const Node none = std::numeric_limits<Node>::max();
+
+    /* The database ID, path and NAR size of each node. */
+    std::vector<int64_t> ids;
+    std::vector<Path> paths;
+    std::vector<uint64_t> narSizes;
+
+    /* The nodes sorted by path. */
+    std::vector<Node> byPath;
+
+    /* The references of each node. */
+    std::vector<size_t> refsStart;
+    std::vector<Node> refs;
+
+    /* Additional edges required by the keep-outputs and
+       keep-derivations settings. */
+    std::vector<size_t> keepStart;
+    std::vector<Node> keep;
+
+    /* Whether each node is reachable from a root. */
+    std::vector<bool> live;
+
+    size_t size() const { return ids.size(); }
+
+    Node fromId(int64_t id) const
+    {
+        auto i = std::lower_bound(ids.begin(), ids.end(), id);
+        return i != ids.end() && *i == id ? i - ids.begin() : none;
+    }
+
+    Node fromPath(const Path & path) const
+    {
+        auto i = std::lower_bound(byPath.begin(), byPath.end(), path,
+            [&](Node n, const Path & p) { return paths[n] < p; });
+        return i != byPath.end() && paths[*i] == path ? *i : none;
+    }
+
+    template<typename F>
+    void forEachSuccessor(Node n, F f) const
+    {
+        for (auto i = refsStart[n]; i < refsStart[n + 1]; ++i) f(refs[i]);
+        for (auto i = keepStart[n]; i < keepStart[n + 1]; ++i) f(keep[i]);
+    }
+
+    /* Set 'live' to the nodes reachable from 'roots'. Large graphs
+       are traversed by multiple threads. */
+    void mark(const std::vector<Node> & roots)
+    {
+        std::unique_ptr<std::atomic<bool>[]> marked(new std::atomic<bool>[size()]());
+
+        static const size_t chunkSize = 4096;
+
+        ThreadPool pool(size() >= 100000 ? 0 : 1);
+
+        std::function<void(std::vector<Node>)> visit;
+        visit = [&](std::vector<Node> todo) {
+            while (!todo.empty()) {
+                auto n = todo.back();
+                todo.pop_back();
+                forEachSuccessor(n, [&](Node m) {
+                    if (!marked[m].exchange(true))
+                        todo.push_back(m);
+                });
+                /* Hand off part of a large stack to another thread. */
+                if (todo.size() >= 2 * chunkSize) {
+                    std::vector<Node> part(todo.end() - chunkSize, todo.end());
+                    todo.resize(todo.size() - chunkSize);
+                    pool.enqueue([&visit, part{std::move(part)}]() { visit(part); });
+                }
+            }
+        };
+
+        std::vector<Node> todo;
+        for (auto n : roots)
+            if (!marked[n].exchange(true))
+                todo.push_back(n);
+        pool.enqueue([&visit, todo{std::move(todo)}]() { visit(todo); });
+        pool.process();
+
+        live.resize(size());
+        for (size_t n = 0; n < size(); ++n)
+            live[n] = marked[n];
+    }
+
+    /* Return the dead nodes in an order in which they can be deleted,
+       i.e. every path comes after its referrers. The order is
+       otherwise random, to make the collector less biased when using
+       --max-freed. */
+    std::vector<Node> deletionOrder() const
+    {
+        std::vector<uint32_t> referrers(size(), 0);
+        for (Node n = 0; n < size(); ++n)
+            if (!live[n])
+                for (auto i = refsStart[n]; i < refsStart[n + 1]; ++i)
+                    if (refs[i] != n) referrers[refs[i]]++;
+
+        std::vector<Node> ready, order;
+        for (Node n = 0; n < size(); ++n)
+            if (!live[n] && !referrers[n]) ready.push_back(n);
+
+        std::mt19937 gen(1);
+
+        while (!ready.empty()) {
+            auto i = std::uniform_int_distribution<size_t>(0, ready.size() - 1)(gen);
+            auto n = ready[i];
+            ready[i] = ready.back();
+            ready.pop_back();
+            order.push_back(n);
+            for (auto j = refsStart[n]; j < refsStart[n + 1]; ++j)
+                if (refs[j] != n && !--referrers[refs[j]])
+                    ready.push_back(refs[j]);
+        }
+
+        /* Cycles can't happen in a consistent database, but if they
+           do, deletePathRecursive() sorts them out. */
+        for (Node n = 0; n < size(); ++n)
+            if (!live[n] && referrers[n]) order.push_back(n);
+
+        return order;
+    }
+};
+
+
+/* Build a compressed sparse row representation from a list of
+   edges. */
+static void makeCSR(size_t nodes, std::vector<std::pair<uint32_t, uint32_t>> & edges,
+    std::vector<size_t> & start, std::vector<uint32_t> & targets)
+{
+    std::sort(edges.begin(), edges.end());
+    start.assign(nodes + 1, 0);
+    for (auto & e : edges) start[e.first + 1]++;
+    for (size_t n = 0; n < nodes; ++n) start[n + 1] += start[n];
+    targets.clear();
+    targets.reserve(edges.size());
+    for (auto & e : edges) targets.push_back(e.second);
+}
+
+
+void LocalStore::loadGCGraph(GCState & state, GCGraph & graph)
+{
+    retrySQLite<void>([&]() {
+        auto dbState(_state.lock());
+
+        graph = GCGraph();
+
+        SQLiteTxn txn(dbState->db);
+
+        {
+            SQLiteStmt stmt(dbState->db, "select id, path, narSize from ValidPaths order by id");
+            auto use(stmt.use());
+            while (use.next()) {
+                graph.ids.push_back(use.getInt(0));
+                graph.paths.push_back(use.getStr(1));
+                graph.narSizes.push_back(use.isNull(2) ? 0 : use.getInt(2));
+            }
+        }
+
+        {
+            SQLiteStmt stmt(dbState->db, "select id from ValidPaths order by path");
+            auto use(stmt.use());
+            graph.byPath.reserve(graph.size());
+            while (use.next())
+                graph.byPath.push_back(graph.fromId(use.getInt(0)));
+        }
+
+        /* Since the rows are sorted by referrer, the references can
+           be appended to the CSR arrays directly. */
+        {
+            SQLiteStmt stmt(dbState->db, "select referrer, reference from Refs order by referrer");
+            auto use(stmt.use());
+            graph.refsStart.assign(graph.size() + 1, 0);
+            GCGraph::Node prev = 0;
+            while (use.next()) {
+                auto referrer = graph.fromId(use.getInt(0));
+                auto reference = graph.fromId(use.getInt(1));
+                if (referrer == GCGraph::none || reference == GCGraph::none) continue;
+                while (prev < referrer) graph.refsStart[++prev] = graph.refs.size();
+                graph.refs.push_back(reference);
+            }
+            while (prev < graph.size()) graph.refsStart[++prev] = graph.refs.size();
+        }
+
+        /* With keep-outputs, a live derivation keeps its valid outputs
+           alive. With keep-derivations, a live output keeps alive the
+           derivation that produced it. */
+        std::vector<std::pair<uint32_t, uint32_t>> keep;
+        if (state.gcKeepOutputs || state.gcKeepDerivations) {
+            SQLiteStmt stmt(dbState->db,
+                "select d.drv, v.id, v.deriver = p.path from DerivationOutputs d "
+                "join ValidPaths v on v.path = d.path "
+                "join ValidPaths p on p.id = d.drv");
+            auto use(stmt.use());
+            while (use.next()) {
+                auto drv = graph.fromId(use.getInt(0));
+                auto output = graph.fromId(use.getInt(1));
+                if (drv == GCGraph::none || output == GCGraph::none || drv == output) continue;
+                if (state.gcKeepOutputs)
+                    keep.emplace_back(drv, output);
+                if (state.gcKeepDerivations && use.getInt(2))
+                    keep.emplace_back(output, drv);
+            }
+        }
+        makeCSR(graph.size(), keep, graph.keepStart, graph.keep);
+
+        txn.commit();
+    });
+}
+
+
+/* Determine which paths are dead. The valid paths are handled by
+   marking the paths reachable from the roots in a graph loaded from
+   the database; they are added to 'state.dead' (and to 'state.alive'
+   if the caller wants the live paths). Invalid entries in the store
+   directory are passed to tryToDelete(), which deletes them if
+   'state.shouldDelete' is set. Returns the dead valid paths and
+   their NAR sizes, in the order in which they should be deleted. */
+vector<std::pair<Path, uint64_t>> LocalStore::findDeadPaths(GCState & state)
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    GCGraph graph;
+    loadGCGraph(state, graph);
+
+    std::vector<GCGraph::Node> roots;
+    for (auto & root : state.roots) {
+        auto n = graph.fromPath(root);
+        if (n != GCGraph::none) roots.push_back(n);
+    }
+
+    graph.mark(roots);
+
+    vector<std::pair<Path, uint64_t>> dead;
+    for (auto n : graph.deletionOrder()) {
+        dead.emplace_back(graph.paths[n], graph.narSizes[n]);
+        state.dead.insert(graph.paths[n]);
+    }
+
+    if (state.options.action == GCOptions::gcReturnLive)
+        for (GCGraph::Node n = 0; n < graph.size(); ++n)
+            if (graph.live[n]) state.alive.insert(graph.paths[n]);
+
+    printMsg(lvlTalkative, format("found %1% dead paths among %2% valid paths with %3% references in %4% ms")
+        % dead.size() % graph.size() % graph.refs.size()
+        % std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count());
+
+    /* Read the store and delete (or record) all paths that aren't
+       valid. When using --max-freed etc., deleting invalid paths is
+       preferred over deleting unreachable paths, since unreachable
+       paths could become reachable again. We don't use
+       readDirectory() here so that GCing can start faster. */
+    AutoCloseDir dir(opendir(realStoreDir.c_str()));
+    if (!dir) throw SysError(format("opening directory '%1%'") % realStoreDir);
+
+    struct dirent * dirent;
+    while (errno = 0, dirent = readdir(dir.get())) {
+        checkInterrupt();
+        string name = dirent->d_name;
+        if (name == "." || name == "..") continue;
+        Path path = storeDir + "/" + name;
+        if (!isStorePath(path) || graph.fromPath(path) == GCGraph::none) {
+            tryToDelete(state, path);
+            if (state.dead.count(path)) state.deadInvalid.insert(path);
+        }
+    }
+
+    return dead;
+}
+
+
 bool LocalStore::isActiveTempFile(const GCState & state,
     const Path & path, const string & suffix)
 {
@@ -531,6 +912,15 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
         invalidatePathChecked(path);
     }
 
+    deleteFromStore(state, path, size);
+}
+
+
+/* Delete the store directory entry of a path that is no longer
+   valid, moving it to the trash directory if possible. 'size' is
+   the estimated amount of space that this frees. */
+void LocalStore::deleteFromStore(GCState & state, const Path & path, unsigned long long size)
+{
     Path realPath = realStoreDir + "/" + baseNameOf(path);
 
     struct stat st;
@@ -575,24 +965,11 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
 }
 
 
-bool LocalStore::canReachRoot(GCState & state, PathSet & visited, const Path & path)
+/* Return the paths that keep 'path' alive if they are alive
+   themselves: its referrers, and depending on the keep-derivations
+   and keep-outputs settings, its outputs or derivers. */
+PathSet LocalStore::queryGCReferrers(GCState & state, const Path & path)
 {
-    if (visited.count(path)) return false;
-
-    if (state.alive.count(path)) return true;
-
-    if (state.dead.count(path)) return false;
-
-    if (state.roots.count(path)) {
-        debug(format("cannot delete '%1%' because it's a root") % path);
-        state.alive.insert(path);
-        return true;
-    }
-
-    visited.insert(path);
-
-    if (!isStorePath(path) || !isValidPath(path)) return false;
-
     PathSet incoming;
 
     /* Don't delete this path if any of its referrers are alive. */
@@ -615,7 +992,29 @@ bool LocalStore::canReachRoot(GCState & state, PathSet & visited, const Path & p
             incoming.insert(i);
     }
 
-    for (auto & i : incoming)
+    return incoming;
+}
+
+
+bool LocalStore::canReachRoot(GCState & state, PathSet & visited, const Path & path)
+{
+    if (visited.count(path)) return false;
+
+    if (state.alive.count(path)) return true;
+
+    if (state.dead.count(path)) return false;
+
+    if (state.roots.count(path)) {
+        debug(format("cannot delete '%1%' because it's a root") % path);
+        state.alive.insert(path);
+        return true;
+    }
+
+    visited.insert(path);
+
+    if (!isStorePath(path) || !isValidPath(path)) return false;
+
+    for (auto & i : queryGCReferrers(state, path))
         if (i != path)
             if (canReachRoot(state, visited, i)) {
                 state.alive.insert(path);
@@ -666,6 +1065,185 @@ void LocalStore::tryToDelete(GCState & state, const Path & path)
 }
 
 
+/* Delete a path that the incremental collector found to be dead,
+   unless something has made it alive again since then. Its referrers
+   (in the sense of queryGCReferrers()) are deleted first; if any of
+   them is alive, then so is this path. Returns whether the path is
+   (still) dead. */
+bool LocalStore::deleteIfStillDead(GCState & state, PathSet & visited, const Path & path)
+{
+    checkInterrupt();
+
+    if (!state.dead.count(path)) return false;
+
+    /* We're already deleting this path further up the stack. */
+    if (!visited.insert(path).second) return true;
+
+    auto alive = [&](const std::string & reason) {
+        debug("not deleting '%s' because %s", path, reason);
+        state.dead.erase(path);
+        return false;
+    };
+
+    if (state.roots.count(path))
+        return alive("it has become a root");
+
+    if (isStorePath(path) && isValidPath(path)) {
+
+        if (state.deadInvalid.count(path))
+            return alive("it has become valid");
+
+        for (auto & i : queryGCReferrers(state, path))
+            if (i != path && isValidPath(i) && !deleteIfStillDead(state, visited, i))
+                return alive(fmt("'%s' is alive", i));
+
+    } else {
+        if (isActiveTempFile(state, path, ".lock")
+            || isActiveTempFile(state, path, ".chroot")
+            || isActiveTempFile(state, path, ".check"))
+            return alive("it is in use by a build");
+    }
+
+    deletePathRecursive(state, path);
+
+    return true;
+}
+
+
+/* Delete the garbage without holding the GC lock for the whole
+   run. The dead paths are determined once, from the roots that our
+   caller found while holding the GC lock. The lock is then released,
+   and the dead paths are deleted in batches of at most
+   'gc-batch-size' paths. Each batch re-acquires the GC lock, finds
+   the roots again, and skips paths that have become reachable since
+   (see deleteIfStillDead()). Deleting the contents of a batch
+   is done after the lock has been released again. */
+void LocalStore::collectGarbageIncremental(GCState & state, AutoCloseFD & fdGCLock, FDs & fds)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    auto toSeconds = [](Clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::duration<double>>(d).count();
+    };
+
+    auto startTime = Clock::now();
+
+    printError(format("determining live/dead paths..."));
+
+    state.shouldDelete = false;
+    auto dead = findDeadPaths(state);
+    state.shouldDelete = true;
+
+    /* Delete invalid paths first, as the non-incremental collector
+       does. */
+    vector<Path> entries(state.deadInvalid.begin(), state.deadInvalid.end());
+    for (auto & i : dead) entries.push_back(i.first);
+
+    /* From here on, other processes can add roots and paths again. */
+    fdGCLock = -1;
+    fds.clear();
+
+    auto snapshotTime = Clock::now() - startTime;
+
+    printError(format("deleting garbage..."));
+
+    auto deleteStart = Clock::now();
+    Clock::duration totalLockTime{0}, maxLockTime{0};
+    unsigned int batches = 0;
+    size_t pathsDeleted = 0;
+    bool limitReached = false;
+
+    /* A batch size of 0 would never make progress. */
+    unsigned int batchSize = std::max(1U, (unsigned int) settings.gcBatchSize);
+
+    auto i = entries.begin();
+
+    while (i != entries.end() && !limitReached) {
+
+        fdGCLock = openGCLock(ltWrite);
+        auto lockStart = Clock::now();
+
+        /* Paths that have become roots since liveness was
+           determined are alive again, and so is everything they
+           refer to, which deleteIfStillDead() discovers through the
+           referrers. This includes permanent and runtime roots:
+           addPermRoot() only waits for the GC lock after creating
+           the root, so a root can appear between batches while the
+           temporary root that protected its path goes away. */
+        Roots roots;
+        findRootsNoTemp(roots, true);
+        FDs batchFDs;
+        Roots tempRoots;
+        findTempRoots(batchFDs, tempRoots, true);
+        state.roots.clear();
+        state.tempRoots.clear();
+        for (auto & root : roots)
+            state.roots.insert(root.first);
+        for (auto & root : tempRoots) {
+            state.roots.insert(root.first);
+            state.tempRoots.insert(root.first);
+        }
+
+        if (state.moveToTrash) {
+            try {
+                createDirs(trashDir);
+            } catch (SysError & e) {
+                if (e.errNo != ENOSPC) throw;
+                printInfo(format("note: can't create trash directory: %1%") % e.msg());
+                state.moveToTrash = false;
+            }
+        }
+
+        auto deletedBefore = state.results.paths.size();
+
+        try {
+            for (size_t n = 0;
+                 i != entries.end() && n < batchSize
+                     && state.results.paths.size() - deletedBefore < batchSize;
+                 ++i, ++n)
+            {
+                PathSet visited;
+                deleteIfStillDead(state, visited, *i);
+            }
+        } catch (GCLimitReached & e) {
+            limitReached = true;
+        }
+
+        pathsDeleted += state.results.paths.size() - deletedBefore;
+
+        /* Move the paths that this batch put in the trash directory
+           out of the way, so that they can be deleted without holding
+           the GC lock. */
+        Path batchTrash = (format("%1%-%2%-%3%") % trashDir % getpid() % batches).str();
+        if (pathExists(trashDir) && rename(trashDir.c_str(), batchTrash.c_str()))
+            throw SysError(format("unable to rename '%1%' to '%2%'") % trashDir % batchTrash);
+
+        fdGCLock = -1;
+        batchFDs.clear();
+
+        auto lockTime = Clock::now() - lockStart;
+        totalLockTime += lockTime;
+        maxLockTime = std::max(maxLockTime, lockTime);
+        batches++;
+
+        deleteGarbage(state, batchTrash);
+        state.bytesInvalidated = 0;
+    }
+
+    auto deleteTime = toSeconds(Clock::now() - deleteStart);
+    double mib = state.results.bytesFreed / (1024.0 * 1024.0);
+
+    printInfo(format("incremental GC: determined liveness in %.3f s; deleted %d paths (%.2f MiB) in %d batches in %.3f s (%.1f paths/s, %.2f MiB/s)")
+        % toSeconds(snapshotTime) % pathsDeleted % mib % batches % deleteTime
+        % (deleteTime > 0 ? pathsDeleted / deleteTime : 0.0)
+        % (deleteTime > 0 ? mib / deleteTime : 0.0));
+
+    printInfo(format("incremental GC: GC lock held for %.3f s while determining liveness, %.3f s while deleting (at most %.3f s, on average %.3f s per batch)")
+        % toSeconds(snapshotTime) % toSeconds(totalLockTime) % toSeconds(maxLockTime)
+        % (batches ? toSeconds(totalLockTime) / batches : 0.0));
+}
+
+
 /* Unlink all files in /nix/store/.links that have a link count of 1,
    which indicates that there are no other links and so they can be
    safely deleted.  FIXME: race condition with optimisePath(): we
@@ -742,9 +1320,10 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     /* Find the roots.  Since we've grabbed the GC lock, the set of
        permanent roots cannot increase now. */
     printError(format("finding garbage collector roots..."));
+    RootTimings timings;
     Roots rootMap;
     if (!options.ignoreLiveness)
-        findRootsNoTemp(rootMap, true);
+        findRootsNoTemp(rootMap, true, &timings);
 
     for (auto & i : rootMap) state.roots.insert(i.first);
 
@@ -753,11 +1332,21 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
        can be added to the set of temporary roots. */
     FDs fds;
     Roots tempRoots;
+    PhaseTimer timer(&timings);
     findTempRoots(fds, tempRoots, true);
+    timer("temporary roots");
     for (auto & root : tempRoots)
         state.tempRoots.insert(root.first);
     state.roots.insert(state.tempRoots.begin(), state.tempRoots.end());
 
+    double total = 0;
+    Strings phases;
+    for (auto & [phase, seconds] : timings) {
+        total += seconds;
+        phases.push_back(fmt("%s: %.3f s", phase, seconds));
+    }
+    printInfo("found %d roots in %.3f s (%s)", state.roots.size(), total, concatStringsSep(", ", phases));
+
     /* After this point the set of roots or temporary roots cannot
        increase, since we hold locks on everything.  So everything
        that is not reachable from `roots' is garbage. */
@@ -790,6 +1379,10 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                     ) % i);
         }
 
+    } else if (options.maxFreed > 0 && options.action == GCOptions::gcDeleteDead && settings.gcIncremental) {
+
+        collectGarbageIncremental(state, fdGCLock, fds);
+
     } else if (options.maxFreed > 0) {
 
         if (state.shouldDelete)
@@ -799,41 +1392,25 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
         try {
 
-            AutoCloseDir dir(opendir(realStoreDir.c_str()));
-            if (!dir) throw SysError(format("opening directory '%1%'") % realStoreDir);
-
-            /* Read the store and immediately delete all paths that
-               aren't valid.  When using --max-freed etc., deleting
-               invalid paths is preferred over deleting unreachable
-               paths, since unreachable paths could become reachable
-               again.  We don't use readDirectory() here so that GCing
-               can start faster. */
-            Paths entries;
-            struct dirent * dirent;
-            while (errno = 0, dirent = readdir(dir.get())) {
-                checkInterrupt();
-                string name = dirent->d_name;
-                if (name == "." || name == "..") continue;
-                Path path = storeDir + "/" + name;
-                if (isStorePath(path) && isValidPath(path))
-                    entries.push_back(path);
-                else
-                    tryToDelete(state, path);
-            }
-
-            dir.reset();
-
-            /* Now delete the unreachable valid paths.  Randomise the
-               order in which we delete entries to make the collector
-               less biased towards deleting paths that come
-               alphabetically first (e.g. /nix/store/000...).  This
-               matters when using --max-freed etc. */
-            vector<Path> entries_(entries.begin(), entries.end());
-            std::mt19937 gen(1);
-            std::shuffle(entries_.begin(), entries_.end(), gen);
-
-            for (auto & i : entries_)
-                tryToDelete(state, i);
+            auto dead = findDeadPaths(state);
+
+            /* Now delete the unreachable valid paths, referrers
+               first. Since we hold the GC lock, they can't have
+               become alive, so there is no need to check them
+               again. */
+            if (state.shouldDelete)
+                for (auto & [path, narSize] : dead) {
+                    checkInterrupt();
+                    try {
+                        invalidatePathChecked(path);
+                    } catch (PathInUse & e) {
+                        /* Part of a reference cycle (see
+                           GCGraph::deletionOrder()). */
+                        deletePathRecursive(state, path);
+                        continue;
+                    }
+                    deleteFromStore(state, path, narSize);
+                }
 
         } catch (GCLimitReached & e) {
         }
@@ -90,6 +90,11 @@ public:
         "Maximum number of parallel build jobs. \"auto\" means use number of cores.",
         {"build-max-jobs"}};
 
+    Setting<unsigned int> globalMaxJobs{this, 0, "global-max-jobs",
+        "Maximum number of local builds running at the same time across all "
+        "Nix processes using this store, such as the builds of all clients "
+        "of the Nix daemon. 0 means no limit."};
+
     Setting<unsigned int> buildCores{this, getDefaultCores(), "cores",
         "Number of CPU cores to utilize in parallel within a build, "
         "i.e. by passing this number to Make via '-j'. 0 means that the "
@@ -166,7 +171,7 @@ public:
     bool printRepeatedBuilds = true;
 
     Setting<unsigned int> pollInterval{this, 5, "build-poll-interval",
-        "How often (in seconds) to poll for locks."};
+        "How often (in seconds) to poll for locks. On Linux, builds waiting for a lock are resumed as soon as it is released, so this only serves as a fallback."};
 
     Setting<bool> checkRootReachability{this, false, "gc-check-reachability",
         "Whether to check if new GC roots can in fact be found by the "
@@ -180,9 +185,29 @@ public:
         "Whether the garbage collector should keep derivers of live paths.",
         {"gc-keep-derivations"}};
 
+    Setting<bool> gcIncremental{this, false, "gc-incremental",
+        "Whether the garbage collector should release the GC lock once it "
+        "has determined the dead paths, and delete them in batches."};
+
+    Setting<unsigned int> gcBatchSize{this, 1000, "gc-batch-size",
+        "The maximum number of store paths that the incremental garbage "
+        "collector deletes while holding the GC lock. 0 is treated as 1."};
+
     Setting<bool> autoOptimiseStore{this, false, "auto-optimise-store",
         "Whether to automatically replace files with identical contents with hard links."};
 
+    Setting<unsigned int> verifyJobs{this, 0, "verify-jobs",
+        "The number of store paths whose contents are checked in parallel "
+        "by 'nix-store --verify --check-contents' (0 means the number of CPUs)."};
+
+    Setting<uint64_t> verifyMaxRate{this, 0, "verify-max-rate",
+        "The maximum rate in bytes per second at which 'nix-store --verify "
+        "--check-contents' reads the store (0 means unlimited)."};
+
+    Setting<bool> verifyResume{this, false, "verify-resume",
+        "Whether 'nix-store --verify --check-contents' skips the paths "
+        "recorded in the checkpoint of an interrupted earlier run."};
+
     Setting<bool> envKeepDerivations{this, false, "keep-env-derivations",
         "Whether to add derivations as a dependency of user environments "
         "(to prevent them from being GCed).",
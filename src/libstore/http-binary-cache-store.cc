@@ -96,6 +96,15 @@ protected:
         }
     }
 
+    void upload(DownloadRequest & req)
+    {
+        try {
+            getDownloader()->download(req);
+        } catch (DownloadError & e) {
+            throw UploadToHTTP("while uploading to HTTP binary cache at '%s': %s", cacheUri, e.msg());
+        }
+    }
+
     void upsertFile(const std::string & path,
         const std::string & data,
         const std::string & mimeType) override
@@ -103,11 +112,19 @@ protected:
         auto req = DownloadRequest(cacheUri + "/" + path);
         req.data = std::make_shared<string>(data); // FIXME: inefficient
         req.mimeType = mimeType;
-        try {
-            getDownloader()->download(req);
-        } catch (DownloadError & e) {
-            throw UploadToHTTP("while uploading to HTTP binary cache at '%s': %s", cacheUri, e.msg());
-        }
+        upload(req);
+    }
+
+    /* Stream the file rather than reading it into memory, since it's
+       usually a NAR. */
+    void upsertFileFromLocal(const std::string & path,
+        const Path & localPath,
+        const std::string & mimeType) override
+    {
+        auto req = DownloadRequest(cacheUri + "/" + path);
+        req.dataFile = localPath;
+        req.mimeType = mimeType;
+        upload(req);
     }
 
     DownloadRequest makeRequest(const std::string & path)
@@ -34,6 +34,15 @@ protected:
         const std::string & data,
         const std::string & mimeType) override;
 
+    void upsertFileFromLocal(const std::string & path,
+        const Path & localPath,
+        const std::string & mimeType) override;
+
+    Path getTempRoot() override
+    {
+        return binaryCacheDir;
+    }
+
     void getFile(const std::string & path, Sink & sink) override
     {
         try {
@@ -90,6 +99,17 @@ void LocalBinaryCacheStore::upsertFile(const std::string & path,
     atomicWrite(binaryCacheDir + "/" + path, data);
 }
 
+void LocalBinaryCacheStore::upsertFileFromLocal(const std::string & path,
+    const Path & localPath,
+    const std::string & mimeType)
+{
+    /* The file was created in binaryCacheDir (see getTempRoot()), so
+       it can be moved into place atomically. */
+    auto target = binaryCacheDir + "/" + path;
+    if (rename(localPath.c_str(), target.c_str()))
+        throw SysError(format("renaming '%1%' to '%2%'") % localPath % target);
+}
+
 static RegisterStoreImplementation regStore([](
     const std::string & uri, const Store::Params & params)
     -> std::shared_ptr<Store>
@@ -6,10 +6,12 @@
 #include "derivations.hh"
 #include "nar-info.hh"
 #include "references.hh"
+#include "thread-pool.hh"
 
 #include <iostream>
 #include <algorithm>
 #include <cstring>
+#include <thread>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -215,6 +217,8 @@ LocalStore::LocalStore(const Params & params)
 
     else openDB(*state, false);
 
+    initBuildHistory(*state);
+
     /* Prepare SQL statements. */
     state->stmtRegisterValidPath.create(state->db,
         "insert into ValidPaths (path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca) values (?, ?, ?, ?, ?, ?, ?, ?);");
@@ -236,6 +240,25 @@ LocalStore::LocalStore(const Params & params)
         "select v.id, v.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
     state->stmtQueryDerivationOutputs.create(state->db,
         "select id, path from DerivationOutputs where drv = ?;");
+    state->stmtAddBuild.create(state->db,
+        "insert into Builds (drvPath, name, pname, system, startTime, stopTime, success, userTime, systemTime, maxRSS, outputSize) "
+        "values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);");
+    /* Only the last 5 successful builds of a derivation name are
+       used, so forget the builds before those. */
+    state->stmtPruneBuilds.create(state->db,
+        "delete from Builds where name = ?1 and system = ?2 and id < "
+        "(select id from Builds where name = ?1 and system = ?2 and success = 1 order by id desc limit 1 offset 4);");
+    /* Average over the last 5 successful builds to smooth out
+       noise. */
+    state->stmtQueryBuildTime.create(state->db,
+        "select avg(stopTime - startTime), count(*) from (select startTime, stopTime from Builds "
+        "where name = ? and system = ? and success = 1 order by id desc limit 5);");
+    state->stmtQueryBuildTimeByPName.create(state->db,
+        "select avg(stopTime - startTime), count(*) from (select startTime, stopTime from Builds "
+        "where pname = ? and system = ? and success = 1 order by id desc limit 5);");
+    state->stmtQueryBuilds.create(state->db,
+        "select drvPath, name, system, startTime, stopTime, success, userTime, systemTime, maxRSS, outputSize "
+        "from Builds where ?1 = '' or name = ?1 or pname = ?1 order by id desc;");
     // Use "path >= ?" with limit 1 rather than "path like '?%'" to
     // ensure efficient lookup.
     state->stmtQueryPathFromHashPart.create(state->db,
@@ -357,6 +380,53 @@ void LocalStore::openDB(State & state, bool create)
 }
 
 
+/* The build history is not part of the store schema proper: older
+   versions of Nix ignore it, so it's created (or extended with
+   columns added later) when the store is opened, rather than through
+   a schema upgrade that would lock them out of the store. */
+void LocalStore::initBuildHistory(State & state)
+{
+    static const std::vector<std::pair<std::string, std::string>> extraColumns{
+        {"userTime", "integer"},   // in microseconds; null if unknown
+        {"systemTime", "integer"}, // in microseconds; null if unknown
+        {"maxRSS", "integer"},     // in bytes; null if unknown
+        {"outputSize", "integer"}, // total NAR size of the outputs
+    };
+
+    retrySQLite<void>([&]() {
+        SQLiteTxn txn(state.db);
+
+        std::set<std::string> columns;
+        {
+            SQLiteStmt stmt(state.db, "pragma table_info(Builds)");
+            auto use(stmt.use());
+            while (use.next()) columns.insert(use.getStr(1));
+        }
+
+        if (columns.empty()) {
+            state.db.exec(
+                "create table Builds ("
+                "  id integer primary key autoincrement not null,"
+                "  drvPath text not null,"
+                "  name text not null," // derivation name, e.g. "hello-2.10"
+                "  pname text not null," // name without version, e.g. "hello"
+                "  system text not null,"
+                "  startTime integer not null,"
+                "  stopTime integer not null,"
+                "  success integer not null);"
+                "create index if not exists IndexBuildsName on Builds(name, system);"
+                "create index if not exists IndexBuildsPName on Builds(pname, system);");
+        }
+
+        for (auto & [column, type] : extraColumns)
+            if (!columns.count(column))
+                state.db.exec(fmt("alter table Builds add column %s %s", column, type));
+
+        txn.commit();
+    });
+}
+
+
 /* To improve purity, users may want to make the Nix store a read-only
    bind mount.  So make the Nix store writable for this process. */
 void LocalStore::makeStoreWritable()
@@ -379,9 +449,6 @@ void LocalStore::makeStoreWritable()
 }
 
 
-const time_t mtimeStore = 1; /* 1 second into the epoch */
-
-
 static void canonicaliseTimestampAndPermissions(const Path & path, const struct stat & st)
 {
     if (!S_ISLNK(st.st_mode)) {
@@ -869,19 +936,18 @@ void LocalStore::querySubstitutablePathInfos(const PathSet & paths,
     if (!settings.useSubstitutes) return;
     for (auto & sub : getDefaultSubstituters()) {
         if (sub->storeDir != storeDir) continue;
-        for (auto & path : paths) {
-            if (infos.count(path)) continue;
-            debug(format("checking substituter '%s' for path '%s'")
-                % sub->getUri() % path);
+        PathSet remaining;
+        for (auto & path : paths)
+            if (!infos.count(path)) remaining.insert(path);
+        if (remaining.empty()) break;
+        debug(format("checking substituter '%s' for %d paths")
+            % sub->getUri() % remaining.size());
+        /* Errors are handled per path, so that one failing query
+           doesn't prevent substituting the other paths. */
+        std::map<Path, std::exception_ptr> errors;
+        auto handleError = [&](std::exception_ptr exc) {
             try {
-                auto info = sub->queryPathInfo(path);
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-                    std::shared_ptr<const ValidPathInfo>(info));
-                infos[path] = SubstitutablePathInfo{
-                    info->deriver,
-                    info->references,
-                    narInfo ? narInfo->fileSize : 0,
-                    info->narSize};
+                std::rethrow_exception(exc);
             } catch (InvalidPath &) {
             } catch (SubstituterDisabled &) {
             } catch (Error & e) {
@@ -890,7 +956,23 @@ void LocalStore::querySubstitutablePathInfos(const PathSet & paths,
                 else
                     throw;
             }
+        };
+        try {
+            for (auto & i : sub->queryPathInfos(remaining, &errors)) {
+                auto & info = i.second;
+                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
+                    std::shared_ptr<const ValidPathInfo>(info));
+                infos[i.first] = SubstitutablePathInfo{
+                    info->deriver,
+                    info->references,
+                    narInfo ? narInfo->fileSize : 0,
+                    info->narSize};
+            }
+        } catch (...) {
+            handleError(std::current_exception());
         }
+        for (auto & i : errors)
+            handleError(i.second);
     }
 }
 
@@ -1025,7 +1107,7 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
                 return n;
             });
 
-            restorePath(realPath, wrapperSource);
+            restorePath(realPath, wrapperSource, mtimeStore);
 
             auto hashResult = hashSink->finish();
 
@@ -1077,7 +1159,7 @@ Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
 
             if (recursive) {
                 StringSource source(dump);
-                restorePath(realPath, source);
+                restorePath(realPath, source, mtimeStore);
             } else
                 writeFile(realPath, dump);
 
@@ -1238,69 +1320,209 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
         verifyPath(i, store, done, validPaths, repair, errors);
 
     /* Optionally, check the content hashes (slow). */
-    if (checkContents) {
-        printInfo("checking hashes...");
+    if (checkContents && verifyContents(validPaths, repair))
+        errors = true;
 
-        Hash nullHash(htSHA256);
+    return errors;
+}
 
-        for (auto & i : validPaths) {
-            try {
-                auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
 
-                /* Check the content hash (optionally - slow). */
-                printMsg(lvlTalkative, format("checking contents of '%1%'") % i);
+/* Limits the combined rate at which a number of threads read data. */
+struct RateLimiter
+{
+    typedef std::chrono::steady_clock Clock;
 
-                std::unique_ptr<AbstractHashSink> hashSink;
-                if (info->ca == "")
-                    hashSink = std::make_unique<HashSink>(info->narHash.type);
-                else
-                    hashSink = std::make_unique<HashModuloSink>(info->narHash.type, storePathToHash(info->path));
-
-                dumpPath(toRealPath(i), *hashSink);
-                auto current = hashSink->finish();
-
-                if (info->narHash != nullHash && info->narHash != current.first) {
-                    printError(format("path '%1%' was modified! "
-                            "expected hash '%2%', got '%3%'")
-                        % i % info->narHash.to_string() % current.first.to_string());
-                    if (repair) repairPath(i); else errors = true;
-                } else {
-
-                    bool update = false;
-
-                    /* Fill in missing hashes. */
-                    if (info->narHash == nullHash) {
-                        printError(format("fixing missing hash on '%1%'") % i);
-                        info->narHash = current.first;
-                        update = true;
-                    }
-
-                    /* Fill in missing narSize fields (from old stores). */
-                    if (info->narSize == 0) {
-                        printError(format("updating size field on '%1%' to %2%") % i % current.second);
-                        info->narSize = current.second;
-                        update = true;
-                    }
-
-                    if (update) {
-                        auto state(_state.lock());
-                        updatePathInfo(*state, *info);
-                    }
+    uint64_t bytesPerSecond;
 
-                }
+    /* The time at which the next caller may proceed. */
+    Sync<Clock::time_point> next_;
 
-            } catch (Error & e) {
-                /* It's possible that the path got GC'ed, so ignore
-                   errors on invalid paths. */
-                if (isValidPath(i))
-                    printError(format("error: %1%") % e.msg());
-                else
-                    printError(format("warning: %1%") % e.msg());
-                errors = true;
+    RateLimiter(uint64_t bytesPerSecond) : bytesPerSecond(bytesPerSecond) { }
+
+    /* Wait until we're allowed to consume 'bytes' more bytes. */
+    void consume(size_t bytes)
+    {
+        if (!bytesPerSecond) return;
+
+        Clock::time_point wakeup;
+        {
+            auto next(next_.lock());
+            auto now = Clock::now();
+            /* Don't let unused capacity accumulate. */
+            if (*next < now) *next = now;
+            wakeup = *next;
+            *next += std::chrono::nanoseconds(bytes * 1000000000 / bytesPerSecond);
+        }
+
+        std::this_thread::sleep_until(wakeup);
+    }
+};
+
+
+struct RateLimitedSink : Sink
+{
+    Sink & nextSink;
+    RateLimiter & limiter;
+
+    RateLimitedSink(Sink & nextSink, RateLimiter & limiter)
+        : nextSink(nextSink), limiter(limiter) { }
+
+    void operator () (const unsigned char * data, size_t len) override
+    {
+        limiter.consume(len);
+        nextSink(data, len);
+    }
+};
+
+
+/* Check the contents of 'paths' against their NAR hashes, using
+   'verify-jobs' threads and reading at most 'verify-max-rate' bytes
+   per second. Verified paths are appended to a checkpoint file, so
+   that an interrupted run can skip them when it is restarted with
+   'verify-resume'; the checkpoint is removed once all paths have been
+   checked. */
+bool LocalStore::verifyContents(const PathSet & paths, RepairFlag repair)
+{
+    printInfo("checking hashes...");
+
+    Path checkpointFile = stateDir + "/verify-checkpoint";
+
+    /* Read the paths verified by a previous run, if asked to. A path
+       is only skipped if its hash hasn't changed since. Otherwise,
+       start from scratch, since a stale checkpoint could hide paths
+       that have been corrupted in the meantime. */
+    std::map<Path, std::string> verified;
+    if (pathExists(checkpointFile)) {
+        if (settings.verifyResume) {
+            for (auto & line : tokenizeString<Strings>(readFile(checkpointFile), "\n")) {
+                auto fields = tokenizeString<std::vector<std::string>>(line, " ");
+                if (fields.size() == 2) verified[fields[0]] = fields[1];
             }
+            printInfo("resuming from '%s' (%d paths already verified)", checkpointFile, verified.size());
+        } else {
+            printInfo("ignoring the checkpoint of an interrupted check in '%s' (use '--resume' to skip the paths it lists)", checkpointFile);
+            deletePath(checkpointFile);
         }
     }
 
+    AutoCloseFD fdCheckpoint = open(checkpointFile.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (!fdCheckpoint)
+        throw SysError("opening '%s'", checkpointFile);
+    std::mutex checkpointMutex;
+
+    Hash nullHash(htSHA256);
+
+    RateLimiter limiter(settings.verifyMaxRate);
+
+    Activity act(*logger, actVerifyPaths);
+
+    std::atomic<size_t> done{0};
+    std::atomic<size_t> failed{0};
+    std::atomic<size_t> active{0};
+    std::atomic<bool> errors{false};
+    Sync<PathSet> toRepair_;
+
+    auto update = [&]() {
+        act.progress(done, paths.size(), active, failed);
+    };
+
+    auto checkPath = [&](const Path & path) {
+        try {
+            checkInterrupt();
+
+            auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(path)));
+
+            auto i = verified.find(path);
+            if (i != verified.end() && info->narHash != nullHash && i->second == info->narHash.to_string()) {
+                done++;
+                update();
+                return;
+            }
+
+            MaintainCount<std::atomic<size_t>> mcActive(active);
+            update();
+
+            /* Check the content hash (optionally - slow). */
+            printMsg(lvlTalkative, format("checking contents of '%1%'") % path);
+
+            std::unique_ptr<AbstractHashSink> hashSink;
+            if (info->ca == "")
+                hashSink = std::make_unique<HashSink>(info->narHash.type);
+            else
+                hashSink = std::make_unique<HashModuloSink>(info->narHash.type, storePathToHash(info->path));
+
+            RateLimitedSink sink(*hashSink, limiter);
+            dumpPath(toRealPath(path), sink);
+            auto current = hashSink->finish();
+
+            if (info->narHash != nullHash && info->narHash != current.first) {
+                printError(format("path '%1%' was modified! "
+                        "expected hash '%2%', got '%3%'")
+                    % path % info->narHash.to_string() % current.first.to_string());
+                failed++;
+                if (repair) toRepair_.lock()->insert(path); else errors = true;
+            } else {
+
+                bool needUpdate = false;
+
+                /* Fill in missing hashes. */
+                if (info->narHash == nullHash) {
+                    printError(format("fixing missing hash on '%1%'") % path);
+                    info->narHash = current.first;
+                    needUpdate = true;
+                }
+
+                /* Fill in missing narSize fields (from old stores). */
+                if (info->narSize == 0) {
+                    printError(format("updating size field on '%1%' to %2%") % path % current.second);
+                    info->narSize = current.second;
+                    needUpdate = true;
+                }
+
+                if (needUpdate) {
+                    auto state(_state.lock());
+                    updatePathInfo(*state, *info);
+                }
+
+                std::lock_guard<std::mutex> lock(checkpointMutex);
+                writeFull(fdCheckpoint.get(), fmt("%s %s\n", path, info->narHash.to_string()));
+            }
+
+        } catch (Error & e) {
+            /* It's possible that the path got GC'ed, so ignore
+               errors on invalid paths. */
+            if (isValidPath(path))
+                printError(format("error: %1%") % e.msg());
+            else
+                printError(format("warning: %1%") % e.msg());
+            failed++;
+            errors = true;
+        }
+
+        done++;
+        update();
+    };
+
+    ThreadPool pool(settings.verifyJobs);
+
+    for (auto & path : paths)
+        pool.enqueue(std::bind(checkPath, path));
+
+    pool.process();
+
+    /* Repair corrupted paths one at a time, since this runs
+       builds/substitutions. */
+    for (auto & path : *toRepair_.lock())
+        try {
+            repairPath(path);
+        } catch (Error & e) {
+            printError(format("error: %1%") % e.msg());
+            errors = true;
+        }
+
+    fdCheckpoint = -1;
+    deletePath(checkpointFile);
+
     return errors;
 }
 
@@ -1419,6 +1641,101 @@ void LocalStore::vacuumDB()
 }
 
 
+/* Strip the version from a derivation name, i.e. everything from the
+   first dash followed by a non-letter. */
+static std::string getPName(const std::string & name)
+{
+    for (size_t i = 0; i + 1 < name.size(); ++i)
+        if (name[i] == '-' && !isalpha(name[i + 1]))
+            return std::string(name, 0, i);
+    return name;
+}
+
+
+/* The name of a derivation, without the ".drv" suffix. */
+static std::string getDrvName(const Path & drvPath)
+{
+    auto name = storePathToName(drvPath);
+    if (hasSuffix(name, drvExtension))
+        name.resize(name.size() - drvExtension.size());
+    return name;
+}
+
+
+void LocalStore::addBuildRecord(const BuildRecord & record)
+{
+    auto name = getDrvName(record.drvPath);
+
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        SQLiteTxn txn(state->db);
+        state->stmtAddBuild.use()
+            (record.drvPath)
+            (name)
+            (getPName(name))
+            (record.system)
+            (record.startTime)
+            (record.stopTime)
+            (record.success)
+            ((int64_t) (record.userTime.value_or(0) * 1e6), (bool) record.userTime)
+            ((int64_t) (record.systemTime.value_or(0) * 1e6), (bool) record.systemTime)
+            (record.maxRSS.value_or(0), (bool) record.maxRSS)
+            (record.outputSize.value_or(0), (bool) record.outputSize)
+            .exec();
+        if (record.success)
+            state->stmtPruneBuilds.use()(name)(record.system).exec();
+        txn.commit();
+    });
+}
+
+
+std::vector<BuildRecord> LocalStore::queryBuildRecords(const std::string & name)
+{
+    return retrySQLite<std::vector<BuildRecord>>([&]() {
+        auto state(_state.lock());
+
+        std::vector<BuildRecord> records;
+
+        auto query(state->stmtQueryBuilds.use()(name));
+        while (query.next()) {
+            BuildRecord record;
+            record.drvPath = query.getStr(0);
+            record.name = query.getStr(1);
+            record.system = query.getStr(2);
+            record.startTime = query.getInt(3);
+            record.stopTime = query.getInt(4);
+            record.success = query.getInt(5);
+            if (!query.isNull(6)) record.userTime = query.getInt(6) / 1e6;
+            if (!query.isNull(7)) record.systemTime = query.getInt(7) / 1e6;
+            if (!query.isNull(8)) record.maxRSS = query.getInt(8);
+            if (!query.isNull(9)) record.outputSize = query.getInt(9);
+            records.push_back(std::move(record));
+        }
+
+        return records;
+    });
+}
+
+
+std::optional<double> LocalStore::queryExpectedBuildTime(const std::string & drvName,
+    const std::string & system)
+{
+    return retrySQLite<std::optional<double>>([&]() -> std::optional<double> {
+        auto state(_state.lock());
+
+        auto query(state->stmtQueryBuildTime.use()(drvName)(system));
+        if (query.next() && query.getInt(1) > 0)
+            return query.getInt(0);
+
+        auto query2(state->stmtQueryBuildTimeByPName.use()(getPName(drvName))(system));
+        if (query2.next() && query2.getInt(1) > 0)
+            return query2.getInt(0);
+
+        return {};
+    });
+}
+
+
 void LocalStore::addSignatures(const Path & storePath, const StringSet & sigs)
 {
     retrySQLite<void>([&]() {
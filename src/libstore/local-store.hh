@@ -3,6 +3,7 @@
 #include "sqlite.hh"
 
 #include "pathlocks.hh"
+#include "references.hh"
 #include "store-api.hh"
 #include "sync.hh"
 #include "util.hh"
@@ -26,11 +27,32 @@ const int nixSchemaVersion = 10;
 struct Derivation;
 
 
+/* A build of a derivation, as recorded in the build history. */
+struct BuildRecord
+{
+    Path drvPath;
+    std::string name; // derived from 'drvPath' when adding a record
+    std::string system;
+    time_t startTime = 0, stopTime = 0;
+    bool success = false;
+    /* CPU time in seconds and maximum resident set size in bytes of
+       the builder and its descendants. Unknown for remote builds. */
+    std::optional<double> userTime, systemTime;
+    std::optional<uint64_t> maxRSS;
+    /* Total NAR size of the outputs of a successful build. Unknown
+       for all but the last round of a repeated build. */
+    std::optional<uint64_t> outputSize;
+};
+
+
 struct OptimiseStats
 {
     unsigned long filesLinked = 0;
     unsigned long long bytesFreed = 0;
     unsigned long long blocksFreed = 0;
+    /* Non-empty files that could not be linked because the file
+       system ran out of space or links. */
+    unsigned long filesNotLinked = 0;
 };
 
 
@@ -59,6 +81,11 @@ private:
         SQLiteStmt stmtQueryDerivationOutputs;
         SQLiteStmt stmtQueryPathFromHashPart;
         SQLiteStmt stmtQueryValidPaths;
+        SQLiteStmt stmtAddBuild;
+        SQLiteStmt stmtPruneBuilds;
+        SQLiteStmt stmtQueryBuildTime;
+        SQLiteStmt stmtQueryBuildTimeByPName;
+        SQLiteStmt stmtQueryBuilds;
 
         /* The file to which we write our temporary roots. */
         AutoCloseFD fdTempRoots;
@@ -186,6 +213,9 @@ public:
 
     Roots findRoots(bool censor) override;
 
+    /* The time in seconds spent in each phase of root discovery. */
+    typedef std::vector<std::pair<std::string, double>> RootTimings;
+
     void collectGarbage(const GCOptions & options, GCResults & results) override;
 
     /* Optimise the disk space usage of the Nix store by hard-linking
@@ -194,8 +224,9 @@ public:
 
     void optimiseStore() override;
 
-    /* Optimise a single store path. */
-    void optimisePath(const Path & path);
+    /* Optimise a single store path. If 'fileHashes' is given (as
+       computed by scanForReferences()), files are not hashed again. */
+    void optimisePath(const Path & path, const FileHashes * fileHashes = nullptr);
 
     bool verifyStore(bool checkContents, RepairFlag repair) override;
 
@@ -223,12 +254,29 @@ public:
        garbage until it exceeds maxFree. */
     void autoGC(bool sync = true);
 
+    /* Add a build to the build history. */
+    void addBuildRecord(const BuildRecord & record);
+
+    /* Return the expected time in seconds to build a derivation with
+       the given name on the given system, based on the most recent
+       successful builds of derivations with the same name or, if
+       there are none, the same name without version. */
+    std::optional<double> queryExpectedBuildTime(const std::string & drvName,
+        const std::string & system);
+
+    /* Return the builds of derivations with the given name or name
+       without version (or all builds if 'name' is empty), most recent
+       first. */
+    std::vector<BuildRecord> queryBuildRecords(const std::string & name = "");
+
 private:
 
     int getSchema();
 
     void openDB(State & state, bool create);
 
+    void initBuildHistory(State & state);
+
     void makeStoreWritable();
 
     uint64_t queryValidPathId(State & state, const Path & path);
@@ -240,6 +288,8 @@ private:
     /* Delete a path from the Nix store. */
     void invalidatePathChecked(const Path & path);
 
+    bool verifyContents(const PathSet & paths, RepairFlag repair);
+
     void verifyPath(const Path & path, const PathSet & store,
         PathSet & done, PathSet & validPaths, RepairFlag repair, bool & errors);
 
@@ -251,15 +301,28 @@ private:
     ValidPathInfo queryPathInfoOld(const Path & path);
 
     struct GCState;
+    struct GCGraph;
 
     void deleteGarbage(GCState & state, const Path & path);
 
     void tryToDelete(GCState & state, const Path & path);
 
+    PathSet queryGCReferrers(GCState & state, const Path & path);
+
     bool canReachRoot(GCState & state, PathSet & visited, const Path & path);
 
+    bool deleteIfStillDead(GCState & state, PathSet & visited, const Path & path);
+
+    void loadGCGraph(GCState & state, GCGraph & graph);
+
+    vector<std::pair<Path, uint64_t>> findDeadPaths(GCState & state);
+
+    void collectGarbageIncremental(GCState & state, AutoCloseFD & fdGCLock, FDs & fds);
+
     void deletePathRecursive(GCState & state, const Path & path);
 
+    void deleteFromStore(GCState & state, const Path & path, unsigned long long size);
+
     bool isActiveTempFile(const GCState & state,
         const Path & path, const string & suffix);
 
@@ -267,9 +330,9 @@ private:
 
     void findRoots(const Path & path, unsigned char type, Roots & roots);
 
-    void findRootsNoTemp(Roots & roots, bool censor);
+    void findRootsNoTemp(Roots & roots, bool censor, RootTimings * timings = nullptr);
 
-    void findRuntimeRoots(Roots & roots, bool censor);
+    void findRuntimeRoots(Roots & roots, bool censor, RootTimings * timings = nullptr);
 
     void removeUnusedLinks(const GCState & state);
 
@@ -279,9 +342,13 @@ private:
 
     typedef std::unordered_set<ino_t> InodeHash;
 
+    struct OptimiseIndex;
+
     InodeHash loadInodeHash();
-    Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
-    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash);
+    Strings readDirectoryIgnoringInodes(const Path & path, Sync<InodeHash> & inodeHash);
+    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path,
+        Sync<InodeHash> & inodeHash, OptimiseIndex * index = nullptr,
+        uint64_t pathId = 0, const FileHashes * fileHashes = nullptr);
 
     // Internal versions that are not wrapped in retry_sqlite.
     bool isValidPath_(State & state, const Path & path);
@@ -304,6 +371,9 @@ typedef std::pair<dev_t, ino_t> Inode;
 typedef set<Inode> InodesSeen;
 
 
+const time_t mtimeStore = 1; /* 1 second into the epoch */
+
+
 /* "Fix", or canonicalise, the meta-data of the files in a store path
    after it has been built.  In particular:
    - the last modification date on each file is set to 1 (i.e.,
@@ -3,7 +3,6 @@
 #include "globals.hh"
 #include "local-store.hh"
 #include "store-api.hh"
-#include "thread-pool.hh"
 
 
 namespace nix {
@@ -105,137 +104,109 @@ void Store::computeFSClosure(const Path & startPath,
 
 
 void Store::queryMissing(const PathSet & targets,
-    PathSet & willBuild_, PathSet & willSubstitute_, PathSet & unknown_,
-    unsigned long long & downloadSize_, unsigned long long & narSize_)
+    PathSet & willBuild, PathSet & willSubstitute, PathSet & unknown,
+    unsigned long long & downloadSize, unsigned long long & narSize)
 {
     Activity act(*logger, lvlDebug, actUnknown, "querying info about missing paths");
 
-    downloadSize_ = narSize_ = 0;
+    downloadSize = narSize = 0;
 
-    ThreadPool pool;
+    /* We explore the closure breadth-first. In each round, all paths
+       found in the previous round are classified first, and then the
+       substituters are queried for all of them at once, so that a
+       binary cache can answer them with a few bulk requests rather
+       than one request per path. */
+    PathSet done, todo(targets);
 
-    struct State
+    struct PendingDrv
     {
-        PathSet done;
-        PathSet & unknown, & willSubstitute, & willBuild;
-        unsigned long long & downloadSize;
-        unsigned long long & narSize;
-    };
-
-    struct DrvState
-    {
-        size_t left;
-        bool done = false;
+        Path drvPath;
+        Derivation drv;
         PathSet outPaths;
-        DrvState(size_t left) : left(left) { }
     };
 
-    Sync<State> state_(State{PathSet(), unknown_, willSubstitute_, willBuild_, downloadSize_, narSize_});
+    while (!todo.empty()) {
 
-    std::function<void(Path)> doPath;
+        PathSet next, query;
+        std::vector<PendingDrv> pendingDrvs;
+        PathSet pendingPaths;
 
-    auto mustBuildDrv = [&](const Path & drvPath, const Derivation & drv) {
-        {
-            auto state(state_.lock());
-            state->willBuild.insert(drvPath);
-        }
+        auto mustBuildDrv = [&](const Path & drvPath, const Derivation & drv) {
+            willBuild.insert(drvPath);
+            for (auto & i : drv.inputDrvs)
+                next.insert(makeDrvPathWithOutputs(i.first, i.second));
+        };
 
-        for (auto & i : drv.inputDrvs)
-            pool.enqueue(std::bind(doPath, makeDrvPathWithOutputs(i.first, i.second)));
-    };
+        for (auto & path : todo) {
+            if (!done.insert(path).second) continue;
 
-    auto checkOutput = [&](
-        const Path & drvPath, ref<Derivation> drv, const Path & outPath, ref<Sync<DrvState>> drvState_)
-    {
-        if (drvState_->lock()->done) return;
+            DrvPathWithOutputs i2 = parseDrvPathWithOutputs(path);
 
-        SubstitutablePathInfos infos;
-        querySubstitutablePathInfos({outPath}, infos);
-
-        if (infos.empty()) {
-            drvState_->lock()->done = true;
-            mustBuildDrv(drvPath, *drv);
-        } else {
-            {
-                auto drvState(drvState_->lock());
-                if (drvState->done) return;
-                assert(drvState->left);
-                drvState->left--;
-                drvState->outPaths.insert(outPath);
-                if (!drvState->left) {
-                    for (auto & path : drvState->outPaths)
-                        pool.enqueue(std::bind(doPath, path));
+            if (isDerivation(i2.first)) {
+                if (!isValidPath(i2.first)) {
+                    // FIXME: we could try to substitute the derivation.
+                    unknown.insert(path);
+                    continue;
                 }
+
+                Derivation drv = derivationFromPath(i2.first);
+                ParsedDerivation parsedDrv(i2.first, drv);
+
+                PathSet invalid;
+                for (auto & j : drv.outputs)
+                    if (wantOutput(j.first, i2.second)
+                        && !isValidPath(j.second.path))
+                        invalid.insert(j.second.path);
+                if (invalid.empty()) continue;
+
+                if (settings.useSubstitutes && parsedDrv.substitutesAllowed()) {
+                    query.insert(invalid.begin(), invalid.end());
+                    pendingDrvs.push_back({i2.first, std::move(drv), std::move(invalid)});
+                } else
+                    mustBuildDrv(i2.first, drv);
+
+            } else {
+                if (isValidPath(path)) continue;
+                query.insert(path);
+                pendingPaths.insert(path);
             }
         }
-    };
 
-    doPath = [&](const Path & path) {
-
-        {
-            auto state(state_.lock());
-            if (!state->done.insert(path).second) return;
+        SubstitutablePathInfos infos;
+        if (!query.empty())
+            querySubstitutablePathInfos(query, infos);
+
+        /* A derivation only needs to be built if one of its wanted
+           outputs cannot be substituted. Otherwise the outputs are
+           handled like any other path in the next round; their info
+           is in the path info cache by now. */
+        for (auto & pending : pendingDrvs) {
+            bool substitutable = true;
+            for (auto & outPath : pending.outPaths)
+                if (!infos.count(outPath)) substitutable = false;
+            if (substitutable)
+                next.insert(pending.outPaths.begin(), pending.outPaths.end());
+            else
+                mustBuildDrv(pending.drvPath, pending.drv);
         }
 
-        DrvPathWithOutputs i2 = parseDrvPathWithOutputs(path);
-
-        if (isDerivation(i2.first)) {
-            if (!isValidPath(i2.first)) {
-                // FIXME: we could try to substitute the derivation.
-                auto state(state_.lock());
-                state->unknown.insert(path);
-                return;
-            }
-
-            Derivation drv = derivationFromPath(i2.first);
-            ParsedDerivation parsedDrv(i2.first, drv);
-
-            PathSet invalid;
-            for (auto & j : drv.outputs)
-                if (wantOutput(j.first, i2.second)
-                    && !isValidPath(j.second.path))
-                    invalid.insert(j.second.path);
-            if (invalid.empty()) return;
-
-            if (settings.useSubstitutes && parsedDrv.substitutesAllowed()) {
-                auto drvState = make_ref<Sync<DrvState>>(DrvState(invalid.size()));
-                for (auto & output : invalid)
-                    pool.enqueue(std::bind(checkOutput, i2.first, make_ref<Derivation>(drv), output, drvState));
-            } else
-                mustBuildDrv(i2.first, drv);
-
-        } else {
-
-            if (isValidPath(path)) return;
-
-            SubstitutablePathInfos infos;
-            querySubstitutablePathInfos({path}, infos);
-
-            if (infos.empty()) {
-                auto state(state_.lock());
-                state->unknown.insert(path);
-                return;
-            }
-
+        for (auto & path : pendingPaths) {
             auto info = infos.find(path);
-            assert(info != infos.end());
-
-            {
-                auto state(state_.lock());
-                state->willSubstitute.insert(path);
-                state->downloadSize += info->second.downloadSize;
-                state->narSize += info->second.narSize;
+            if (info == infos.end()) {
+                unknown.insert(path);
+                continue;
             }
 
+            willSubstitute.insert(path);
+            downloadSize += info->second.downloadSize;
+            narSize += info->second.narSize;
+
             for (auto & ref : info->second.references)
-                pool.enqueue(std::bind(doPath, ref));
+                next.insert(ref);
         }
-    };
 
-    for (auto & path : targets)
-        pool.enqueue(std::bind(doPath, path));
-
-    pool.process();
+        todo = std::move(next);
+    }
 }
 
 
@@ -3,6 +3,7 @@
 #include <functional>
 
 #include "fs-accessor.hh"
+#include "serialise.hh"
 
 namespace nix {
 
@@ -10,6 +11,11 @@ namespace nix {
    file. */
 ref<FSAccessor> makeNarAccessor(ref<const std::string> nar);
 
+/* Return an object that provides access to the listing of a NAR read
+   from 'source', without keeping its contents in memory. Thus
+   readFile() is not supported. */
+ref<FSAccessor> makeNarAccessor(Source & source);
+
 /* Create a NAR accessor from a NAR listing (in the format produced by
    listNar()). The callback getNarBytes(offset, length) is used by the
    readFile() method of the accessor to get the contents of files
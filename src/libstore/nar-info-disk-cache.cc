@@ -170,50 +170,85 @@ public:
         });
     }
 
-    std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
-        const std::string & uri, const std::string & hashPart) override
+    std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo_(
+        State & state, const Cache & cache, const std::string & hashPart, time_t now)
     {
-        return retrySQLite<std::pair<Outcome, std::shared_ptr<NarInfo>>>(
-            [&]() -> std::pair<Outcome, std::shared_ptr<NarInfo>> {
-            auto state(_state.lock());
+        auto queryNAR(state.queryNAR.use()
+            (cache.id)
+            (hashPart)
+            (now - settings.ttlNegativeNarInfoCache)
+            (now - settings.ttlPositiveNarInfoCache));
+
+        if (!queryNAR.next())
+            return {oUnknown, 0};
+
+        if (!queryNAR.getInt(0))
+            return {oInvalid, 0};
+
+        auto narInfo = make_ref<NarInfo>();
+
+        auto namePart = queryNAR.getStr(1);
+        narInfo->path = cache.storeDir + "/" +
+            hashPart + (namePart.empty() ? "" : "-" + namePart);
+        narInfo->url = queryNAR.getStr(2);
+        narInfo->compression = queryNAR.getStr(3);
+        if (!queryNAR.isNull(4))
+            narInfo->fileHash = Hash(queryNAR.getStr(4));
+        narInfo->fileSize = queryNAR.getInt(5);
+        narInfo->narHash = Hash(queryNAR.getStr(6));
+        narInfo->narSize = queryNAR.getInt(7);
+        for (auto & r : tokenizeString<Strings>(queryNAR.getStr(8), " "))
+            narInfo->references.insert(cache.storeDir + "/" + r);
+        if (!queryNAR.isNull(9))
+            narInfo->deriver = cache.storeDir + "/" + queryNAR.getStr(9);
+        for (auto & sig : tokenizeString<Strings>(queryNAR.getStr(10), " "))
+            narInfo->sigs.insert(sig);
+        narInfo->ca = queryNAR.getStr(11);
+
+        return {oValid, narInfo};
+    }
 
-            auto & cache(getCache(*state, uri));
+    void upsertNarInfo_(
+        State & state, const Cache & cache, const std::string & hashPart,
+        std::shared_ptr<ValidPathInfo> info, time_t now)
+    {
+        if (info) {
 
-            auto now = time(0);
+            auto narInfo = std::dynamic_pointer_cast<NarInfo>(info);
 
-            auto queryNAR(state->queryNAR.use()
+            assert(hashPart == storePathToHash(info->path));
+
+            state.insertNAR.use()
+                (cache.id)
+                (hashPart)
+                (storePathToName(info->path))
+                (narInfo ? narInfo->url : "", narInfo != 0)
+                (narInfo ? narInfo->compression : "", narInfo != 0)
+                (narInfo && narInfo->fileHash ? narInfo->fileHash.to_string() : "", narInfo && narInfo->fileHash)
+                (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
+                (info->narHash.to_string())
+                (info->narSize)
+                (concatStringsSep(" ", info->shortRefs()))
+                (info->deriver != "" ? baseNameOf(info->deriver) : "", info->deriver != "")
+                (concatStringsSep(" ", info->sigs))
+                (info->ca)
+                (now).exec();
+
+        } else {
+            state.insertMissingNAR.use()
                 (cache.id)
                 (hashPart)
-                (now - settings.ttlNegativeNarInfoCache)
-                (now - settings.ttlPositiveNarInfoCache));
-
-            if (!queryNAR.next())
-                return {oUnknown, 0};
-
-            if (!queryNAR.getInt(0))
-                return {oInvalid, 0};
-
-            auto narInfo = make_ref<NarInfo>();
-
-            auto namePart = queryNAR.getStr(1);
-            narInfo->path = cache.storeDir + "/" +
-                hashPart + (namePart.empty() ? "" : "-" + namePart);
-            narInfo->url = queryNAR.getStr(2);
-            narInfo->compression = queryNAR.getStr(3);
-            if (!queryNAR.isNull(4))
-                narInfo->fileHash = Hash(queryNAR.getStr(4));
-            narInfo->fileSize = queryNAR.getInt(5);
-            narInfo->narHash = Hash(queryNAR.getStr(6));
-            narInfo->narSize = queryNAR.getInt(7);
-            for (auto & r : tokenizeString<Strings>(queryNAR.getStr(8), " "))
-                narInfo->references.insert(cache.storeDir + "/" + r);
-            if (!queryNAR.isNull(9))
-                narInfo->deriver = cache.storeDir + "/" + queryNAR.getStr(9);
-            for (auto & sig : tokenizeString<Strings>(queryNAR.getStr(10), " "))
-                narInfo->sigs.insert(sig);
-            narInfo->ca = queryNAR.getStr(11);
-
-            return {oValid, narInfo};
+                (now).exec();
+        }
+    }
+
+    std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
+        const std::string & uri, const std::string & hashPart) override
+    {
+        return retrySQLite<std::pair<Outcome, std::shared_ptr<NarInfo>>>(
+            [&]() -> std::pair<Outcome, std::shared_ptr<NarInfo>> {
+            auto state(_state.lock());
+            return lookupNarInfo_(*state, getCache(*state, uri), hashPart, time(0));
         });
     }
 
@@ -223,37 +258,38 @@ public:
     {
         retrySQLite<void>([&]() {
             auto state(_state.lock());
+            upsertNarInfo_(*state, getCache(*state, uri), hashPart, info, time(0));
+        });
+    }
 
+    std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupNarInfos(
+        const std::string & uri, const StringSet & hashParts) override
+    {
+        typedef std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> Result;
+        return retrySQLite<Result>([&]() {
+            auto state(_state.lock());
             auto & cache(getCache(*state, uri));
+            auto now = time(0);
+            SQLiteTxn txn(state->db);
+            Result res;
+            for (auto & hashPart : hashParts)
+                res.emplace(hashPart, lookupNarInfo_(*state, cache, hashPart, now));
+            txn.commit();
+            return res;
+        });
+    }
 
-            if (info) {
-
-                auto narInfo = std::dynamic_pointer_cast<NarInfo>(info);
-
-                assert(hashPart == storePathToHash(info->path));
-
-                state->insertNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (storePathToName(info->path))
-                    (narInfo ? narInfo->url : "", narInfo != 0)
-                    (narInfo ? narInfo->compression : "", narInfo != 0)
-                    (narInfo && narInfo->fileHash ? narInfo->fileHash.to_string() : "", narInfo && narInfo->fileHash)
-                    (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
-                    (info->narHash.to_string())
-                    (info->narSize)
-                    (concatStringsSep(" ", info->shortRefs()))
-                    (info->deriver != "" ? baseNameOf(info->deriver) : "", info->deriver != "")
-                    (concatStringsSep(" ", info->sigs))
-                    (info->ca)
-                    (time(0)).exec();
-
-            } else {
-                state->insertMissingNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (time(0)).exec();
-            }
+    void upsertNarInfos(const std::string & uri,
+        const std::map<std::string, std::shared_ptr<ValidPathInfo>> & infos) override
+    {
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+            auto & cache(getCache(*state, uri));
+            auto now = time(0);
+            SQLiteTxn txn(state->db);
+            for (auto & i : infos)
+                upsertNarInfo_(*state, cache, i.first, i.second, now);
+            txn.commit();
         });
     }
 };
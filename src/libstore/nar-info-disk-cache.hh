@@ -22,6 +22,13 @@ public:
     virtual void upsertNarInfo(
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<ValidPathInfo> info) = 0;
+
+    /* Bulk versions of the above, using a single transaction. */
+    virtual std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupNarInfos(
+        const std::string & uri, const StringSet & hashParts) = 0;
+
+    virtual void upsertNarInfos(const std::string & uri,
+        const std::map<std::string, std::shared_ptr<ValidPathInfo>> & infos) = 0;
 };
 
 /* Return a singleton cache object that can be used concurrently by
@@ -1,6 +1,7 @@
 #include "util.hh"
 #include "local-store.hh"
 #include "globals.hh"
+#include "thread-pool.hh"
 
 #include <cstdlib>
 #include <cstring>
@@ -10,6 +11,8 @@
 #include <errno.h>
 #include <stdio.h>
 #include <regex>
+#include <mutex>
+#include <atomic>
 
 
 namespace nix {
@@ -41,6 +44,157 @@ struct MakeReadOnly
 };
 
 
+static const char * optimiseIndexSchema = R"sql(
+
+drop table if exists Files;
+
+create table if not exists FileHashes (
+    dev    integer not null,
+    ino    integer not null,
+    pathId integer not null, -- ValidPaths.id of the containing store path
+    size   integer not null,
+    mtime  integer not null,
+    hash   text not null,
+    primary key (dev, ino, pathId)
+);
+
+create table if not exists OptimisedPaths (
+    path  text primary key not null,
+    ino   integer not null,
+    ctime integer not null -- in nanoseconds
+);
+
+)sql";
+
+
+/* The ctime of a file in nanoseconds. Since any change to an inode
+   updates its ctime, this detects inodes that have been reused. */
+static int64_t getCTime(const struct stat & st)
+{
+#if __APPLE__
+    return (int64_t) st.st_ctimespec.tv_sec * 1000000000 + st.st_ctimespec.tv_nsec;
+#else
+    return (int64_t) st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+#endif
+}
+
+
+/* A persistent index used by 'nix-store --optimise' to avoid
+   redoing work done by previous runs. It records the hashes of the
+   files it has hashed, and the store paths that have been optimised
+   completely (keyed on the inode and ctime of the top-level
+   directory, so that a path that has been deleted and rebuilt is
+   optimised again).
+
+   File hashes are keyed on the inode, the size and mtime, and the
+   database ID of the store path containing the file. The ctime can't
+   be used, since linking a file into .links (or any other file to
+   the same inode) changes it. The store path ID is what detects
+   reused inodes instead: an inode can only be reused once all its
+   links are gone, i.e. once the store path has been deleted, and a
+   rebuilt path gets a new ID. The index can be deleted at any
+   time. */
+struct LocalStore::OptimiseIndex
+{
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt queryFile, insertFile, queryPath, insertPath;
+        std::vector<std::tuple<struct stat, uint64_t, Hash>> pendingFiles;
+    };
+
+    Sync<State> _state;
+
+    OptimiseIndex(const Path & dbPath)
+    {
+        auto state(_state.lock());
+
+        state->db = SQLite(dbPath);
+
+        // We can always reproduce the index.
+        state->db.exec("pragma synchronous = off");
+        state->db.exec("pragma main.journal_mode = truncate");
+        state->db.exec("pragma busy_timeout = 60000");
+
+        state->db.exec(optimiseIndexSchema);
+
+        state->queryFile.create(state->db,
+            "select hash from FileHashes where dev = ? and ino = ? and pathId = ? and size = ? and mtime = ?");
+
+        state->insertFile.create(state->db,
+            "insert or replace into FileHashes(dev, ino, pathId, size, mtime, hash) values (?, ?, ?, ?, ?, ?)");
+
+        state->queryPath.create(state->db,
+            "select 1 from OptimisedPaths where path = ? and ino = ? and ctime = ?");
+
+        state->insertPath.create(state->db,
+            "insert or replace into OptimisedPaths(path, ino, ctime) values (?, ?, ?)");
+    }
+
+    ~OptimiseIndex()
+    {
+        try {
+            retrySQLite<void>([&]() {
+                flush(*_state.lock());
+            });
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
+    std::optional<Hash> queryFile(const struct stat & st, uint64_t pathId)
+    {
+        return retrySQLite<std::optional<Hash>>([&]() -> std::optional<Hash> {
+            auto state(_state.lock());
+            auto use(state->queryFile.use()
+                (st.st_dev)(st.st_ino)(pathId)(st.st_size)(st.st_mtime));
+            if (!use.next()) return {};
+            return Hash(use.getStr(0));
+        });
+    }
+
+    /* File hashes are written in batches to reduce the number of
+       transactions. */
+    void insertFile(const struct stat & st, uint64_t pathId, const Hash & hash)
+    {
+        auto state(_state.lock());
+        state->pendingFiles.emplace_back(st, pathId, hash);
+        if (state->pendingFiles.size() >= 1000)
+            retrySQLite<void>([&]() { flush(*state); });
+    }
+
+    bool isOptimised(const Path & path, const struct stat & st)
+    {
+        return retrySQLite<bool>([&]() {
+            auto state(_state.lock());
+            return state->queryPath.use()(path)(st.st_ino)(getCTime(st)).next();
+        });
+    }
+
+    void markOptimised(const Path & path, const struct stat & st)
+    {
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+            flush(*state);
+            state->insertPath.use()(path)(st.st_ino)(getCTime(st)).exec();
+        });
+    }
+
+    void flush(State & state)
+    {
+        if (state.pendingFiles.empty()) return;
+        SQLiteTxn txn(state.db);
+        for (auto & [st, pathId, hash] : state.pendingFiles)
+            state.insertFile.use()
+                (st.st_dev)(st.st_ino)(pathId)(st.st_size)(st.st_mtime)
+                (hash.to_string(Base32, true))
+                .exec();
+        txn.commit();
+        state.pendingFiles.clear();
+    }
+};
+
+
 LocalStore::InodeHash LocalStore::loadInodeHash()
 {
     debug("loading hash inodes in memory");
@@ -63,34 +217,43 @@ LocalStore::InodeHash LocalStore::loadInodeHash()
 }
 
 
-Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash)
+Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, Sync<InodeHash> & inodeHash_)
 {
     Strings names;
 
     AutoCloseDir dir(opendir(path.c_str()));
     if (!dir) throw SysError(format("opening directory '%1%'") % path);
 
+    /* Read the directory without holding the lock on the inode hash,
+       which is shared by all threads. */
+    std::vector<std::pair<ino_t, string>> entries;
+
     struct dirent * dirent;
     while (errno = 0, dirent = readdir(dir.get())) { /* sic */
         checkInterrupt();
+        string name = dirent->d_name;
+        if (name == "." || name == "..") continue;
+        entries.emplace_back(dirent->d_ino, name);
+    }
+    if (errno) throw SysError(format("reading directory '%1%'") % path);
 
-        if (inodeHash.count(dirent->d_ino)) {
-            debug(format("'%1%' is already linked") % dirent->d_name);
+    auto inodeHash(inodeHash_.lock());
+
+    for (auto & [ino, name] : entries) {
+        if (inodeHash->count(ino)) {
+            debug(format("'%1%' is already linked") % name);
             continue;
         }
-
-        string name = dirent->d_name;
-        if (name == "." || name == "..") continue;
         names.push_back(name);
     }
-    if (errno) throw SysError(format("reading directory '%1%'") % path);
 
     return names;
 }
 
 
 void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
-    const Path & path, InodeHash & inodeHash)
+    const Path & path, Sync<InodeHash> & inodeHash, OptimiseIndex * index,
+    uint64_t pathId, const FileHashes * fileHashes)
 {
     checkInterrupt();
 
@@ -114,7 +277,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     if (S_ISDIR(st.st_mode)) {
         Strings names = readDirectoryIgnoringInodes(path, inodeHash);
         for (auto & i : names)
-            optimisePath_(act, stats, path + "/" + i, inodeHash);
+            optimisePath_(act, stats, path + "/" + i, inodeHash, index, pathId, fileHashes);
         return;
     }
 
@@ -135,7 +298,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     }
 
     /* This can still happen on top-level files. */
-    if (st.st_nlink > 1 && inodeHash.count(st.st_ino)) {
+    if (st.st_nlink > 1 && inodeHash.lock()->count(st.st_ino)) {
         debug(format("'%1%' is already linked, with %2% other file(s)") % path % (st.st_nlink - 2));
         return;
     }
@@ -149,24 +312,45 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
        Also note that if `path' is a symlink, then we're hashing the
        contents of the symlink (i.e. the result of readlink()), not
        the contents of the target (which may not even exist). */
-    Hash hash = hashPath(htSHA256, path).first;
+    std::optional<Hash> cached;
+    if (fileHashes) {
+        auto i = fileHashes->find(path);
+        if (i != fileHashes->end()) cached = i->second;
+    }
+    if (index && !cached) cached = index->queryFile(st, pathId);
+    if (!cached) debug("hashing '%s'", path);
+    Hash hash = cached ? *cached : hashPath(htSHA256, path).first;
     debug(format("'%1%' has hash '%2%'") % path % hash.to_string());
 
+    /* Record the hash in the index once we're done with the file,
+       since replacing it gives it another inode. */
+    auto recordHash = [&]() {
+        if (!index || cached) return;
+        struct stat st2;
+        if (lstat(path.c_str(), &st2))
+            throw SysError(format("getting attributes of path '%1%'") % path);
+        index->insertFile(st2, pathId, hash);
+    };
+
     /* Check if this is a known hash. */
     Path linkPath = linksDir + "/" + hash.to_string(Base32, false);
 
  retry:
-    if (!pathExists(linkPath)) {
-        /* Nope, create a hard link in the links directory. */
-        if (link(path.c_str(), linkPath.c_str()) == 0) {
-            inodeHash.insert(st.st_ino);
-            return;
-        }
+    /* Try to create a hard link in the links directory. If that fails
+       because it already exists, we've seen a file with the same
+       contents before. (This is cheaper than checking whether
+       ‘linkPath’ exists first, since .links can be very large.) */
+    if (link(path.c_str(), linkPath.c_str()) == 0) {
+        inodeHash.lock()->insert(st.st_ino);
+        recordHash();
+        return;
+    }
 
+    {
         switch (errno) {
         case EEXIST:
-            /* Fall through if another process created ‘linkPath’ before
-               we did. */
+            /* Fall through: another file with the same contents has
+               been linked before. */
             break;
 
         case ENOSPC:
@@ -175,6 +359,8 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
                just effectively disable deduplication of this
                file.  */
             printInfo("cannot link '%s' to '%s': %s", linkPath, path, strerror(errno));
+            if (st.st_size) stats.filesNotLinked++;
+            recordHash();
             return;
 
         default:
@@ -219,8 +405,11 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
             /* Too many links to the same file (>= 32000 on most file
                systems).  This is likely to happen with empty files.
                Just shrug and ignore. */
-            if (st.st_size)
+            if (st.st_size) {
                 printInfo(format("'%1%' has maximum number of links") % linkPath);
+                stats.filesNotLinked++;
+            }
+            recordHash();
             return;
         }
         throw SysError("cannot link '%1%' to '%2%'", tempLink, linkPath);
@@ -236,11 +425,15 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
                temporarily increases the st_nlink field before
                decreasing it again.) */
             debug("'%s' has reached maximum number of links", linkPath);
+            if (st.st_size) stats.filesNotLinked++;
+            recordHash();
             return;
         }
         throw SysError(format("cannot rename '%1%' to '%2%'") % tempLink % path);
     }
 
+    recordHash();
+
     stats.filesLinked++;
     stats.bytesFreed += st.st_size;
     stats.blocksFreed += st.st_blocks;
@@ -255,22 +448,81 @@ void LocalStore::optimiseStore(OptimiseStats & stats)
     Activity act(*logger, actOptimiseStore);
 
     PathSet paths = queryAllValidPaths();
-    InodeHash inodeHash = loadInodeHash();
+
+    OptimiseIndex index(dbDir + "/optimise-index.sqlite");
+
+    /* Loading the inode hash means reading all of .links, so only
+       do this if some path actually needs to be optimised. */
+    std::once_flag inodeHashLoaded;
+    Sync<InodeHash> inodeHash;
 
     act.progress(0, paths.size());
 
-    uint64_t done = 0;
+    std::atomic<uint64_t> done{0}, skipped{0};
+    Sync<OptimiseStats> totals;
+
+    auto doPath = [&](const Path & path) {
+        checkInterrupt();
 
-    for (auto & i : paths) {
-        addTempRoot(i);
-        if (!isValidPath(i)) continue; /* path was GC'ed, probably */
-        {
-            Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", i));
-            optimisePath_(&act, stats, realStoreDir + "/" + baseNameOf(i), inodeHash);
+        addTempRoot(path);
+        if (isValidPath(path)) { /* otherwise path was GC'ed, probably */
+
+            Path realPath = realStoreDir + "/" + baseNameOf(path);
+
+            struct stat st;
+            if (lstat(realPath.c_str(), &st))
+                throw SysError(format("getting attributes of path '%1%'") % realPath);
+
+            if (index.isOptimised(path, st))
+                skipped++;
+            else {
+                std::call_once(inodeHashLoaded, [&]() { *inodeHash.lock() = loadInodeHash(); });
+
+                auto pathId = retrySQLite<uint64_t>([&]() {
+                    return queryValidPathId(*_state.lock(), path);
+                });
+
+                OptimiseStats pathStats;
+                {
+                    Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", path));
+                    optimisePath_(&act, pathStats, realPath, inodeHash, &index, pathId);
+                }
+
+                /* Optimising may have changed the ctime of the
+                   top-level directory. Paths with files that could
+                   not be linked are tried again next time. (Empty
+                   files don't count, since linking them frees no
+                   space, and they often reach the maximum number of
+                   links.) */
+                if (lstat(realPath.c_str(), &st))
+                    throw SysError(format("getting attributes of path '%1%'") % realPath);
+                if (!pathStats.filesNotLinked)
+                    index.markOptimised(path, st);
+
+                auto totals_(totals.lock());
+                totals_->filesLinked += pathStats.filesLinked;
+                totals_->bytesFreed += pathStats.bytesFreed;
+                totals_->blocksFreed += pathStats.blocksFreed;
+            }
         }
+
         done++;
         act.progress(done, paths.size());
-    }
+    };
+
+    ThreadPool pool;
+
+    for (auto & path : paths)
+        pool.enqueue(std::bind(doPath, path));
+
+    pool.process();
+
+    auto totals_(totals.lock());
+    stats.filesLinked += totals_->filesLinked;
+    stats.bytesFreed += totals_->bytesFreed;
+    stats.blocksFreed += totals_->blocksFreed;
+
+    printMsg(lvlTalkative, format("skipped %1% paths that were already optimised") % skipped);
 }
 
 static string showBytes(unsigned long long bytes)
@@ -290,12 +542,21 @@ void LocalStore::optimiseStore()
         % stats.filesLinked);
 }
 
-void LocalStore::optimisePath(const Path & path)
+void LocalStore::optimisePath(const Path & path, const FileHashes * fileHashes)
 {
     OptimiseStats stats;
-    InodeHash inodeHash;
+    Sync<InodeHash> inodeHash;
+
+    if (!settings.autoOptimiseStore) return;
+
+    /* 'fileHashes' is relative to 'path', but optimisePath_() works
+       on absolute paths. */
+    FileHashes absHashes;
+    if (fileHashes)
+        for (auto & i : *fileHashes)
+            absHashes.emplace(path + i.first, i.second);
 
-    if (settings.autoOptimiseStore) optimisePath_(nullptr, stats, path, inodeHash);
+    optimisePath_(nullptr, stats, path, inodeHash, nullptr, 0, fileHashes ? &absHashes : nullptr);
 }
 
 
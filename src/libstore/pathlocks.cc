@@ -4,12 +4,17 @@
 
 #include <cerrno>
 #include <cstdlib>
+#include <cstring>
 
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
 
+#if __linux__
+#include <sys/inotify.h>
+#endif
+
 
 namespace nix {
 
@@ -82,7 +87,7 @@ PathLocks::PathLocks(const PathSet & paths, const string & waitMsg)
 
 
 bool PathLocks::lockPaths(const PathSet & paths,
-    const string & waitMsg, bool wait)
+    const string & waitMsg, bool wait, Path * blocked)
 {
     assert(fds.empty());
 
@@ -114,6 +119,7 @@ bool PathLocks::lockPaths(const PathSet & paths,
                     /* Failed to lock this path; release all other
                        locks. */
                     unlock();
+                    if (blocked) *blocked = lockPath;
                     return false;
                 }
             }
@@ -175,4 +181,174 @@ void PathLocks::setDeletion(bool deletePaths)
 }
 
 
+#if __linux__
+
+LockMonitor::LockMonitor()
+    : inotifyFd(inotify_init1(IN_CLOEXEC | IN_NONBLOCK))
+{
+    if (!inotifyFd)
+        printError("warning: cannot create inotify instance (%s); polling for locks instead", strerror(errno));
+
+    /* The initial PID namespace has a fixed inode number
+       (PROC_PID_INIT_INO). */
+    try {
+        allLocksVisible = readLink("/proc/self/ns/pid") == "pid:[4026531836]";
+    } catch (SysError &) {
+    }
+}
+
+
+LockMonitor::LockState LockMonitor::getState(int fd)
+{
+    /* Look for a flock() lock on the lock file's inode in
+       /proc/locks. Taking the lock to see whether it's free would make
+       concurrent non-blocking lockPaths() calls fail. (F_OFD_GETLK
+       doesn't see flock() locks.) */
+    struct stat st;
+    if (fstat(fd, &st) == -1) return lsUnknown;
+
+    std::string locks;
+    try {
+        locks = readFile("/proc/locks", true);
+    } catch (SysError &) {
+        return lsUnknown;
+    }
+
+    /* Lines look like "1: FLOCK  ADVISORY  WRITE 1234 08:01:5678 0 EOF".
+       Blocked waiters are listed as "1: -> FLOCK ..."; skip them.
+       Only the inode number is compared, since the device number
+       needn't match st_dev (e.g. on btrfs). A false match only means
+       that we fall back to polling. */
+    size_t pos = 0;
+    while (pos < locks.size()) {
+        auto eol = locks.find('\n', pos);
+        if (eol == std::string::npos) eol = locks.size();
+        auto fields = tokenizeString<std::vector<std::string>>(
+            std::string(locks, pos, eol - pos));
+        pos = eol + 1;
+
+        unsigned int maj, min;
+        unsigned long ino;
+        if (fields.size() >= 6
+            && fields[1] == "FLOCK"
+            && sscanf(fields[5].c_str(), "%x:%x:%lu", &maj, &min, &ino) == 3
+            && ino == st.st_ino)
+            return lsHeld;
+    }
+
+    return allLocksVisible ? lsReleased : lsUnknown;
+}
+
+
+LockMonitor::LockState LockMonitor::watch(const Path & lockPath)
+{
+    assert(inotifyFd);
+
+    if (watchesByPath.count(lockPath)) return lsHeld;
+
+    /* Opening the lock file read-only means that closing it doesn't
+       trigger an IN_CLOSE_WRITE event for the other watchers. */
+    AutoCloseFD fd = open(lockPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) {
+        if (errno == ENOENT) return lsReleased;
+        throw SysError("opening lock file '%s'", lockPath);
+    }
+
+    int wd = inotify_add_watch(inotifyFd.get(), lockPath.c_str(), IN_CLOSE_WRITE | IN_DELETE_SELF);
+    if (wd == -1) {
+        if (errno == ENOENT) return lsReleased;
+        throw SysError("watching lock file '%s'", lockPath);
+    }
+
+    /* The lock may have been released before we started watching
+       it. */
+    auto state = getState(fd.get());
+    if (state != lsHeld) {
+        inotify_rm_watch(inotifyFd.get(), wd);
+        return state;
+    }
+
+    watches[wd] = Watch{lockPath, std::move(fd)};
+    watchesByPath[lockPath] = wd;
+
+    return lsHeld;
+}
+
+
+void LockMonitor::unwatch(int wd)
+{
+    auto i = watches.find(wd);
+    if (i == watches.end()) return;
+    watchesByPath.erase(i->second.lockPath);
+    watches.erase(i);
+    inotify_rm_watch(inotifyFd.get(), wd);
+}
+
+
+void LockMonitor::unwatch(const Path & lockPath)
+{
+    auto i = watchesByPath.find(lockPath);
+    if (i != watchesByPath.end()) unwatch(i->second);
+}
+
+
+PathSet LockMonitor::released()
+{
+    std::set<int> triggered;
+
+    alignas(struct inotify_event) char buf[4096];
+    while (true) {
+        auto n = read(inotifyFd.get(), buf, sizeof(buf));
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            throw SysError("reading inotify events");
+        }
+        for (char * p = buf; p < buf + n; ) {
+            auto event = (struct inotify_event *) p;
+            triggered.insert(event->wd);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    PathSet res;
+
+    for (auto wd : triggered) {
+        auto i = watches.find(wd);
+        if (i == watches.end()) continue;
+        if (getState(i->second.fd.get()) == lsHeld) continue;
+        debug("lock on '%s' has been released", i->second.lockPath);
+        res.insert(i->second.lockPath);
+        unwatch(wd);
+    }
+
+    return res;
+}
+
+#else
+
+LockMonitor::LockMonitor()
+{
+}
+
+
+LockMonitor::LockState LockMonitor::watch(const Path & lockPath)
+{
+    abort();
+}
+
+
+void LockMonitor::unwatch(const Path & lockPath)
+{
+}
+
+
+PathSet LockMonitor::released()
+{
+    return {};
+}
+
+#endif
+
+
 }
@@ -27,12 +27,83 @@ public:
     PathLocks();
     PathLocks(const PathSet & paths,
         const string & waitMsg = "");
+    /* If 'wait' is false and some lock is held by someone else,
+       return false and set '*blocked' (if not null) to the path of
+       that lock file. */
     bool lockPaths(const PathSet & _paths,
         const string & waitMsg = "",
-        bool wait = true);
+        bool wait = true,
+        Path * blocked = nullptr);
     ~PathLocks();
     void unlock();
     void setDeletion(bool deletePaths);
 };
 
+
+/* Reports when locks held by other processes may have been released,
+   so that waiting for a lock doesn't require polling. On Linux this
+   uses inotify: a lock is released when the last descriptor of its
+   lock file is closed, which triggers an IN_CLOSE_WRITE event. Since
+   other processes close lock files without having held the lock, a
+   watcher only reports a lock as released if /proc/locks no longer
+   lists a lock on the file. It doesn't take the lock itself, since
+   that could make other processes' attempts to take it fail.
+   /proc/locks only lists the locks of processes in our PID namespace,
+   so outside the initial PID namespace, a lock that isn't listed may
+   still be held. Callers must then poll, and should poll occasionally
+   as a fallback anyway. Not supported on other platforms. */
+class LockMonitor
+{
+public:
+
+    enum LockState {
+        lsHeld,
+        lsReleased,
+        /* We can't tell whether the lock is held. */
+        lsUnknown,
+    };
+
+private:
+    AutoCloseFD inotifyFd;
+
+    /* Whether /proc/locks shows the locks of all processes. */
+    bool allLocksVisible = false;
+
+    struct Watch
+    {
+        Path lockPath;
+        AutoCloseFD fd;
+    };
+
+    std::map<int, Watch> watches;
+    std::map<Path, int> watchesByPath;
+
+    LockState getState(int fd);
+
+    void unwatch(int wd);
+
+public:
+
+    LockMonitor();
+
+    /* A file descriptor that becomes readable when a watched lock
+       may have been released, or -1 if this is not supported. */
+    int getFd() { return inotifyFd.get(); }
+
+    /* Start watching the lock file 'lockPath'. Returns lsHeld if it's
+       now being watched. Otherwise it's not watched, and the result is
+       lsReleased if the lock has been released already (or the lock
+       file is gone), or lsUnknown if we can't tell, in which case the
+       caller should poll. */
+    LockState watch(const Path & lockPath);
+
+    /* Stop watching the lock file 'lockPath'. */
+    void unwatch(const Path & lockPath);
+
+    /* Return the lock files that have been released (or may have
+       been, if we can't tell) since the last call. These are no longer
+       watched. */
+    PathSet released();
+};
+
 }
@@ -4,86 +4,189 @@
 #include "archive.hh"
 
 #include <map>
+#include <mutex>
 #include <cstdlib>
+#include <cstring>
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 namespace nix {
 
 
-static unsigned int refLength = 32; /* characters */
+static const size_t refLength = 32; /* characters */
 
 
-static void search(const unsigned char * s, size_t len,
-    StringSet & hashes, StringSet & seen)
+/* Return a mask with bit i set if s[i] is a base-32 character, for
+   the 64 bytes starting at 's'. */
+static inline uint64_t base32Mask(const unsigned char * s)
 {
-    static bool initialised = false;
-    static bool isBase32[256];
-    if (!initialised) {
-        for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
-        for (unsigned int i = 0; i < base32Chars.size(); ++i)
-            isBase32[(unsigned char) base32Chars[i]] = true;
-        initialised = true;
+#if __SSE2__
+    /* Base-32 characters are the digits and the lowercase letters
+       except 'e', 'o', 't' and 'u' (see base32Chars). The signed
+       comparisons are fine since bytes >= 0x80 are negative and
+       thus never in range. */
+    uint64_t mask = 0;
+    for (int n = 0; n < 4; ++n) {
+        __m128i c = _mm_loadu_si128((const __m128i *) (s + 16 * n));
+        __m128i digit = _mm_and_si128(
+            _mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+            _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+        __m128i letter = _mm_and_si128(
+            _mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)),
+            _mm_cmplt_epi8(c, _mm_set1_epi8('z' + 1)));
+        __m128i omitted = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('e')), _mm_cmpeq_epi8(c, _mm_set1_epi8('o'))),
+            _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('t')), _mm_cmpeq_epi8(c, _mm_set1_epi8('u'))));
+        __m128i isBase32 = _mm_or_si128(digit, _mm_andnot_si128(omitted, letter));
+        mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(isBase32) << (16 * n);
     }
+    return mask;
+#else
+    static bool isBase32[256] = {};
+    static std::once_flag initialised;
+    std::call_once(initialised, []() {
+        for (auto c : base32Chars) isBase32[(unsigned char) c] = true;
+    });
+
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; ++i)
+        mask |= (uint64_t) isBase32[s[i]] << i;
+    return mask;
+#endif
+}
 
-    for (size_t i = 0; i + refLength <= len; ) {
-        int j;
-        bool match = true;
-        for (j = refLength - 1; j >= 0; --j)
-            if (!isBase32[(unsigned char) s[i + j]]) {
-                i += j + 1;
-                match = false;
-                break;
-            }
-        if (!match) continue;
-        string ref((const char *) s + i, refLength);
-        if (hashes.erase(ref)) {
-            debug(format("found reference to '%1%' at offset '%2%'")
-                  % ref % i);
-            seen.insert(ref);
-        }
-        ++i;
+
+RefScanSink::RefScanSink(const StringSet & hashes)
+{
+    size_t size = 16;
+    while (size < hashes.size() * 2) size *= 2;
+    table.resize(size);
+    tableMask = size - 1;
+
+    for (auto & hash : hashes) {
+        assert(hash.size() == refLength);
+        auto i = slot(hash.data());
+        while (table[i].state != Entry::Empty) i = (i + 1) & tableMask;
+        memcpy(table[i].key, hash.data(), refLength);
+        table[i].state = Entry::Unseen;
     }
+
+    nrUnseen = hashes.size();
 }
 
 
-struct RefScanSink : Sink
+size_t RefScanSink::slot(const char * key) const
 {
-    HashSink hashSink;
-    StringSet hashes;
-    StringSet seen;
+    /* The keys are hashes already, so the first few characters
+       are good enough. */
+    uint64_t n;
+    memcpy(&n, key, sizeof(n));
+    return (size_t) ((n * 0x9e3779b97f4a7c15ULL) >> 32) & tableMask;
+}
+
+
+void RefScanSink::check(const unsigned char * s, uint64_t offset)
+{
+    for (auto i = slot((const char *) s); table[i].state != Entry::Empty; i = (i + 1) & tableMask)
+        if (memcmp(table[i].key, s, refLength) == 0) {
+            if (table[i].state == Entry::Unseen) {
+                debug("found reference to '%s' at offset '%d'",
+                    std::string(table[i].key, refLength), offset);
+                table[i].state = Entry::Seen;
+                nrUnseen--;
+            }
+            return;
+        }
+}
 
-    string tail;
 
-    RefScanSink() : hashSink(htSHA256) { }
+void RefScanSink::search(const unsigned char * s, size_t len, uint64_t offset)
+{
+    if (len < refLength) return;
+
+    size_t nrBlocks = (len + 63) / 64;
+
+    /* The last block may be partial. Pad it with bytes that aren't
+       base-32 characters so that no hash can extend past 'len'. */
+    auto blockMask = [&](size_t b) {
+        if (b * 64 + 64 <= len) return base32Mask(s + b * 64);
+        unsigned char buf[64];
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, s + b * 64, len - b * 64);
+        return base32Mask(buf);
+    };
+
+    uint64_t next = blockMask(0);
+
+    for (size_t b = 0; b < nrBlocks; ++b) {
+        /* Bit i of 'lo' (block b) and 'hi' (block b + 1) says whether
+           the byte at that position is a base-32 character. Narrow
+           this down to the positions that start a run of at least
+           'refLength' of them, i.e. the only places where a hash
+           can start. */
+        uint64_t lo = next, hi = next = b + 1 < nrBlocks ? blockMask(b + 1) : 0;
+        for (size_t k = 1; k < refLength; k *= 2) {
+            lo &= (lo >> k) | (hi << (64 - k));
+            hi &= hi >> k;
+        }
 
-    void operator () (const unsigned char * data, size_t len);
-};
+        for (; lo; lo &= lo - 1) {
+            size_t i = b * 64 + __builtin_ctzll(lo);
+            check(s + i, offset + i);
+        }
+    }
+}
 
 
 void RefScanSink::operator () (const unsigned char * data, size_t len)
 {
-    hashSink(data, len);
+    if (!nrUnseen) return;
 
     /* It's possible that a reference spans the previous and current
        fragment, so search in the concatenation of the tail of the
        previous fragment and the start of the current fragment. */
-    string s = tail + string((const char *) data, len > refLength ? refLength : len);
-    search((const unsigned char *) s.data(), s.size(), hashes, seen);
+    if (tailLen) {
+        unsigned char buf[2 * (refLength - 1)];
+        size_t n = std::min(len, refLength - 1);
+        memcpy(buf, tail, tailLen);
+        memcpy(buf + tailLen, data, n);
+        search(buf, tailLen + n, pos - tailLen);
+    }
 
-    search(data, len, hashes, seen);
+    search(data, len, pos);
 
-    size_t tailLen = len <= refLength ? len : refLength;
-    tail =
-        string(tail, tail.size() < refLength - tailLen ? 0 : tail.size() - (refLength - tailLen)) +
-        string((const char *) data + len - tailLen, tailLen);
+    pos += len;
+
+    if (len >= refLength - 1) {
+        memcpy(tail, data + len - (refLength - 1), refLength - 1);
+        tailLen = refLength - 1;
+    } else {
+        size_t keep = std::min(tailLen, refLength - 1 - len);
+        memmove(tail, tail + tailLen - keep, keep);
+        memcpy(tail + keep, data, len);
+        tailLen = keep + len;
+    }
+}
+
+
+StringSet RefScanSink::getFound() const
+{
+    StringSet found;
+    for (auto & entry : table)
+        if (entry.state == Entry::Seen)
+            found.insert(std::string(entry.key, refLength));
+    return found;
 }
 
 
 PathSet scanForReferences(const string & path,
-    const PathSet & refs, HashResult & hash)
+    const PathSet & refs, HashResult & hash, FileHashes * fileHashes)
 {
-    RefScanSink sink;
     std::map<string, Path> backMap;
+    StringSet hashes;
 
     /* For efficiency (and a higher hit rate), just search for the
        hash part of the file name.  (This assumes that all references
@@ -97,22 +200,34 @@ PathSet scanForReferences(const string & path,
         assert(s.size() == refLength);
         assert(backMap.find(s) == backMap.end());
         // parseHash(htSHA256, s);
-        sink.hashes.insert(s);
+        hashes.insert(s);
         backMap[s] = i;
     }
 
+    HashSink hashSink(htSHA256);
+    RefScanSink refSink(hashes);
+    LambdaSink sink([&](const unsigned char * data, size_t len) {
+        hashSink(data, len);
+        refSink(data, len);
+    });
+
     /* Look for the hashes in the NAR dump of the path. */
-    dumpPath(path, sink);
+    if (fileHashes)
+        dumpPath(path, sink, defaultPathFilter, [&](const Path & file, const Hash & h) {
+            (*fileHashes)[string(file, path.size())] = h;
+        });
+    else
+        dumpPath(path, sink);
 
     /* Map the hashes found back to their store paths. */
     PathSet found;
-    for (auto & i : sink.seen) {
+    for (auto & i : refSink.getFound()) {
         std::map<string, Path>::iterator j;
         if ((j = backMap.find(i)) == backMap.end()) abort();
         found.insert(j->second);
     }
 
-    hash = sink.hashSink.finish();
+    hash = hashSink.finish();
 
     return found;
 }
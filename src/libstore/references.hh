@@ -5,8 +5,58 @@
 
 namespace nix {
 
+/* The SHA-256 NAR hashes of the regular files and symlinks in a path,
+   indexed by their path relative to it ("" for the path itself). */
+typedef std::map<Path, Hash> FileHashes;
+
+/* Return those paths in 'refs' whose hash part occurs in the NAR
+   serialisation of 'path', and set 'hash' to the hash and size of
+   that serialisation. If 'fileHashes' is not null, it is filled in
+   during the same pass, so that the store optimiser doesn't have to
+   read 'path' again. */
 PathSet scanForReferences(const Path & path, const PathSet & refs,
-    HashResult & hash);
+    HashResult & hash, FileHashes * fileHashes = nullptr);
+
+/* A sink that searches the data written to it for a set of
+   32-character hashes, such as the hash parts of store paths. Runs of
+   base-32 characters are located a block of 64 bytes at a time (using
+   SSE2 where available), and only positions that start a long enough
+   run are looked up in an open-addressing table of the hashes, so
+   nothing is allocated while scanning. */
+struct RefScanSink : Sink
+{
+    RefScanSink(const StringSet & hashes);
+
+    void operator () (const unsigned char * data, size_t len) override;
+
+    /* Return the hashes that occurred in the data. */
+    StringSet getFound() const;
+
+private:
+
+    struct Entry
+    {
+        enum { Empty, Unseen, Seen } state = Empty;
+        char key[32];
+    };
+
+    std::vector<Entry> table;
+    size_t tableMask;
+    size_t nrUnseen;
+
+    /* The last bytes of the data seen so far, to find hashes that
+       span two writes. */
+    unsigned char tail[31];
+    size_t tailLen = 0;
+
+    uint64_t pos = 0;
+
+    size_t slot(const char * key) const;
+
+    void check(const unsigned char * s, uint64_t offset);
+
+    void search(const unsigned char * s, size_t len, uint64_t offset);
+};
 
 struct RewritingSink : Sink
 {
@@ -25,6 +25,8 @@
 #include <aws/s3/model/PutObjectRequest.h>
 #include <aws/transfer/TransferManager.h>
 
+#include <fstream>
+
 using namespace Aws::Transfer;
 
 namespace nix {
@@ -261,8 +263,15 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
         const std::string & mimeType,
         const std::string & contentEncoding)
     {
-        auto stream = std::make_shared<istringstream_nocopy>(data);
+        uploadFile(path, std::make_shared<istringstream_nocopy>(data), data.size(),
+            mimeType, contentEncoding);
+    }
 
+    void uploadFile(const std::string & path,
+        std::shared_ptr<std::basic_iostream<char>> stream, uint64_t size,
+        const std::string & mimeType,
+        const std::string & contentEncoding)
+    {
         auto maxThreads = std::thread::hardware_concurrency();
 
         static std::shared_ptr<Aws::Utils::Threading::PooledThreadExecutor>
@@ -328,8 +337,6 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
             if (contentEncoding != "")
                 request.SetContentEncoding(contentEncoding);
 
-            auto stream = std::make_shared<istringstream_nocopy>(data);
-
             request.SetBody(stream);
 
             auto result = checkAws(fmt("AWS error uploading '%s'", path),
@@ -343,10 +350,10 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
                 .count();
 
         printInfo(format("uploaded 's3://%1%/%2%' (%3% bytes) in %4% ms") %
-                  bucketName % path % data.size() % duration);
+                  bucketName % path % size % duration);
 
         stats.putTimeMs += duration;
-        stats.putBytes += data.size();
+        stats.putBytes += size;
         stats.put++;
     }
 
@@ -363,6 +370,19 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
             uploadFile(path, data, mimeType, "");
     }
 
+    void upsertFileFromLocal(const std::string & path, const Path & localPath,
+        const std::string & mimeType) override
+    {
+        /* Stream the file rather than reading it into memory. With
+           'multipart-upload', the transfer manager uploads it in parts
+           of 'buffer-size' bytes. */
+        auto stream = std::make_shared<std::fstream>(localPath, std::ios_base::in | std::ios_base::binary);
+        if (!*stream) throw SysError("opening '%s'", localPath);
+        uint64_t size = stream->seekg(0, std::ios_base::end).tellg();
+        stream->seekg(0, std::ios_base::beg);
+        uploadFile(path, stream, size, mimeType, "");
+    }
+
     void getFile(const std::string & path, Sink & sink) override
     {
         stats.get++;
@@ -402,6 +402,123 @@ void Store::queryPathInfo(const Path & storePath,
 }
 
 
+std::map<Path, ref<const ValidPathInfo>> Store::queryPathInfos(const PathSet & paths,
+    std::map<Path, std::exception_ptr> * errors)
+{
+    std::map<Path, ref<const ValidPathInfo>> res;
+
+    /* Paths that are not in the in-memory cache, by hash part. */
+    std::map<std::string, Path> uncached;
+
+    auto isMatch = [](const Path & storePath, const std::shared_ptr<const ValidPathInfo> & info) {
+        return info && (info->path == storePath || storePathToName(storePath) == "");
+    };
+
+    {
+        auto state_(state.lock());
+        for (auto & storePath : paths) {
+            assertStorePath(storePath);
+            auto hashPart = storePathToHash(storePath);
+            auto info = state_->pathInfoCache.get(hashPart);
+            if (info) {
+                stats.narInfoReadAverted++;
+                if (isMatch(storePath, *info))
+                    res.emplace(storePath, ref<const ValidPathInfo>(*info));
+            } else
+                uncached.emplace(hashPart, storePath);
+        }
+    }
+
+    if (diskCache && !uncached.empty()) {
+        StringSet hashParts;
+        for (auto & i : uncached) hashParts.insert(i.first);
+
+        auto cached = diskCache->lookupNarInfos(getUri(), hashParts);
+
+        auto state_(state.lock());
+        for (auto & i : cached) {
+            if (i.second.first == NarInfoDiskCache::oUnknown) continue;
+            stats.narInfoReadAverted++;
+            state_->pathInfoCache.upsert(i.first,
+                i.second.first == NarInfoDiskCache::oInvalid ? 0 : i.second.second);
+            auto & storePath = uncached[i.first];
+            if (i.second.first == NarInfoDiskCache::oValid && isMatch(storePath, i.second.second))
+                res.emplace(storePath, ref<const ValidPathInfo>(i.second.second));
+            uncached.erase(i.first);
+        }
+    }
+
+    if (uncached.empty()) return res;
+
+    PathSet missing;
+    for (auto & i : uncached) missing.insert(i.second);
+
+    std::map<Path, std::exception_ptr> errors2;
+    auto fetched = queryPathInfosUncached(missing, errors2);
+
+    if (!errors2.empty()) {
+        if (!errors) std::rethrow_exception(errors2.begin()->second);
+        errors->insert(errors2.begin(), errors2.end());
+    }
+
+    if (diskCache) {
+        std::map<std::string, std::shared_ptr<ValidPathInfo>> infos;
+        for (auto & i : fetched)
+            infos.emplace(storePathToHash(i.first), i.second);
+        diskCache->upsertNarInfos(getUri(), infos);
+    }
+
+    auto state_(state.lock());
+    for (auto & i : fetched) {
+        state_->pathInfoCache.upsert(storePathToHash(i.first), i.second);
+        if (isMatch(i.first, i.second))
+            res.emplace(i.first, ref<const ValidPathInfo>(i.second));
+        else
+            stats.narInfoMissing++;
+    }
+
+    return res;
+}
+
+
+std::map<Path, std::shared_ptr<ValidPathInfo>> Store::queryPathInfosUncached(const PathSet & paths,
+    std::map<Path, std::exception_ptr> & errors)
+{
+    struct State
+    {
+        size_t left;
+        std::map<Path, std::shared_ptr<ValidPathInfo>> infos;
+        std::map<Path, std::exception_ptr> errors;
+    };
+
+    Sync<State> state_(State{paths.size()});
+
+    std::condition_variable wakeup;
+
+    for (auto & path : paths)
+        queryPathInfoUncached(path,
+            {[path, &state_, &wakeup](std::future<std::shared_ptr<ValidPathInfo>> fut) {
+                auto state(state_.lock());
+                try {
+                    state->infos[path] = fut.get();
+                } catch (...) {
+                    state->errors[path] = std::current_exception();
+                }
+                assert(state->left);
+                if (!--state->left)
+                    wakeup.notify_one();
+            }});
+
+    auto state(state_.lock());
+    while (state->left)
+        state.wait(wakeup);
+
+    errors.insert(state->errors.begin(), state->errors.end());
+
+    return std::move(state->infos);
+}
+
+
 PathSet Store::queryValidPaths(const PathSet & paths, SubstituteFlag maybeSubstitute)
 {
     struct State
@@ -629,18 +746,50 @@ void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
         info = info2;
     }
 
-    auto source = sinkToSource([&](Sink & sink) {
+    /* Fetch (i.e. download and decompress) the NAR in a separate
+       thread, so that this can overlap with unpacking it into the
+       destination store. */
+    std::atomic<ThreadSource *> sourcePtr{nullptr};
+
+    auto lastReport = std::chrono::steady_clock::now();
+
+    /* Report how fast each stage would go if it didn't have to wait
+       for the other one. */
+    auto reportThroughput = [&]() {
+        auto source = sourcePtr.load();
+        if (!source) return;
+        auto stats = source->getStats();
+        auto rate = [&](double waited) {
+            return stats.elapsed > waited ? (uint64_t) (stats.bytes / (stats.elapsed - waited)) : 0;
+        };
+        act.result(resStageThroughput,
+            "fetch", rate(stats.producerWaited),
+            "unpack", rate(stats.consumerWaited));
+    };
+
+    /* Declared after everything the producer thread uses, so that
+       the thread is joined before those go out of scope. */
+    auto source = std::make_unique<ThreadSource>([&](Sink & sink) {
+        PushActivity pact(act.id);
         LambdaSink wrapperSink([&](const unsigned char * data, size_t len) {
             sink(data, len);
             total += len;
             act.progress(total, info->narSize);
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastReport >= std::chrono::seconds(1)) {
+                lastReport = now;
+                reportThroughput();
+            }
         });
         srcStore->narFromPath({storePath}, wrapperSink);
     }, [&]() {
         throw EndOfFile("NAR for '%s' fetched from '%s' is incomplete", storePath, srcStore->getUri());
     });
+    sourcePtr = source.get();
 
     dstStore->addToStore(*info, *source, repair, checkSigs);
+
+    reportThroughput();
 }
 
 
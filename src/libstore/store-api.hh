@@ -363,11 +363,29 @@ public:
     void queryPathInfo(const Path & path,
         Callback<ref<ValidPathInfo>> callback) noexcept;
 
+    /* Query information about a set of paths at once. Paths that are
+       not valid are omitted from the result. This is much cheaper
+       than calling queryPathInfo() for each path: the caches are
+       consulted in bulk, and the remaining paths are fetched
+       concurrently or with a store-specific bulk query. If 'errors'
+       is not null, paths whose query fails are recorded there and
+       omitted from the result; otherwise, the first such error is
+       rethrown. */
+    std::map<Path, ref<const ValidPathInfo>> queryPathInfos(const PathSet & paths,
+        std::map<Path, std::exception_ptr> * errors = nullptr);
+
 protected:
 
     virtual void queryPathInfoUncached(const Path & path,
         Callback<std::shared_ptr<ValidPathInfo>> callback) noexcept = 0;
 
+    /* Fetch information about paths that are not in any cache,
+       mapping invalid paths to null. Paths whose query fails are
+       recorded in 'errors' instead. The default implementation calls
+       queryPathInfoUncached() for all paths concurrently. */
+    virtual std::map<Path, std::shared_ptr<ValidPathInfo>> queryPathInfosUncached(const PathSet & paths,
+        std::map<Path, std::exception_ptr> & errors);
+
 public:
 
     /* Queries the set of incoming FS references for a store path.
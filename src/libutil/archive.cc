@@ -2,6 +2,9 @@
 #include <algorithm>
 #include <vector>
 #include <map>
+#include <memory>
+#include <optional>
+#include <atomic>
 
 #include <strings.h> // for strcasecmp
 
@@ -14,6 +17,7 @@
 #include "archive.hh"
 #include "util.hh"
 #include "config.hh"
+#include "thread-pool.hh"
 
 namespace nix {
 
@@ -48,6 +52,12 @@ static void dumpContents(const Path & path, size_t size,
     AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
     if (!fd) throw SysError(format("opening file '%1%'") % path);
 
+#if HAVE_POSIX_FADVISE
+    /* We read the whole file sequentially, so let the kernel read
+       ahead more aggressively. */
+    posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
     std::vector<unsigned char> buf(65536);
     size_t left = size;
 
@@ -62,7 +72,8 @@ static void dumpContents(const Path & path, size_t size,
 }
 
 
-static void dump(const Path & path, Sink & sink, PathFilter & filter)
+static void dump(const Path & path, Sink & sink, PathFilter & filter,
+    const FileHashCallback * fileHashed)
 {
     checkInterrupt();
 
@@ -70,13 +81,29 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
     if (lstat(path.c_str(), &st))
         throw SysError(format("getting attributes of path '%1%'") % path);
 
-    sink << "(";
+    /* If requested, hash the serialisation of regular files and
+       symlinks as if they were the top-level path of a NAR, while
+       writing them to 'sink'. This way callers get the per-file
+       hashes without reading the file a second time. */
+    std::optional<HashSink> fileHash;
+    std::optional<LambdaSink> tee;
+    if (fileHashed && !S_ISDIR(st.st_mode)) {
+        fileHash.emplace(htSHA256);
+        *fileHash << narVersionMagic1;
+        tee.emplace([&](const unsigned char * data, size_t len) {
+            sink(data, len);
+            (*fileHash)(data, len);
+        });
+    }
+    Sink & out = tee ? (Sink &) *tee : sink;
+
+    out << "(";
 
     if (S_ISREG(st.st_mode)) {
-        sink << "type" << "regular";
+        out << "type" << "regular";
         if (st.st_mode & S_IXUSR)
-            sink << "executable" << "";
-        dumpContents(path, (size_t) st.st_size, sink);
+            out << "executable" << "";
+        dumpContents(path, (size_t) st.st_size, out);
     }
 
     else if (S_ISDIR(st.st_mode)) {
@@ -103,24 +130,35 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
         for (auto & i : unhacked)
             if (filter(path + "/" + i.first)) {
                 sink << "entry" << "(" << "name" << i.first << "node";
-                dump(path + "/" + i.second, sink, filter);
+                dump(path + "/" + i.second, sink, filter, fileHashed);
                 sink << ")";
             }
     }
 
     else if (S_ISLNK(st.st_mode))
-        sink << "type" << "symlink" << "target" << readLink(path);
+        out << "type" << "symlink" << "target" << readLink(path);
 
     else throw Error(format("file '%1%' has an unsupported type") % path);
 
-    sink << ")";
+    out << ")";
+
+    if (fileHash)
+        (*fileHashed)(path, fileHash->finish().first);
 }
 
 
 void dumpPath(const Path & path, Sink & sink, PathFilter & filter)
 {
     sink << narVersionMagic1;
-    dump(path, sink, filter);
+    dump(path, sink, filter, nullptr);
+}
+
+
+void dumpPath(const Path & path, Sink & sink, PathFilter & filter,
+    const FileHashCallback & fileHashed)
+{
+    sink << narVersionMagic1;
+    dump(path, sink, filter, &fileHashed);
 }
 
 
@@ -195,6 +233,7 @@ static void parse(ParseSink & sink, Source & source, const Path & path)
         s = readString(source);
 
         if (s == ")") {
+            if (type == tpRegular) sink.closeRegularFile();
             break;
         }
 
@@ -294,36 +333,68 @@ void parseDump(ParseSink & sink, Source & source)
 }
 
 
+/* Files up to this size are buffered and written by a worker thread,
+   as long as no more than 'maxQueuedBytes' are waiting to be
+   written. Larger files are written directly while parsing. */
+static const unsigned long long maxBufferedFileSize = 1 << 20;
+static const unsigned long long maxQueuedBytes = 64 << 20;
+
+
 struct RestoreSink : ParseSink
 {
     Path dstPath;
+    std::optional<time_t> mtime;
+
+    /* The regular file currently being parsed. */
+    Path curPath;
+    bool curExecutable;
+    std::shared_ptr<std::string> curContents;
     AutoCloseFD fd;
 
+    std::vector<Path> directories;
+
+    std::atomic<unsigned long long> queuedBytes{0};
+
+    /* Declared last, so that its worker threads are stopped before
+       the members above are destroyed. */
+    ThreadPool pool;
+
+    RestoreSink(const Path & dstPath, std::optional<time_t> mtime)
+        : dstPath(dstPath)
+        , mtime(mtime)
+        , pool(std::min(std::thread::hardware_concurrency(), 8U))
+    { }
+
     void createDirectory(const Path & path)
     {
         Path p = dstPath + path;
         if (mkdir(p.c_str(), 0777) == -1)
             throw SysError(format("creating directory '%1%'") % p);
+        if (mtime) directories.push_back(p);
     };
 
     void createRegularFile(const Path & path)
     {
-        Path p = dstPath + path;
-        fd = open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
-        if (!fd) throw SysError(format("creating file '%1%'") % p);
+        curPath = dstPath + path;
+        curExecutable = false;
     }
 
     void isExecutable()
     {
-        struct stat st;
-        if (fstat(fd.get(), &st) == -1)
-            throw SysError("fstat");
-        if (fchmod(fd.get(), st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
-            throw SysError("fchmod");
+        curExecutable = true;
     }
 
     void preallocateContents(unsigned long long len)
     {
+        if (len <= maxBufferedFileSize && queuedBytes + len <= maxQueuedBytes) {
+            curContents = std::make_shared<std::string>();
+            curContents->reserve(len);
+            queuedBytes += len;
+            return;
+        }
+
+        fd = openFile(curPath, curExecutable);
+
 #if HAVE_POSIX_FALLOCATE
         if (len) {
             errno = posix_fallocate(fd.get(), 0, len);
@@ -339,22 +410,109 @@ struct RestoreSink : ParseSink
 
     void receiveContents(unsigned char * data, unsigned int len)
     {
-        writeFull(fd.get(), data, len);
+        if (curContents)
+            curContents->append((const char *) data, len);
+        else
+            writeFull(fd.get(), data, len);
+    }
+
+    void closeRegularFile()
+    {
+        if (fd) {
+            closeFile(curPath, fd, curExecutable);
+            return;
+        }
+
+        /* A file without a 'contents' field is empty. */
+        auto contents = curContents ? curContents : std::make_shared<std::string>();
+        curContents.reset();
+
+        pool.enqueue([this, path(curPath), executable(curExecutable), contents]() {
+            auto fd = openFile(path, executable);
+            writeFull(fd.get(), *contents);
+            closeFile(path, fd, executable);
+            queuedBytes -= contents->size();
+        });
     }
 
     void createSymlink(const Path & path, const string & target)
     {
         Path p = dstPath + path;
         nix::createSymlink(target, p);
+        if (mtime) setMTime(p, AT_SYMLINK_NOFOLLOW);
+    }
+
+    /* Executable files get all execute bits regardless of the umask,
+       as the umask shouldn't affect the NAR serialisation. */
+    AutoCloseFD openFile(const Path & path, bool executable)
+    {
+        AutoCloseFD fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+        if (!fd) throw SysError(format("creating file '%1%'") % path);
+        if (executable && !mtime) {
+            struct stat st;
+            if (fstat(fd.get(), &st) == -1)
+                throw SysError("getting attributes of '%s'", path);
+            if (fchmod(fd.get(), st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
+                throw SysError("changing mode of '%s'", path);
+        }
+        return fd;
+    }
+
+    /* Give the file its final permissions and timestamp while we
+       still have it open, rather than in a separate pass. */
+    void closeFile(const Path & path, AutoCloseFD & fd, bool executable)
+    {
+        if (mtime) {
+            if (fchmod(fd.get(), executable ? 0555 : 0444) == -1)
+                throw SysError("changing mode of '%s'", path);
+            struct timespec times[2];
+            times[0].tv_sec = 0;
+            times[0].tv_nsec = UTIME_OMIT;
+            times[1].tv_sec = *mtime;
+            times[1].tv_nsec = 0;
+            if (futimens(fd.get(), times) == -1)
+                throw SysError("changing modification time of '%s'", path);
+        }
+        fd = AutoCloseFD();
+    }
+
+    void setMTime(const Path & path, int flags)
+    {
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = *mtime;
+        times[1].tv_nsec = 0;
+        if (utimensat(AT_FDCWD, path.c_str(), times, flags) == -1)
+            throw SysError("changing modification time of '%s'", path);
+    }
+
+    void finish()
+    {
+        pool.process();
+
+        /* Directories are finished last, since creating their
+           entries changes their modification time. Do them
+           bottom-up so that making a directory read-only doesn't
+           get in the way of its subdirectories. */
+        for (auto i = directories.rbegin(); i != directories.rend(); ++i) {
+            if (chmod(i->c_str(), 0555) == -1)
+                throw SysError("changing mode of '%s'", *i);
+            setMTime(*i, 0);
+        }
     }
 };
 
 
-void restorePath(const Path & path, Source & source)
+void restorePath(const Path & path, Source & source, std::optional<time_t> mtime)
 {
-    RestoreSink sink;
-    sink.dstPath = path;
-    parseDump(sink, source);
+    RestoreSink sink(path, mtime);
+    try {
+        parseDump(sink, source);
+    } catch (ThreadPoolShutDown &) {
+        /* A worker thread failed; finish() rethrows its error. */
+    }
+    sink.finish();
 }
 
 
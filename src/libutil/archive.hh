@@ -2,6 +2,9 @@
 
 #include "types.hh"
 #include "serialise.hh"
+#include "hash.hh"
+
+#include <optional>
 
 
 namespace nix {
@@ -48,6 +51,16 @@ namespace nix {
 void dumpPath(const Path & path, Sink & sink,
     PathFilter & filter = defaultPathFilter);
 
+/* Called for every regular file and symlink in a dump, with the
+   SHA-256 hash of that file's own NAR serialisation (i.e. what
+   hashPath(htSHA256, path) would return for it). */
+typedef std::function<void(const Path & path, const Hash & hash)> FileHashCallback;
+
+/* Like dumpPath(), but also compute the per-file hashes described
+   above in the same pass. */
+void dumpPath(const Path & path, Sink & sink, PathFilter & filter,
+    const FileHashCallback & fileHashed);
+
 void dumpString(const std::string & s, Sink & sink);
 
 /* FIXME: fix this API, it sucks. */
@@ -59,6 +72,7 @@ struct ParseSink
     virtual void isExecutable() { };
     virtual void preallocateContents(unsigned long long size) { };
     virtual void receiveContents(unsigned char * data, unsigned int len) { };
+    virtual void closeRegularFile() { };
 
     virtual void createSymlink(const Path & path, const string & target) { };
 };
@@ -72,7 +86,14 @@ struct TeeSink : ParseSink
 
 void parseDump(ParseSink & sink, Source & source);
 
-void restorePath(const Path & path, Source & source);
+/* Unpack the NAR in 'source' to 'path'. The NAR is parsed on the
+   calling thread, which also creates directories, symlinks and large
+   files, while small files are written by a pool of threads. If
+   'mtime' is set, every file also gets the canonical store
+   permissions (0444 or 0555) and that modification time as it is
+   created. */
+void restorePath(const Path & path, Source & source,
+    std::optional<time_t> mtime = {});
 
 /* Read a NAR from 'source' and write it to 'sink'. */
 void copyNAR(Source & source, Sink & sink);
@@ -11,7 +11,10 @@
 #include <brotli/decode.h>
 #include <brotli/encode.h>
 
+#include <zstd.h>
+
 #include <iostream>
+#include <thread>
 
 namespace nix {
 
@@ -198,6 +201,56 @@ struct BrotliDecompressionSink : ChunkedCompressionSink
     }
 };
 
+struct ZstdDecompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    ZSTD_DCtx * dctx;
+    uint8_t outbuf[32 * 1024];
+    /* The last result of ZSTD_decompressStream(), which is 0 at the
+       end of a frame. */
+    size_t ret = 1;
+
+    ZstdDecompressionSink(Sink & nextSink) : nextSink(nextSink)
+    {
+        dctx = ZSTD_createDCtx();
+        if (!dctx)
+            throw CompressionError("unable to initialise zstd decoder");
+    }
+
+    ~ZstdDecompressionSink()
+    {
+        ZSTD_freeDCtx(dctx);
+    }
+
+    void finish() override
+    {
+        flush();
+        if (ret != 0)
+            throw CompressionError("zstd file is truncated");
+    }
+
+    void write(const unsigned char * data, size_t len) override
+    {
+        ZSTD_inBuffer in{data, len, 0};
+
+        while (true) {
+            checkInterrupt();
+
+            ZSTD_outBuffer out{outbuf, sizeof(outbuf), 0};
+
+            ret = ZSTD_decompressStream(dctx, &out, &in);
+            if (ZSTD_isError(ret))
+                throw CompressionError("error while decompressing zstd file: %s", ZSTD_getErrorName(ret));
+
+            if (out.pos) nextSink(outbuf, out.pos);
+
+            /* If the output buffer was filled, the decoder may still
+               hold output even though all input has been consumed. */
+            if (in.pos == in.size && out.pos < out.size) break;
+        }
+    }
+};
+
 ref<std::string> decompress(const std::string & method, const std::string & in)
 {
     StringSink ssink;
@@ -217,6 +270,8 @@ ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & ne
         return make_ref<BzipDecompressionSink>(nextSink);
     else if (method == "br")
         return make_ref<BrotliDecompressionSink>(nextSink);
+    else if (method == "zstd")
+        return make_ref<ZstdDecompressionSink>(nextSink);
     else
         throw UnknownCompressionMethod("unknown compression method '%s'", method);
 }
@@ -228,8 +283,10 @@ struct XzCompressionSink : CompressionSink
     lzma_stream strm = LZMA_STREAM_INIT;
     bool finished = false;
 
-    XzCompressionSink(Sink & nextSink, bool parallel) : nextSink(nextSink)
+    XzCompressionSink(Sink & nextSink, bool parallel, int level) : nextSink(nextSink)
     {
+        uint32_t preset = level == -1 ? LZMA_PRESET_DEFAULT : level;
+
         lzma_ret ret;
         bool done = false;
 
@@ -238,7 +295,7 @@ struct XzCompressionSink : CompressionSink
             lzma_mt mt_options = {};
             mt_options.flags = 0;
             mt_options.timeout = 300; // Using the same setting as the xz cmd line
-            mt_options.preset = LZMA_PRESET_DEFAULT;
+            mt_options.preset = preset;
             mt_options.filters = NULL;
             mt_options.check = LZMA_CHECK_CRC64;
             mt_options.threads = lzma_cputhreads();
@@ -255,7 +312,7 @@ struct XzCompressionSink : CompressionSink
         }
 
         if (!done)
-            ret = lzma_easy_encoder(&strm, 6, LZMA_CHECK_CRC64);
+            ret = lzma_easy_encoder(&strm, preset, LZMA_CHECK_CRC64);
 
         if (ret != LZMA_OK)
             throw CompressionError("unable to initialise lzma encoder");
@@ -360,11 +417,13 @@ struct BrotliCompressionSink : ChunkedCompressionSink
     BrotliEncoderState *state;
     bool finished = false;
 
-    BrotliCompressionSink(Sink & nextSink) : nextSink(nextSink)
+    BrotliCompressionSink(Sink & nextSink, int level) : nextSink(nextSink)
     {
         state = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
         if (!state)
             throw CompressionError("unable to initialise brotli encoder");
+        if (level != -1)
+            BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, level);
     }
 
     ~BrotliCompressionSink()
@@ -406,24 +465,99 @@ struct BrotliCompressionSink : ChunkedCompressionSink
     }
 };
 
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel)
+struct ZstdCompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    ZSTD_CCtx * cctx;
+    uint8_t outbuf[32 * 1024];
+
+    ZstdCompressionSink(Sink & nextSink, bool parallel, int level, bool longDistance)
+        : nextSink(nextSink)
+    {
+        cctx = ZSTD_createCCtx();
+        if (!cctx)
+            throw CompressionError("unable to initialise zstd encoder");
+
+        setParameter(ZSTD_c_compressionLevel, level == -1 ? ZSTD_CLEVEL_DEFAULT : level);
+
+        if (longDistance)
+            setParameter(ZSTD_c_enableLongDistanceMatching, 1);
+
+        if (parallel) {
+            auto ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, std::max(1U, std::thread::hardware_concurrency()));
+            if (ZSTD_isError(ret))
+                printMsg(lvlError, "warning: parallel zstd compression requested but not supported, falling back to single-threaded compression");
+        }
+    }
+
+    ~ZstdCompressionSink()
+    {
+        ZSTD_freeCCtx(cctx);
+    }
+
+    void setParameter(ZSTD_cParameter param, int value)
+    {
+        auto ret = ZSTD_CCtx_setParameter(cctx, param, value);
+        if (ZSTD_isError(ret))
+            throw CompressionError("unable to set zstd parameter: %s", ZSTD_getErrorName(ret));
+    }
+
+    void finish() override
+    {
+        flush();
+        compress(nullptr, 0, ZSTD_e_end);
+    }
+
+    void write(const unsigned char * data, size_t len) override
+    {
+        compress(data, len, ZSTD_e_continue);
+    }
+
+    void compress(const unsigned char * data, size_t len, ZSTD_EndDirective mode)
+    {
+        ZSTD_inBuffer in{data, len, 0};
+
+        while (true) {
+            checkInterrupt();
+
+            ZSTD_outBuffer out{outbuf, sizeof(outbuf), 0};
+
+            auto remaining = ZSTD_compressStream2(cctx, &out, &in, mode);
+            if (ZSTD_isError(remaining))
+                throw CompressionError("error while compressing zstd file: %s", ZSTD_getErrorName(remaining));
+
+            if (out.pos) nextSink(outbuf, out.pos);
+
+            /* When finishing, keep going until everything has been
+               flushed. Otherwise, stop once the input has been
+               consumed. */
+            if (mode == ZSTD_e_end ? remaining == 0 : in.pos == in.size) break;
+        }
+    }
+};
+
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink,
+    const bool parallel, int level, bool longDistance)
 {
     if (method == "none")
         return make_ref<NoneSink>(nextSink);
     else if (method == "xz")
-        return make_ref<XzCompressionSink>(nextSink, parallel);
+        return make_ref<XzCompressionSink>(nextSink, parallel, level);
     else if (method == "bzip2")
         return make_ref<BzipCompressionSink>(nextSink);
     else if (method == "br")
-        return make_ref<BrotliCompressionSink>(nextSink);
+        return make_ref<BrotliCompressionSink>(nextSink, level);
+    else if (method == "zstd")
+        return make_ref<ZstdCompressionSink>(nextSink, parallel, level, longDistance);
     else
         throw UnknownCompressionMethod(format("unknown compression method '%s'") % method);
 }
 
-ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel)
+ref<std::string> compress(const std::string & method, const std::string & in,
+    const bool parallel, int level, bool longDistance)
 {
     StringSink ssink;
-    auto sink = makeCompressionSink(method, ssink, parallel);
+    auto sink = makeCompressionSink(method, ssink, parallel, level, longDistance);
     (*sink)(in);
     sink->finish();
     return ssink.s;
@@ -17,9 +17,16 @@ ref<std::string> decompress(const std::string & method, const std::string & in);
 
 ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & nextSink);
 
-ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel = false);
-
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false);
+/* Compress 'in' using 'method' ("none", "xz", "bzip2", "br" or
+   "zstd"). 'level' is the compression level, or -1 for the method's
+   default; it is ignored by bzip2. 'parallel' enables multi-threaded
+   compression and 'longDistance' enables long-distance matching; only
+   some methods support these. */
+ref<std::string> compress(const std::string & method, const std::string & in,
+    const bool parallel = false, int level = -1, bool longDistance = false);
+
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink,
+    const bool parallel = false, int level = -1, bool longDistance = false);
 
 MakeError(UnknownCompressionMethod, Error);
 
@@ -178,6 +178,14 @@ public:
         toJSON(state->str, v);
     }
 
+    /* Write a value that is already encoded as JSON. */
+    void writeRaw(const std::string & s)
+    {
+        assertValid();
+        first = false;
+        state->str << s;
+    }
+
     JSONList list();
 
     JSONObject object();
@@ -38,6 +38,7 @@ typedef enum {
     resProgress = 105,
     resSetExpected = 106,
     resPostBuildLogLine = 107,
+    resStageThroughput = 108,
 } ResultType;
 
 typedef uint64_t ActivityId;
@@ -1,9 +1,13 @@
 #include "serialise.hh"
 #include "util.hh"
+#include "sync.hh"
 
 #include <cstring>
 #include <cerrno>
 #include <memory>
+#include <deque>
+#include <thread>
+#include <chrono>
 
 #include <boost/coroutine2/coroutine.hpp>
 
@@ -212,6 +216,115 @@ std::unique_ptr<Source> sinkToSource(
 }
 
 
+struct ThreadSource::State
+{
+    typedef std::chrono::steady_clock Clock;
+
+    struct Queue
+    {
+        std::deque<std::string> chunks;
+        size_t buffered = 0;
+        bool done = false, cancelled = false;
+        std::exception_ptr exc;
+        uint64_t bytesRead = 0;
+        Clock::duration producerWaited{0}, consumerWaited{0};
+    };
+
+    Sync<Queue> queue_;
+    std::condition_variable produced, consumed;
+    std::function<void()> eof;
+    size_t maxBuffered;
+    Clock::time_point startTime = Clock::now();
+    std::thread thread;
+};
+
+
+ThreadSource::ThreadSource(std::function<void(Sink &)> fun,
+    std::function<void()> eof, size_t maxBuffered)
+    : state(std::make_unique<State>())
+{
+    state->eof = eof;
+    state->maxBuffered = maxBuffered;
+
+    state->thread = std::thread([fun, state(state.get())]() {
+        try {
+            LambdaSink sink([&](const unsigned char * data, size_t len) {
+                if (!len) return;
+                std::string chunk((const char *) data, len);
+                auto queue(state->queue_.lock());
+                if (queue->buffered >= state->maxBuffered && !queue->cancelled) {
+                    auto before = State::Clock::now();
+                    while (queue->buffered >= state->maxBuffered && !queue->cancelled)
+                        queue.wait(state->consumed);
+                    queue->producerWaited += State::Clock::now() - before;
+                }
+                if (queue->cancelled)
+                    throw Interrupted("consumer of producer thread has gone away");
+                queue->buffered += len;
+                queue->chunks.push_back(std::move(chunk));
+                state->produced.notify_one();
+            });
+            fun(sink);
+        } catch (...) {
+            state->queue_.lock()->exc = std::current_exception();
+        }
+        state->queue_.lock()->done = true;
+        state->produced.notify_one();
+    });
+}
+
+
+ThreadSource::~ThreadSource()
+{
+    state->queue_.lock()->cancelled = true;
+    state->consumed.notify_one();
+    state->thread.join();
+}
+
+
+size_t ThreadSource::read(unsigned char * data, size_t len)
+{
+    if (pos == cur.size()) {
+        {
+            auto queue(state->queue_.lock());
+            if (queue->chunks.empty() && !queue->done) {
+                auto before = State::Clock::now();
+                while (queue->chunks.empty() && !queue->done)
+                    queue.wait(state->produced);
+                queue->consumerWaited += State::Clock::now() - before;
+            }
+            if (!queue->chunks.empty()) {
+                cur = std::move(queue->chunks.front());
+                queue->chunks.pop_front();
+                queue->buffered -= cur.size();
+                queue->bytesRead += cur.size();
+                pos = 0;
+                state->consumed.notify_one();
+            } else if (queue->exc)
+                std::rethrow_exception(queue->exc);
+        }
+        if (pos == cur.size()) { state->eof(); abort(); }
+    }
+
+    auto n = std::min(cur.size() - pos, len);
+    memcpy(data, (unsigned char *) cur.data() + pos, n);
+    pos += n;
+
+    return n;
+}
+
+
+ThreadSource::Stats ThreadSource::getStats()
+{
+    auto queue(state->queue_.lock());
+    auto secs = [](State::Clock::duration d) {
+        return std::chrono::duration<double>(d).count();
+    };
+    return {queue->bytesRead, secs(State::Clock::now() - state->startTime),
+        secs(queue->producerWaited), secs(queue->consumerWaited)};
+}
+
+
 void writePadding(size_t len, Sink & sink)
 {
     if (len % 8) {
@@ -251,6 +251,46 @@ std::unique_ptr<Source> sinkToSource(
     });
 
 
+/* Like sinkToSource(), but execute the function in a separate thread
+   and pass its data through a queue of at most 'maxBuffered' bytes.
+   This lets the producer and the consumer run concurrently (e.g. to
+   decompress a NAR while unpacking the previous part of it), while
+   preventing the producer from getting too far ahead. Exceptions
+   thrown by the function are rethrown by read(). */
+struct ThreadSource : Source
+{
+    ThreadSource(std::function<void(Sink &)> fun,
+        std::function<void()> eof = []() {
+            throw EndOfFile("producer thread has finished");
+        },
+        size_t maxBuffered = 8 * 1024 * 1024);
+
+    ~ThreadSource();
+
+    size_t read(unsigned char * data, size_t len) override;
+
+    struct Stats
+    {
+        /* Bytes taken from the queue by the consumer so far. */
+        uint64_t bytes;
+        /* Seconds since the producer was started, and how much of
+           that the producer spent waiting for the queue to drain and
+           the consumer for it to fill. */
+        double elapsed, producerWaited, consumerWaited;
+    };
+
+    Stats getStats();
+
+private:
+
+    struct State;
+    std::unique_ptr<State> state;
+
+    std::string cur;
+    size_t pos = 0;
+};
+
+
 void writePadding(size_t len, Sink & sink);
 void writeString(const unsigned char * buf, size_t len, Sink & sink);
 
@@ -821,7 +821,7 @@ Pid::operator pid_t()
 }
 
 
-int Pid::kill()
+int Pid::kill(struct rusage * usage)
 {
     assert(pid != -1);
 
@@ -840,16 +840,16 @@ int Pid::kill()
             printError((SysError("killing process %d", pid).msg()));
     }
 
-    return wait();
+    return wait(usage);
 }
 
 
-int Pid::wait()
+int Pid::wait(struct rusage * usage)
 {
     assert(pid != -1);
     while (1) {
         int status;
-        int res = waitpid(pid, &status, 0);
+        int res = usage ? wait4(pid, &status, 0, usage) : waitpid(pid, &status, 0);
         if (res == pid) {
             pid = -1;
             return status;
@@ -5,6 +5,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <signal.h>
@@ -234,8 +235,10 @@ public:
     ~Pid();
     void operator =(pid_t pid);
     operator pid_t();
-    int kill();
-    int wait();
+    /* If 'usage' is not null, it is set to the resource usage of the
+       process and its waited-for descendants. */
+    int kill(struct rusage * usage = nullptr);
+    int wait(struct rusage * usage = nullptr);
 
     void setSeparatePG(bool separatePG);
     void setKillSignal(int signal);
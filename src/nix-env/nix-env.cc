@@ -173,14 +173,19 @@ static void loadSourceExpr(EvalState & state, const Path & path, Value & v)
 
 static void loadDerivations(EvalState & state, Path nixExprPath,
     string systemFilter, Bindings & autoArgs,
-    const string & pathPrefix, DrvInfos & elems)
+    const string & pathPrefix, DrvInfos & elems, bool parallel = false)
 {
-    Value vRoot;
+    /* Allocated on the heap because the DrvInfos returned by
+       getDerivationsParallel() refer to it. */
+    Value & vRoot(*state.allocValue());
     loadSourceExpr(state, nixExprPath, vRoot);
 
     Value & v(*findAlongAttrPath(state, pathPrefix, autoArgs, vRoot));
 
-    getDerivations(state, v, pathPrefix, autoArgs, elems, true);
+    if (parallel)
+        getDerivationsParallel(state, v, pathPrefix, autoArgs, elems, true);
+    else
+        getDerivations(state, v, pathPrefix, autoArgs, elems, true);
 
     /* Filter out all derivations not applicable to the current
        system. */
@@ -926,7 +931,7 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     if (source == sAvailable || compareVersions)
         loadDerivations(*globals.state, globals.instSource.nixExprPath,
             globals.instSource.systemFilter, *globals.instSource.autoArgs,
-            attrPath, availElems);
+            attrPath, availElems, true);
 
     DrvInfos elems_ = filterBySelector(*globals.state,
         source == sInstalled ? installedElems : availElems,
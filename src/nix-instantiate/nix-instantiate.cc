@@ -10,6 +10,8 @@
 #include "store-api.hh"
 #include "common-eval-args.hh"
 #include "legacy.hh"
+#include "eval-cache.hh"
+#include "download.hh"
 
 #include <map>
 #include <iostream>
@@ -26,9 +28,27 @@ static bool indirectRoot = false;
 enum OutputKind { okPlain, okXML, okJSON };
 
 
+static void printDrvPath(EvalState & state, Path drvPath, const string & outputName)
+{
+    if (gcRoot == "")
+        printGCWarning();
+    else {
+        Path rootName = indirectRoot ? absPath(gcRoot) : gcRoot;
+        if (++rootNr > 1) rootName += "-" + std::to_string(rootNr);
+        auto store2 = state.store.dynamic_pointer_cast<LocalFSStore>();
+        if (store2)
+            drvPath = store2->addPermRoot(drvPath, rootName, indirectRoot);
+    }
+    std::cout << format("%1%%2%\n") % drvPath % (outputName != "out" ? "!" + outputName : "");
+}
+
+
+/* If 'results' is not null, the derivation paths and output names
+   are appended to it in the form 'drvPath!outputName'. */
 void processExpr(EvalState & state, const Strings & attrPaths,
     bool parseOnly, bool strict, Bindings & autoArgs,
-    bool evalOnly, OutputKind output, bool location, Expr * e)
+    bool evalOnly, OutputKind output, bool location, Expr * e,
+    Strings * results = nullptr)
 {
     if (parseOnly) {
         std::cout << format("%1%\n") % *e;
@@ -68,16 +88,9 @@ void processExpr(EvalState & state, const Strings & attrPaths,
                 if (outputName == "")
                     throw Error(format("derivation '%1%' lacks an 'outputName' attribute ") % drvPath);
 
-                if (gcRoot == "")
-                    printGCWarning();
-                else {
-                    Path rootName = indirectRoot ? absPath(gcRoot) : gcRoot;
-                    if (++rootNr > 1) rootName += "-" + std::to_string(rootNr);
-                    auto store2 = state.store.dynamic_pointer_cast<LocalFSStore>();
-                    if (store2)
-                        drvPath = store2->addPermRoot(drvPath, rootName, indirectRoot);
-                }
-                std::cout << format("%1%%2%\n") % drvPath % (outputName != "out" ? "!" + outputName : "");
+                if (results) results->push_back(drvPath + "!" + outputName);
+
+                printDrvPath(state, drvPath, outputName);
             }
         }
     }
@@ -161,6 +174,14 @@ static int _main(int argc, char * * argv)
 
         Bindings & autoArgs = *myArgs.getAutoArgs(*state);
 
+        /* The evaluation cache only applies to instantiation, since
+           that is the only mode whose result (a set of store
+           derivations) can be validated against the store. It is
+           skipped when repairing, since a cache hit would skip the
+           repair. */
+        bool useCache = evalSettings.evalCache && !evalOnly && !readStdin && !settings.readOnlyMode && !repair;
+        if (useCache) state->trackedInputs = TrackedInputs();
+
         if (attrPaths.empty()) attrPaths = {""};
 
         if (findFile) {
@@ -180,11 +201,43 @@ static int _main(int argc, char * * argv)
             files.push_back("./default.nix");
 
         for (auto & i : files) {
+            std::optional<Hash> fingerprint;
+
+            if (useCache && (fromArgs || !isUri(i))) {
+                Strings key{fromArgs ? "expr" : "file", i, absPath(".")};
+                key.insert(key.end(), attrPaths.begin(), attrPaths.end());
+                key.push_back("");
+                for (auto & arg : myArgs.autoArgs)
+                    key.push_back(arg.first + "=" + arg.second);
+                fingerprint = fingerprintEval(*state, key);
+
+                if (auto results = getEvalCache()->lookup(*fingerprint)) {
+                    bool valid = true;
+                    for (auto & j : *results)
+                        if (!store->isValidPath(string(j, 0, j.rfind('!')))) valid = false;
+                    if (valid) {
+                        printTalkative("using cached evaluation result for '%s'", i);
+                        for (auto & j : *results) {
+                            auto k = j.rfind('!');
+                            printDrvPath(*state, string(j, 0, k), string(j, k + 1));
+                        }
+                        continue;
+                    }
+                }
+            }
+
+            Strings results;
             Expr * e = fromArgs
                 ? state->parseExprFromString(i, absPath("."))
-                : state->parseExprFromFile(resolveExprPath(state->checkSourcePath(lookupFileArg(*state, i))));
+                : state->parseExprFromFile(state->checkSourcePath(resolveExprPath(state->checkSourcePath(lookupFileArg(*state, i)))));
             processExpr(*state, attrPaths, parseOnly, strict, autoArgs,
-                evalOnly, outputKind, xmlOutputSourceLocation, e);
+                evalOnly, outputKind, xmlOutputSourceLocation, e, &results);
+
+            /* The tracked inputs accumulate over all files, which
+               over-approximates the inputs of each one but accounts
+               for values shared between them. */
+            if (fingerprint && !state->impure)
+                getEvalCache()->add(*fingerprint, *state->trackedInputs, results);
         }
 
         state->printStats();
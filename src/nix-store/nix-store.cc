@@ -710,6 +710,7 @@ static void opVerify(Strings opFlags, Strings opArgs)
     for (auto & i : opFlags)
         if (i == "--check-contents") checkContents = true;
         else if (i == "--repair") repair = Repair;
+        else if (i == "--resume") settings.set("verify-resume", "true");
         else throw UsageError(format("unknown flag '%1%'") % i);
 
     if (store->verifyStore(checkContents, repair)) {
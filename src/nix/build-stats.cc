@@ -0,0 +1,208 @@
+#include "command.hh"
+#include "shared.hh"
+#include "local-store.hh"
+#include "json.hh"
+#include "common-args.hh"
+
+#include <algorithm>
+
+using namespace nix;
+
+struct CmdBuildStats : StoreCommand, MixJSON
+{
+    std::vector<std::string> names;
+    bool showBuilds = false;
+    size_t limit = 0;
+
+    CmdBuildStats()
+    {
+        expectArgs("names", &names);
+        mkFlag(0, "builds", "show individual builds rather than statistics per derivation name", &showBuilds);
+        mkIntFlag('n', "limit", "show at most N lines", &limit);
+    }
+
+    std::string name() override
+    {
+        return "build-stats";
+    }
+
+    std::string description() override
+    {
+        return "show statistics about past builds (local stores only, not through the daemon)";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To show the derivations that took the most time to build:",
+                "nix build-stats -n 10"
+            },
+            Example{
+                "To show every build of GCC (with any version):",
+                "nix build-stats --builds gcc"
+            },
+            Example{
+                "To show the derivations that needed the most memory (using --json and the jq(1) command):",
+                "nix build-stats --json | jq 'sort_by(.maxRSS) | reverse | .[:10]'"
+            },
+            Example{
+                "To show the builds done by the daemon of a multi-user installation (the history is not available through the daemon):",
+                "sudo nix build-stats --store local"
+            },
+        };
+    }
+
+    static std::string showTime(std::optional<double> t)
+    {
+        return t ? fmt("%.1fs", *t) : "-";
+    }
+
+    static std::string showSize(std::optional<uint64_t> n)
+    {
+        return n ? fmt("%.1fM", *n / (1024.0 * 1024.0)) : "-";
+    }
+
+    void run(ref<Store> store) override
+    {
+        /* The build history is only kept in the database of the
+           local store, and is not exposed by the daemon protocol. */
+        auto localStore = store.dynamic_pointer_cast<LocalStore>();
+        if (!localStore)
+            throw Error("store '%s' does not keep a build history; "
+                "it can only be queried by a user with direct access to the local store (e.g. 'nix build-stats --store local' as root)",
+                store->getUri());
+
+        std::vector<BuildRecord> records;
+        if (names.empty())
+            records = localStore->queryBuildRecords();
+        else
+            for (auto & name : names) {
+                auto records2 = localStore->queryBuildRecords(name);
+                records.insert(records.end(), records2.begin(), records2.end());
+            }
+
+        if (showBuilds)
+            printBuilds(records);
+        else
+            printStats(records);
+    }
+
+    void printBuilds(std::vector<BuildRecord> & records)
+    {
+        if (limit && records.size() > limit) records.resize(limit);
+
+        if (json) {
+            JSONList jsonRoot(std::cout);
+            for (auto & record : records) {
+                auto obj = jsonRoot.object();
+                obj.attr("drvPath", record.drvPath);
+                obj.attr("system", record.system);
+                obj.attr("startTime", record.startTime);
+                obj.attr("stopTime", record.stopTime);
+                obj.attr("success", record.success);
+                if (record.userTime) obj.attr("userTime", *record.userTime);
+                if (record.systemTime) obj.attr("systemTime", *record.systemTime);
+                if (record.maxRSS) obj.attr("maxRSS", *record.maxRSS);
+                if (record.success && record.outputSize) obj.attr("outputSize", *record.outputSize);
+            }
+            return;
+        }
+
+        for (auto & record : records)
+            std::cout << fmt("%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
+                record.drvPath,
+                record.success ? "ok" : "failed",
+                showTime(record.stopTime - record.startTime),
+                showTime(record.userTime),
+                showTime(record.systemTime),
+                showSize(record.maxRSS),
+                record.success && record.outputSize ? showSize(*record.outputSize) : "-",
+                record.system);
+    }
+
+    void printStats(const std::vector<BuildRecord> & records)
+    {
+        struct Stats
+        {
+            std::string name, system;
+            size_t builds = 0, failures = 0;
+            double totalTime = 0, maxTime = 0;
+            double totalCPUTime = 0;
+            size_t cpuTimes = 0;
+            std::optional<uint64_t> maxRSS;
+            uint64_t totalOutputSize = 0;
+            size_t outputSizes = 0;
+        };
+
+        std::map<std::pair<std::string, std::string>, Stats> stats;
+
+        for (auto & record : records) {
+            auto & s = stats[{record.name, record.system}];
+            s.name = record.name;
+            s.system = record.system;
+            s.builds++;
+            double time = record.stopTime - record.startTime;
+            s.totalTime += time;
+            s.maxTime = std::max(s.maxTime, time);
+            if (record.userTime && record.systemTime) {
+                s.totalCPUTime += *record.userTime + *record.systemTime;
+                s.cpuTimes++;
+            }
+            if (record.maxRSS)
+                s.maxRSS = std::max(s.maxRSS.value_or(0), *record.maxRSS);
+            if (!record.success)
+                s.failures++;
+            else if (record.outputSize) {
+                s.totalOutputSize += *record.outputSize;
+                s.outputSizes++;
+            }
+        }
+
+        /* Show the derivations that took the most time first. */
+        std::vector<Stats *> sorted;
+        for (auto & i : stats) sorted.push_back(&i.second);
+        std::stable_sort(sorted.begin(), sorted.end(),
+            [](const Stats * a, const Stats * b) { return a->totalTime > b->totalTime; });
+        if (limit && sorted.size() > limit) sorted.resize(limit);
+
+        auto mean = [](double total, size_t n) -> std::optional<double> {
+            if (!n) return {};
+            return total / n;
+        };
+
+        if (json) {
+            JSONList jsonRoot(std::cout);
+            for (auto s : sorted) {
+                auto obj = jsonRoot.object();
+                obj.attr("name", s->name);
+                obj.attr("system", s->system);
+                obj.attr("builds", s->builds);
+                obj.attr("failures", s->failures);
+                obj.attr("totalTime", s->totalTime);
+                obj.attr("meanTime", s->totalTime / s->builds);
+                obj.attr("maxTime", s->maxTime);
+                if (s->cpuTimes) obj.attr("meanCPUTime", s->totalCPUTime / s->cpuTimes);
+                if (s->maxRSS) obj.attr("maxRSS", *s->maxRSS);
+                if (s->outputSizes) obj.attr("meanOutputSize", s->totalOutputSize / s->outputSizes);
+            }
+            return;
+        }
+
+        for (auto s : sorted) {
+            auto meanOutputSize = mean(s->totalOutputSize, s->outputSizes);
+            std::cout << fmt("%s\t%d\t%d\t%s\t%s\t%s\t%s\t%s\t%s\n",
+                s->name,
+                s->builds,
+                s->failures,
+                showTime(s->totalTime / s->builds),
+                showTime(s->maxTime),
+                showTime(mean(s->totalCPUTime, s->cpuTimes)),
+                showSize(s->maxRSS),
+                meanOutputSize ? showSize((uint64_t) *meanOutputSize) : "-",
+                s->system);
+        }
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdBuildStats>());
@@ -30,7 +30,7 @@ private:
 
     struct ActInfo
     {
-        std::string s, lastLine, phase;
+        std::string s, lastLine, phase, throughput;
         ActivityType type = actUnknown;
         uint64_t done = 0;
         uint64_t expected = 0;
@@ -81,6 +81,11 @@ public:
         , isTTY(isTTY)
     {
         state_.lock()->active = isTTY;
+        startUpdateThread();
+    }
+
+    void startUpdateThread()
+    {
         updateThread = std::thread([&]() {
             auto state(state_.lock());
             while (state->active) {
@@ -111,6 +116,19 @@ public:
         quitCV.notify_one();
     }
 
+    /* Restart the progress bar after stop(). */
+    void resume()
+    {
+        if (!isTTY || state_.lock()->active) return;
+        updateThread.join();
+        {
+            auto state(state_.lock());
+            state->active = true;
+            state->haveUpdate = true;
+        }
+        startUpdateThread();
+    }
+
     void log(Verbosity lvl, const FormatOrString & fs) override
     {
         auto state(state_.lock());
@@ -286,6 +304,23 @@ public:
             update(*state);
         }
 
+        else if (type == resStageThroughput) {
+            /* Show this on the closest visible activity, since
+               e.g. copying a substituted path is hidden. */
+            auto i = state->its.find(act);
+            while (i != state->its.end() && !i->second->visible)
+                i = state->its.find(i->second->parent);
+            if (i != state->its.end()) {
+                std::string s;
+                for (size_t n = 0; n + 1 < fields.size(); n += 2) {
+                    if (!s.empty()) s += ", ";
+                    s += fmt("%s %.1f MiB/s", getS(fields, n), getI(fields, n + 1) / (1024.0 * 1024.0));
+                }
+                i->second->throughput = s;
+                update(*state);
+            }
+        }
+
         else if (type == resSetExpected) {
             auto i = state->its.find(act);
             assert(i != state->its.end());
@@ -333,6 +368,11 @@ public:
                     line += i->phase;
                     line += ")";
                 }
+                if (!i->throughput.empty()) {
+                    line += " (";
+                    line += i->throughput;
+                    line += ")";
+                }
                 if (!i->lastLine.empty()) {
                     if (!i->s.empty()) line += ": ";
                     line += i->lastLine;
@@ -449,4 +489,10 @@ void stopProgressBar()
 
 }
 
+void resumeProgressBar()
+{
+    auto progressBar = dynamic_cast<ProgressBar *>(logger);
+    if (progressBar) progressBar->resume();
+}
+
 }
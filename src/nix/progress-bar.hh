@@ -8,4 +8,7 @@ void startProgressBar(bool printBuildLogs = false);
 
 void stopProgressBar();
 
+/* Restart the progress bar after stopProgressBar(). */
+void resumeProgressBar();
+
 }
@@ -8,6 +8,9 @@
 #include "json.hh"
 #include "json-to-value.hh"
 #include "shared.hh"
+#include "parallel-eval.hh"
+#include "progress-bar.hh"
+#include "finally.hh"
 
 #include <regex>
 #include <fstream>
@@ -113,6 +116,12 @@ struct CmdSearch : SourceExprCommand, MixJSON
 
         std::map<std::string, std::string> results;
 
+        /* For --json: maps attribute paths to the package name,
+           version and description. */
+        std::map<std::string, std::array<std::string, 3>> jsonResults;
+
+        bool inWorker = false;
+
         std::function<void(Value *, std::string, bool, JSONObject *)> doExpr;
 
         doExpr = [&](Value * v, std::string attrPath, bool toplevel, JSONObject * cache) {
@@ -162,11 +171,7 @@ struct CmdSearch : SourceExprCommand, MixJSON
                     if (found == res.size()) {
                         if (json) {
 
-                            auto jsonElem = jsonOut->object(attrPath);
-
-                            jsonElem.attr("pkgName", parsed.name);
-                            jsonElem.attr("version", parsed.version);
-                            jsonElem.attr("description", description);
+                            jsonResults[attrPath] = {parsed.name, parsed.version, description};
 
                         } else {
                             auto name = hilite(parsed.name, nameMatch, "\e[0;2m")
@@ -207,13 +212,66 @@ struct CmdSearch : SourceExprCommand, MixJSON
                         toplevel2 = j != v->attrs->end() && state->forceBool(*j->value, *j->pos);
                     }
 
-                    for (auto & i : *v->attrs) {
-                        auto cache2 =
-                            cache ? std::make_unique<JSONObject>(cache->object(i.name)) : nullptr;
-                        doExpr(i.value,
-                            attrPath == "" ? (std::string) i.name : attrPath + "." + (std::string) i.name,
-                            toplevel2 || fromCache, cache2 ? cache2.get() : nullptr);
+                    auto childAttrPath = [&](const Attr & i) {
+                        return attrPath == "" ? (std::string) i.name : attrPath + "." + (std::string) i.name;
+                    };
+
+                    /* The attributes of a package set can be
+                       evaluated independently, so fork workers to
+                       process them in parallel. */
+                    if (toplevel && !toplevel2 && !fromCache && !inWorker && evalSettings.evalWorkers > 1) {
+                        std::vector<const Attr *> attrs;
+                        for (auto & i : *v->attrs) attrs.push_back(&i);
+
+                        /* The workers can't use the progress bar,
+                           since its thread doesn't exist in them. */
+                        stopProgressBar();
+                        Finally resume([]() { resumeProgressBar(); });
+
+                        forkEvalWorkers(*state, attrs.size(), evalSettings.evalWorkers,
+                            [&](size_t n) {
+                                inWorker = true;
+                                results.clear();
+                                jsonResults.clear();
+                                std::ostringstream cacheStr;
+                                {
+                                    auto cache2 = cache ? std::make_unique<JSONObject>(cacheStr) : nullptr;
+                                    doExpr(attrs[n]->value, childAttrPath(*attrs[n]), false, cache2.get());
+                                }
+                                StringSink sink;
+                                sink << results.size();
+                                for (auto & j : results)
+                                    sink << j.first << j.second;
+                                sink << jsonResults.size();
+                                for (auto & j : jsonResults)
+                                    sink << j.first << j.second[0] << j.second[1] << j.second[2];
+                                sink << cacheStr.str();
+                                return *sink.s;
+                            },
+                            [&](size_t n, std::string && data) {
+                                StringSource source(data);
+                                for (auto count = readNum<size_t>(source); count; --count) {
+                                    auto key = readString(source);
+                                    results[key] = readString(source);
+                                }
+                                for (auto count = readNum<size_t>(source); count; --count) {
+                                    auto key = readString(source);
+                                    auto & res = jsonResults[key];
+                                    for (auto & field : res) field = readString(source);
+                                }
+                                auto cacheData = readString(source);
+                                if (cache)
+                                    cache->placeholder(attrs[n]->name).writeRaw(cacheData);
+                            });
                     }
+
+                    else
+                        for (auto & i : *v->attrs) {
+                            auto cache2 =
+                                cache ? std::make_unique<JSONObject>(cache->object(i.name)) : nullptr;
+                            doExpr(i.value, childAttrPath(i),
+                                toplevel2 || fromCache, cache2 ? cache2.get() : nullptr);
+                        }
                 }
 
             } catch (AssertionError & e) {
@@ -268,6 +326,15 @@ struct CmdSearch : SourceExprCommand, MixJSON
                 throw SysError("cannot rename '%s' to '%s'", tmpFile, jsonCacheFileName);
         }
 
+        if (json) {
+            for (auto & i : jsonResults) {
+                auto jsonElem = jsonOut->object(i.first);
+                jsonElem.attr("pkgName", i.second[0]);
+                jsonElem.attr("version", i.second[1]);
+                jsonElem.attr("description", i.second[2]);
+            }
+        }
+
         if (results.size() == 0)
             throw Error("no results for the given search term(s)!");
 
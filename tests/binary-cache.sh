@@ -8,6 +8,28 @@ outPath=$(nix-build dependencies.nix --no-out-link)
 
 nix copy --to file://$cacheDir $outPath
 
+# NARs are compressed via a temporary file that must not be left behind.
+(! ls -d $cacheDir/nix-upload-* 2> /dev/null)
+
+# The NAR listing is generated while streaming the NAR.
+listingCache=$TEST_ROOT/binary-cache-listing
+rm -rf $listingCache
+nix copy --to "file://$listingCache?write-nar-listing=1&compression=none" $outPath
+listing=$listingCache/$(basename $outPath | cut -c1-32).ls
+grep -q '"type":"directory"' $listing
+grep -q '"narOffset"' $listing
+nar=$listingCache/$(grep '^URL:' $listingCache/$(basename $outPath | cut -c1-32).narinfo | cut -d' ' -f2)
+nix-store --dump $outPath | cmp - $nar
+
+# Upload a NAR through the in-memory code path (nix-store --import) as
+# well, and check that it can be read back.
+importCache=$TEST_ROOT/binary-cache-import
+rm -rf $importCache
+nix-store --export $outPath | nix-store --import --store "file://$importCache?compression=none"
+nar=$importCache/$(grep '^URL:' $importCache/$(basename $outPath | cut -c1-32).narinfo | cut -d' ' -f2)
+nix-store --dump $outPath | cmp - $nar
+nix path-info --store file://$importCache $outPath
+
 
 basicTests() {
 
@@ -52,6 +74,30 @@ export _NIX_FORCE_HTTP_BINARY_CACHE_STORE=1
 basicTests
 
 
+# Test the NAR info index. The individual .narinfo files are removed,
+# so substitution only works if the index is used.
+indexCache=$TEST_ROOT/binary-cache-index
+rm -rf $indexCache
+cp -r $cacheDir $indexCache
+mkdir $indexCache/narinfo-index
+for i in $indexCache/*.narinfo; do
+    (cat $i; echo) >> $indexCache/narinfo-index/$(basename $i | cut -c1)
+    rm $i
+done
+echo "NarInfoIndex: 1" >> $indexCache/nix-cache-info
+
+clearStore
+clearCacheCache
+
+(! nix-store --substituters "file://$indexCache" --no-require-sigs -r $outPath)
+
+clearCacheCache
+
+nix-store --substituters "file://$indexCache?narinfo-index-min-paths=1" --no-require-sigs -r $outPath
+
+[ -x $outPath/program ]
+
+
 # Test whether Nix notices if the NAR doesn't match the hash in the NAR info.
 clearStore
 
@@ -0,0 +1,41 @@
+source common.sh
+
+clearStore
+
+# Builds are recorded in the build history, and the worker reports
+# how long it expected the builds to take.
+nix-build dependencies.nix --no-out-link -v 2>&1 | tee $TEST_ROOT/log
+grep -q "expecting builds to take .* [1-3] derivations without build history" $TEST_ROOT/log
+grep -q "builds took .* s (predicted .* s)" $TEST_ROOT/log
+
+if [ -n "$(type -p sqlite3)" ]; then
+    [ "$(sqlite3 $NIX_STATE_DIR/db/db.sqlite "select count(*) from Builds where pname = 'dependencies-input' and success = 1")" -eq 2 ]
+fi
+
+# The second time around, the history is used.
+nix-collect-garbage
+nix-build dependencies.nix --no-out-link -v 2>&1 | tee $TEST_ROOT/log
+grep -q "expecting builds to take .* 0 derivations without build history" $TEST_ROOT/log
+
+# The history can be queried with 'nix build-stats'.
+nix build-stats | grep -q "^dependencies-input-1	2	0	"
+[ "$(nix build-stats --builds dependencies-input | wc -l)" -eq 4 ]
+nix build-stats --builds --json -n 1 | grep -q '"maxRSS":'
+nix build-stats --json dependencies | grep -q '"meanOutputSize":'
+
+# Other stores (including the daemon) don't provide the history.
+nix build-stats --store file://$TEST_ROOT/binary-cache 2>&1 | grep -q "does not keep a build history"
+
+# Repeated builds are recorded once per round. Only the last round,
+# which registers the outputs, knows their size.
+clearStore
+nix-build dependencies.nix --no-out-link --repeat 2
+[ "$(nix build-stats --builds dependencies-input-1 | wc -l)" -eq 3 ]
+[ "$(nix build-stats --builds --json dependencies-input-1 | grep -o '"outputSize":' | wc -l)" -eq 1 ]
+
+# Only the last 5 successful builds of a derivation are kept.
+for i in 1 2 3; do
+    nix-collect-garbage
+    nix-build dependencies.nix --no-out-link
+done
+[ "$(nix build-stats --builds dependencies-input-1 | wc -l)" -eq 5 ]
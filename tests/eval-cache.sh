@@ -0,0 +1,75 @@
+source common.sh
+
+clearStore
+
+rm -rf $TEST_ROOT/eval-cache
+mkdir -p $TEST_ROOT/eval-cache
+cp simple.nix simple.builder.sh config.nix $TEST_ROOT/eval-cache/
+cd $TEST_ROOT/eval-cache
+
+drvPath=$(nix-instantiate --eval-cache simple.nix)
+
+# The second evaluation should be served from the cache.
+nix-instantiate --eval-cache -v simple.nix 2>&1 | grep -q 'using cached evaluation result'
+[[ $(nix-instantiate --eval-cache simple.nix) = $drvPath ]]
+
+# Changing an imported file invalidates the cache entry.
+echo '# foo' >> config.nix
+(! nix-instantiate --eval-cache -v simple.nix 2>&1 | grep -q 'using cached evaluation result')
+
+# Repointing a symlinked input to a file with the same size and
+# modification time (as happens with channels, since everything in the
+# store has a modification time of 1) invalidates the cache entry.
+echo 'with import ./config.nix; mkDerivation { name = "a"; builder = ./simple.builder.sh; PATH = ""; }' > a.nix
+echo 'with import ./config.nix; mkDerivation { name = "b"; builder = ./simple.builder.sh; PATH = ""; }' > b.nix
+touch -d @1 a.nix b.nix
+ln -sfn a.nix link.nix
+drvPathA=$(nix-instantiate --eval-cache link.nix)
+nix-instantiate --eval-cache -v link.nix 2>&1 | grep -q 'using cached evaluation result'
+ln -sfn b.nix link.nix
+(! nix-instantiate --eval-cache -v link.nix 2>&1 | grep -q 'using cached evaluation result')
+[[ $(nix-instantiate --eval-cache link.nix) != $drvPathA ]]
+
+# Changing the arguments uses a different cache entry.
+(! nix-instantiate --eval-cache -v simple.nix --arg x 1 2>&1 | grep -q 'using cached evaluation result')
+
+# A directory copied to the store is tracked recursively.
+mkdir -p src/sub
+echo foo > src/sub/file
+expr='with import ./config.nix; mkDerivation { name = "d"; builder = ./simple.builder.sh; PATH = ""; src = ./src; }'
+nix-instantiate --eval-cache -E "$expr"
+nix-instantiate --eval-cache -v -E "$expr" 2>&1 | grep -q 'using cached evaluation result'
+echo bar > src/sub/file
+(! nix-instantiate --eval-cache -v -E "$expr" 2>&1 | grep -q 'using cached evaluation result')
+touch src/sub/new
+(! nix-instantiate --eval-cache -v -E "$expr" 2>&1 | grep -q 'using cached evaluation result')
+
+# The default.nix of a directory passed to scopedImport is tracked.
+mkdir -p dir
+echo 'with import ../config.nix; mkDerivation { name = "s"; builder = ../simple.builder.sh; PATH = ""; }' > dir/default.nix
+expr='builtins.scopedImport { x = 1; } ./dir'
+nix-instantiate --eval-cache -E "$expr"
+nix-instantiate --eval-cache -v -E "$expr" 2>&1 | grep -q 'using cached evaluation result'
+echo '# foo' >> dir/default.nix
+(! nix-instantiate --eval-cache -v -E "$expr" 2>&1 | grep -q 'using cached evaluation result')
+
+# Paths relative to the home directory depend on $HOME. (Keep the
+# cache directory fixed, since it defaults to one under $HOME.)
+mkdir -p home1 home2
+cp dir/default.nix home1/s.nix
+echo 'with import ../config.nix; mkDerivation { name = "h"; builder = ../simple.builder.sh; PATH = ""; }' > home2/s.nix
+drvPath1=$(XDG_CACHE_HOME=$TEST_HOME/.cache HOME=$PWD/home1 nix-instantiate --eval-cache -E 'import ~/s.nix')
+drvPath2=$(XDG_CACHE_HOME=$TEST_HOME/.cache HOME=$PWD/home2 nix-instantiate --eval-cache -E 'import ~/s.nix')
+[[ $drvPath1 != $drvPath2 ]]
+
+# Repairing bypasses the cache.
+(! nix-instantiate --eval-cache --repair -v simple.nix 2>&1 | grep -q 'using cached evaluation result')
+
+# Impure evaluations are not cached.
+nix-instantiate --eval-cache -E 'with import ./config.nix; mkDerivation { name = "t"; builder = ./simple.builder.sh; PATH = ""; t = builtins.currentTime; }'
+(! nix-instantiate --eval-cache -v -E 'with import ./config.nix; mkDerivation { name = "t"; builder = ./simple.builder.sh; PATH = ""; t = builtins.currentTime; }' 2>&1 | grep -q 'using cached evaluation result')
+
+# A garbage-collected derivation is not returned from the cache.
+nix-store --delete $drvPath
+drvPath2=$(nix-instantiate --eval-cache simple.nix)
+[[ -e $drvPath2 ]]
@@ -0,0 +1,36 @@
+source common.sh
+
+clearStore
+
+expr='let f = n: builtins.length (builtins.genList (x: x) n); in builtins.foldl'"'"' (x: y: x + f y) 0 (builtins.genList (x: x) 100)'
+
+nix-instantiate --eval --expr "$expr" \
+    --eval-profile-trace $TEST_ROOT/trace.json \
+    --eval-profile-folded $TEST_ROOT/folded
+
+# The Chrome trace contains complete events for functions and primops.
+grep -q '"traceEvents"' $TEST_ROOT/trace.json
+grep -q '"name":"primop genList"' $TEST_ROOT/trace.json
+grep -q "\"name\":\"'f' at (string):1:9\"" $TEST_ROOT/trace.json
+
+# Every line of the folded output is a stack followed by a count.
+(! grep -vE '^[^ ].* [0-9]+$' $TEST_ROOT/folded)
+grep -q "'f' at (string):1:9;primop length [0-9]*$" $TEST_ROOT/folded
+
+# In sampling mode, only the folded output is written.
+rm -f $TEST_ROOT/trace.json $TEST_ROOT/folded
+nix-instantiate --eval --expr "$expr" \
+    --eval-profile-trace $TEST_ROOT/trace.json \
+    --eval-profile-folded $TEST_ROOT/folded \
+    --eval-profile-sample-interval 100
+[[ -e $TEST_ROOT/folded ]]
+[[ ! -e $TEST_ROOT/trace.json ]]
+
+# Allocation profiling.
+nix-instantiate --eval --expr "$expr" \
+    --eval-alloc-profile $TEST_ROOT/alloc.pb \
+    --eval-alloc-profile-top 5 2> $TEST_ROOT/alloc-report
+grep -q "attrsets.*function" $TEST_ROOT/alloc-report
+grep -q "primop genList" $TEST_ROOT/alloc-report
+[[ -s $TEST_ROOT/alloc.pb ]]
+grep -qa alloc_space $TEST_ROOT/alloc.pb
@@ -0,0 +1,31 @@
+source common.sh
+
+clearStore
+
+drvPath=$(nix-instantiate dependencies.nix)
+outPath=$(nix-store -rvv "$drvPath")
+
+# Set a GC root.
+rm -f "$NIX_STATE_DIR"/gcroots/foo
+ln -sf $outPath "$NIX_STATE_DIR"/gcroots/foo
+
+# Delete the garbage one path at a time.
+nix-collect-garbage --option gc-incremental true --option gc-batch-size 1 2>&1 | tee $TEST_ROOT/gc.log
+grep -q 'GC lock held' $TEST_ROOT/gc.log
+
+# Check that the root and its dependencies haven't been deleted.
+cat $outPath/foobar
+cat $outPath/input-2/bar
+
+# Check that the derivation has been GC'd.
+if test -e $drvPath; then false; fi
+
+# The per-batch trash directories should be gone.
+(! ls $NIX_STORE_DIR | grep -q trash)
+
+rm "$NIX_STATE_DIR"/gcroots/foo
+
+nix-collect-garbage --option gc-incremental true --option gc-batch-size 1
+
+# Check that the output has been GC'd.
+if test -e $outPath/foobar; then false; fi
@@ -0,0 +1,17 @@
+# Wait until $barrier builders (including this one) have started, so
+# that they are known to be running at the same time.
+if [ -n "$barrier" ]; then
+    mkdir -p $shared.barrier
+    touch $shared.barrier/$text
+    n=0
+    while [ $(ls $shared.barrier | wc -l) -lt $barrier ]; do
+        n=$((n + 1))
+        if [ $n -gt 60 ]; then
+            echo "builders didn't run at the same time" >&2
+            exit 1
+        fi
+        sleep 1
+    done
+fi
+
+source $parallelBuilder
@@ -0,0 +1,15 @@
+{ salt, sleepTime ? 2, barrier ? "", texts ? [ "a" "b" "c" ] }:
+
+with import ./config.nix;
+
+let
+
+  mkDrv = text: mkDerivation {
+    name = "global-max-jobs-${salt}-${text}";
+    builder = ./global-max-jobs.builder.sh;
+    parallelBuilder = ./parallel.builder.sh;
+    inputs = [];
+    inherit text shared sleepTime barrier;
+  };
+
+in map mkDrv texts
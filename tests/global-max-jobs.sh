@@ -0,0 +1,30 @@
+source common.sh
+
+clearStore
+
+# Two nix-build processes that may run 10 builds each must share a
+# single machine-wide build slot.
+rm -f $_NIX_TEST_SHARED.cur $_NIX_TEST_SHARED.max
+
+nix-build -j10 --option global-max-jobs 1 global-max-jobs.nix --argstr salt 1 --no-out-link &
+pid1=$!
+
+nix-build -j10 --option global-max-jobs 1 global-max-jobs.nix --argstr salt 2 --no-out-link &
+pid2=$!
+
+wait $pid1 || fail "instance 1 failed: $?"
+wait $pid2 || fail "instance 2 failed: $?"
+
+if test "$(cat $_NIX_TEST_SHARED.cur)" != 0; then fail "wrong current process count"; fi
+if test "$(cat $_NIX_TEST_SHARED.max)" != 1; then fail "global-max-jobs was exceeded"; fi
+
+[[ -d $NIX_STATE_DIR/build-slots ]]
+
+# With a limit of 2, two builds can run at the same time. The builders
+# wait for each other, so this fails if they don't.
+rm -rf $_NIX_TEST_SHARED.cur $_NIX_TEST_SHARED.max $_NIX_TEST_SHARED.barrier
+
+nix-build -j10 --option global-max-jobs 2 global-max-jobs.nix --argstr salt 3 \
+    --argstr barrier 2 --arg texts '[ "a" "b" ]' --no-out-link
+
+if test "$(cat $_NIX_TEST_SHARED.max)" -gt 2; then fail "global-max-jobs was exceeded"; fi
@@ -0,0 +1,18 @@
+let
+  drv = derivation {
+    name = "concat-context";
+    builder = "/bin/false";
+    system = "x86_64-linux";
+  };
+
+  s1 = "a${drv}b";
+  s2 = "${s1}c${s1}";
+  s3 = "${s2}${drv.drvPath}";
+
+  contextOf = s: builtins.attrValues (builtins.getContext s);
+in
+  [ (builtins.stringLength s2 == 2 * builtins.stringLength s1 + 1)
+    (contextOf s2)
+    (contextOf s3)
+    (builtins.hasContext "${"x"}${toString 1}")
+  ]
@@ -0,0 +1,11 @@
+# Updates of large sets with small ones produce layered sets; check
+# that lookups and iteration see the right attributes.
+let
+  big = builtins.listToAttrs (map (n: { name = "a${toString n}"; value = n; }) (builtins.genList (x: x) 100));
+  s1 = big // { a5 = "x"; b = 1; };
+  s2 = s1 // { a7 = "y"; };
+  s3 = builtins.foldl' (s: n: s // { "c${toString n}" = n; }) s2 (builtins.genList (x: x) 20);
+in
+  [ s2.a5 s2.a7 s2.a8 s2.b (s2 ? c0) (builtins.length (builtins.attrNames s2))
+    s3.a5 s3.c19 (builtins.length (builtins.attrNames s3))
+    (builtins.attrNames (removeAttrs s3 (builtins.attrNames big))) ]
@@ -6,6 +6,7 @@ nix_tests = \
   gc.sh \
   gc-concurrent.sh \
   gc-auto.sh \
+  gc-incremental.sh \
   referrers.sh user-envs.sh logging.sh nix-build.sh misc.sh fixed.sh \
   gc-runtime.sh check-refs.sh filter-source.sh \
   remote-store.sh export.sh export-graph.sh \
@@ -24,13 +25,21 @@ nix_tests = \
   signing.sh \
   run.sh \
   brotli.sh \
+  zstd.sh \
   pure-eval.sh \
   check.sh \
   plugins.sh \
   search.sh \
   nix-copy-ssh.sh \
   post-hook.sh \
-  function-trace.sh
+  function-trace.sh \
+  eval-cache.sh \
+  parse-cache.sh \
+  eval-profile.sh \
+  refscan.sh \
+  build-history.sh \
+  global-max-jobs.sh \
+  lock-wakeup.sh
   # parallel.sh
 
 install-tests += $(foreach x, $(nix_tests), tests/$(x))
@@ -39,4 +48,4 @@ tests-environment = NIX_REMOTE= $(bash) -e
 
 clean-files += $(d)/common.sh
 
-installcheck: $(d)/common.sh $(d)/plugins/libplugintest.$(SO_EXT)
+installcheck: $(d)/common.sh $(d)/plugins/libplugintest.$(SO_EXT) $(d)/refscan-bench/refscan-bench
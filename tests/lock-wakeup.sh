@@ -0,0 +1,22 @@
+source common.sh
+
+clearStore
+
+# A build that finds its output locked by another process resumes as
+# soon as the lock is released, rather than after build-poll-interval.
+expr='with import ./config.nix; mkDerivation { name = "lock-wakeup"; buildCommand = "sleep 3; touch $out"; }'
+
+SECONDS=0
+
+nix-build -E "$expr" --no-out-link --option build-poll-interval 60 2> $TEST_ROOT/lock-wakeup1.log &
+pid1=$!
+
+nix-build -E "$expr" --no-out-link --option build-poll-interval 60 2> $TEST_ROOT/lock-wakeup2.log &
+pid2=$!
+
+wait $pid1 || fail "instance 1 failed: $?"
+wait $pid2 || fail "instance 2 failed: $?"
+
+cat $TEST_ROOT/lock-wakeup[12].log | grep -q 'waiting for locks' || fail "neither build waited for the output lock"
+
+if (( SECONDS >= 30 )); then fail "waiting build did not resume when the lock was released"; fi
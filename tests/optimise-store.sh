@@ -35,9 +35,64 @@ if [ "$inode1" != "$inode3" ]; then
     exit 1
 fi
 
+# Paths optimised by a previous run are skipped, but new paths are
+# still linked.
+test -e $NIX_STATE_DIR/db/optimise-index.sqlite
+
+outPath4=$(echo 'with import ./config.nix; mkDerivation { name = "foo4"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo"; }' | nix-build - --no-out-link)
+
+skipped=$(nix-store --optimise -v 2>&1 | sed -n 's/^skipped \([0-9]*\) paths that were already optimised$/\1/p')
+if [ -z "$skipped" ] || (( skipped < 3 )); then
+    echo "paths optimised by a previous run were not skipped"
+    exit 1
+fi
+
+inode4="$(stat --format=%i $outPath4/foo)"
+if [ "$inode1" != "$inode4" ]; then
+    echo "inodes do not match"
+    exit 1
+fi
+
 nix-store --gc
 
 if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then
     echo ".links directory not empty after GC"
     exit 1
 fi
+
+# The file hashes computed while scanning build outputs for references
+# must match the ones computed by the optimiser itself.
+outPath5=$(echo 'with import ./config.nix; mkDerivation { name = "foo5"; builder = builtins.toFile "builder" "mkdir -p $out/bin; echo hello > $out/bin/foo; chmod +x $out/bin/foo"; }' | nix-build - --no-out-link --auto-optimise-store)
+
+hash5=$(nix-hash --type sha256 --base32 $outPath5/bin/foo)
+inode5="$(stat --format=%i $outPath5/bin/foo)"
+if [ "$inode5" != "$(stat --format=%i $NIX_STORE_DIR/.links/$hash5)" ]; then
+    echo "file not linked under its NAR hash"
+    exit 1
+fi
+
+# Files hashed by a previous run are not hashed again, even though
+# linking them changed their ctime.
+outPath6=$(echo 'with import ./config.nix; mkDerivation { name = "foo6"; builder = builtins.toFile "builder" "mkdir $out; echo foo6a > $out/a; echo foo6b > $out/b"; }' | nix-build - --no-out-link)
+
+nix-store --optimise
+
+hash6=$(nix-hash --type sha256 --base32 $outPath6/a)
+rm $NIX_STORE_DIR/.links/*
+chmod u+w $outPath6
+chmod u-w $outPath6
+
+outPath7=$(echo 'with import ./config.nix; mkDerivation { name = "foo7"; builder = builtins.toFile "builder" "mkdir $out; echo foo7 > $out/a"; }' | nix-build - --no-out-link)
+
+nix-store --optimise --debug 2> $TEST_ROOT/optimise.log
+
+if grep -q "hashing '.*$(basename $outPath6)/" $TEST_ROOT/optimise.log; then
+    echo "unchanged files were hashed again"
+    exit 1
+fi
+grep -q "hashing '.*$(basename $outPath7)/a'" $TEST_ROOT/optimise.log
+
+if [ "$(stat --format=%i $outPath6/a)" != "$(stat --format=%i $NIX_STORE_DIR/.links/$hash6)" ]; then
+    echo "file not linked again"
+    exit 1
+fi
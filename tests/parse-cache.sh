@@ -0,0 +1,66 @@
+source common.sh
+
+export TEST_VAR=foo # for eval-okay-getenv.nix
+
+rm -rf $TEST_HOME/.cache/nix/parse-cache-v1
+
+set +x
+
+fail=0
+
+# Evaluate every language test twice with the parse cache enabled.
+# The second evaluation uses the deserialised parse trees, and must
+# produce the same result.
+for i in lang/eval-okay-*.nix; do
+    i=$(basename $i .nix)
+    test -e lang/$i.exp || continue
+
+    flags=
+    if test -e lang/$i.flags; then
+        flags=$(cat lang/$i.flags)
+    fi
+
+    for pass in 1 2; do
+        echo "evaluating $i with parse cache (pass $pass)"
+        if ! NIX_PATH=lang/dir3:lang/dir4 nix-instantiate --parse-cache $flags --eval --strict lang/$i.nix > $TEST_ROOT/$i.out; then
+            echo "FAIL: $i should evaluate"
+            fail=1
+        elif ! diff $TEST_ROOT/$i.out lang/$i.exp; then
+            echo "FAIL: evaluation result of $i not as expected"
+            fail=1
+        fi
+    done
+done
+
+[[ -n $(ls $TEST_HOME/.cache/nix/parse-cache-v1) ]]
+
+NIX_SHOW_STATS=1 nix-instantiate --parse-cache --eval lang/eval-okay-let.nix 2>&1 >/dev/null | grep -qE '"cacheHits": ?[1-9]'
+
+# Corrupt or unreadable cache entries are treated as cache misses. Each
+# entry is replaced by a variable 'foo' with an out-of-range level.
+cacheDir=$TEST_HOME/.cache/nix/parse-cache-v1
+for i in $cacheDir/*; do
+    printf '1\nnixast01\x01\x03foo\x06\x00\x01\x00\x01\x00\x05\x09' > $i
+done
+[[ $(nix-instantiate --parse-cache --eval lang/eval-okay-let.nix) = '"foobar"' ]]
+for i in $cacheDir/*; do
+    rm -f $i
+    mkdir $i
+done
+[[ $(nix-instantiate --parse-cache --eval lang/eval-okay-let.nix) = '"foobar"' ]]
+rm -rf $cacheDir
+
+# Entries that haven't been used for 'parse-cache-max-age' seconds are
+# removed when a new entry is added. Entries that are used are kept.
+nix-instantiate --parse-cache --eval lang/eval-okay-let.nix
+touch -d '2 months ago' $cacheDir/unused $cacheDir/.last-prune
+echo '"unused"' > $TEST_ROOT/prune.nix
+nix-instantiate --parse-cache --eval $TEST_ROOT/prune.nix
+[[ ! -e $cacheDir/unused ]]
+[[ -n $(ls $cacheDir) ]]
+touch -d '2 months ago' $cacheDir/*
+[[ $(nix-instantiate --parse-cache --eval $TEST_ROOT/prune.nix) = '"unused"' ]]
+[[ -n $(find $cacheDir -type f -newermt '1 day ago') ]]
+rm -rf $cacheDir
+
+exit $fail
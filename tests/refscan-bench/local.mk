@@ -0,0 +1,11 @@
+programs += refscan-bench
+
+refscan-bench_DIR := $(d)
+
+refscan-bench_NO_INSTALL := 1
+
+refscan-bench_SOURCES := $(d)/refscan-bench.cc
+
+refscan-bench_LIBS = libstore libutil
+
+refscan-bench_LDFLAGS = -pthread
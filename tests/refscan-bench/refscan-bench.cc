@@ -0,0 +1,129 @@
+/* Microbenchmark for the reference scanner. It generates a synthetic
+   NAR containing binary data, base-32 heavy text and embedded store
+   path hashes, and reports how fast RefScanSink processes it. With
+   '--check', it also compares the result with a straightforward
+   scanner, using random write sizes to exercise references spanning
+   two writes. */
+
+#include "references.hh"
+#include "archive.hh"
+#include "hash.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+
+using namespace nix;
+
+
+static std::string randomHash(std::mt19937_64 & rng)
+{
+    std::string s;
+    for (int i = 0; i < 32; ++i)
+        s.push_back(base32Chars[rng() % base32Chars.size()]);
+    return s;
+}
+
+
+/* The obvious implementation: look at every window. */
+static StringSet naiveScan(const std::string & data, const StringSet & hashes)
+{
+    StringSet found;
+    for (size_t i = 0; i + 32 <= data.size(); ++i) {
+        auto s = data.substr(i, 32);
+        if (hashes.count(s)) found.insert(s);
+    }
+    return found;
+}
+
+
+int main(int argc, char * * argv)
+{
+    try {
+        size_t size = 256, nrRefs = 100, iterations = 5;
+        bool check = false;
+
+        for (int n = 1; n < argc; ++n) {
+            std::string arg = argv[n];
+            auto next = [&]() {
+                if (++n == argc) throw Error("'%s' requires an argument", arg);
+                return std::stoull(argv[n]);
+            };
+            if (arg == "--check") check = true;
+            else if (arg == "--size") size = next();
+            else if (arg == "--refs") nrRefs = next();
+            else if (arg == "--iterations") iterations = next();
+            else throw Error("unknown argument '%s'", arg);
+        }
+
+        std::mt19937_64 rng(42);
+
+        /* Only half of the hashes we look for actually occur. */
+        StringSet hashes;
+        std::vector<std::string> present;
+        while (hashes.size() < nrRefs) {
+            auto h = randomHash(rng);
+            if (hashes.insert(h).second && hashes.size() % 2)
+                present.push_back(h);
+        }
+
+        /* Alternate between random bytes (like compiled code) and
+           text made of base-32 characters and store paths (like
+           scripts or pkg-config files). */
+        std::string contents;
+        contents.reserve(size << 20);
+        while (contents.size() < size << 20) {
+            size_t len = 1 + rng() % 65536;
+            if (rng() % 2)
+                for (size_t i = 0; i < len; ++i)
+                    contents.push_back((char) rng());
+            else
+                while (len > 0) {
+                    std::string word = rng() % 8 == 0 && !present.empty()
+                        ? "/nix/store/" + present[rng() % present.size()] + "-foo/bin"
+                        : randomHash(rng).substr(0, 1 + rng() % 40);
+                    contents += word + " ";
+                    len -= std::min(len, word.size() + 1);
+                }
+        }
+
+        StringSink nar;
+        dumpString(contents, nar);
+        auto & data = *nar.s;
+
+        if (check) {
+            auto expected = naiveScan(data, hashes);
+            for (size_t i = 0; i < iterations; ++i) {
+                RefScanSink sink(hashes);
+                for (size_t pos = 0; pos < data.size(); ) {
+                    size_t n = std::min(data.size() - pos, (size_t) (rng() % 200));
+                    sink((const unsigned char *) data.data() + pos, n);
+                    pos += n;
+                }
+                if (sink.getFound() != expected)
+                    throw Error("reference scanner found %d hashes, expected %d",
+                        sink.getFound().size(), expected.size());
+            }
+            std::cout << fmt("found %d of %d hashes, as expected\n", expected.size(), hashes.size());
+        }
+
+        /* Time the scanner with the write size used by dumpPath(). */
+        double best = 0;
+        for (size_t i = 0; i < iterations; ++i) {
+            auto before = std::chrono::steady_clock::now();
+            RefScanSink sink(hashes);
+            for (size_t pos = 0; pos < data.size(); pos += 65536)
+                sink((const unsigned char *) data.data() + pos, std::min(data.size() - pos, (size_t) 65536));
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - before).count();
+            best = std::max(best, data.size() / secs / 1e9);
+        }
+
+        std::cout << fmt("scanned %d MiB for %d hashes at %.2f GB/s\n", size, hashes.size(), best);
+
+        return 0;
+    } catch (std::exception & e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,5 @@
+source common.sh
+
+# Check the reference scanner against a naive implementation, with
+# references spanning writes.
+$PWD/refscan-bench/refscan-bench --check --size 4 --refs 50 --iterations 3
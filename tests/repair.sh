@@ -5,7 +5,10 @@ clearStore
 path=$(nix-build dependencies.nix -o $TEST_ROOT/result)
 path2=$(nix-store -qR $path | grep input-2)
 
-nix-store --verify --check-contents -v
+nix-store --verify --check-contents -v --option verify-jobs 2 --option verify-max-rate 100000000
+
+# A completed check removes its checkpoint.
+(! test -e $NIX_STATE_DIR/verify-checkpoint)
 
 hash=$(nix-hash $path2)
 
@@ -18,6 +21,16 @@ if nix-store --verify --check-contents -v; then
     exit 1
 fi
 
+# A checkpoint is only used when resuming explicitly.
+echo "$path2 $(nix-store -q --hash $path2)" > $NIX_STATE_DIR/verify-checkpoint
+(! nix-store --verify --check-contents)
+(! test -e $NIX_STATE_DIR/verify-checkpoint)
+
+# A resumed check skips the paths recorded in the checkpoint.
+echo "$path2 $(nix-store -q --hash $path2)" > $NIX_STATE_DIR/verify-checkpoint
+nix-store --verify --check-contents --resume
+(! test -e $NIX_STATE_DIR/verify-checkpoint)
+
 # The path can be repaired by rebuilding the derivation.
 nix-store --verify --check-contents --repair
 
@@ -41,3 +41,21 @@ clearCache
 nix search|grep -q foo
 nix search|grep -q bar
 nix search|grep -q hello
+
+## Parallel evaluation
+
+# Evaluating the package set in worker processes gives the same results.
+diff <(nix search -f search.nix --no-cache --json) <(nix search -f search.nix --no-cache --json --eval-workers 3)
+
+# The cache written by the workers is equivalent, too.
+nix search -f search.nix -u --eval-workers 3 > /dev/null
+(( $(nix search foo | wc -l) > 0 ))
+(( $(nix search broken | wc -l) > 0 ))
+
+# So does 'nix-env -qa', including for derivations bound to several
+# attributes, which are only listed once.
+echo "let s = import $PWD/search.nix; in s // { hello2 = s.hello; }" > $TEST_ROOT/search-alias.nix
+for flags in "-P --out-path --drv-path --system" "--description" "--meta --xml"; do
+    diff <(nix-env -f $TEST_ROOT/search-alias.nix -qa $flags) <(nix-env -f $TEST_ROOT/search-alias.nix -qa $flags --option eval-workers 3)
+done
+(( $(nix-env -f $TEST_ROOT/search-alias.nix -qa --option eval-workers 3 | wc -l) == 3 ))
@@ -0,0 +1,41 @@
+source common.sh
+
+clearStore
+clearCache
+
+cacheURI="file://$cacheDir?compression=zstd&compression-level=19&zstd-long-distance-matching=1"
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+nix copy --to $cacheURI $outPath
+
+HASH=$(nix hash-path $outPath)
+
+clearStore
+clearCacheCache
+
+nix copy --from $cacheURI $outPath --no-check-sigs
+
+HASH2=$(nix hash-path $outPath)
+
+[[ $HASH = $HASH2 ]]
+
+# Check that the end of a large, highly compressible NAR isn't lost.
+clearStore
+clearCache
+
+seq 1 1000000 > $TEST_ROOT/big
+bigPath=$(nix-store --add $TEST_ROOT/big)
+
+nix copy --to $cacheURI $bigPath
+
+HASH=$(nix hash-path $bigPath)
+
+clearStore
+clearCacheCache
+
+nix copy --from $cacheURI $bigPath --no-check-sigs
+
+HASH2=$(nix hash-path $bigPath)
+
+[[ $HASH = $HASH2 ]]